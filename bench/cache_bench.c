@@ -0,0 +1,233 @@
+// Cache micro-benchmark: find_in_cache(), add_to_cache() and
+// remove_lru_element() at several fill levels and thread counts.
+//
+//   make bench/cache_bench
+//   ./bench/cache_bench [object-bytes] [lru|clock|gdsf]
+//
+// The proxy is built into this program (without its main()) so the
+// benchmark drives the real shards, index and slab allocator.
+
+#define PROXY_NO_MAIN
+#include "../lru_proxy_with_cache.c"
+
+#define BENCH_OBJECT_BYTES 4096
+#define BENCH_FIND_OPS 1000000          // Lookups per measurement, split across threads
+#define BENCH_ADD_OPS 16384             // Inserts per measurement
+#define BENCH_REMOVE_OPS 16384          // Most evictions per measurement
+#define BENCH_MAX_THREADS 64
+
+static const int bench_fill_levels[] = { 25, 50, 90, 100 };
+static const int bench_thread_counts[] = { 1, 2, 4, 8, 16 };
+
+#define BENCH_FILL_LEVEL_COUNT (int)(sizeof(bench_fill_levels) / sizeof(bench_fill_levels[0]))
+#define BENCH_THREAD_COUNT_COUNT (int)(sizeof(bench_thread_counts) / sizeof(bench_thread_counts[0]))
+
+enum { BENCH_FIND, BENCH_ADD, BENCH_REMOVE };
+
+typedef struct bench_worker {
+    pthread_t thread;
+    int op;
+    int index;
+    int ops;
+    int first_key;                  // BENCH_ADD: first new key of this thread
+    int resident;                   // BENCH_FIND: keys [0, resident) were added
+    long hits;
+    double start;                   // Measured by the thread itself, the main
+    double end;                     // thread may not run again until it is done
+    cache_fill* fills;              // BENCH_ADD: built before the clock starts
+} bench_worker;
+
+static int bench_object_bytes = BENCH_OBJECT_BYTES;
+static char* bench_response;
+static int bench_response_len;
+static pthread_barrier_t bench_start;
+
+static void bench_key(cache_key* key, int id) {
+    key->len = snprintf(key->str, sizeof(key->str), "GET http://bench.example:80/objects/%d", id);
+    key->hash = cache_hash(key->str, key->len);
+}
+
+static int bench_fill(cache_fill* fill) {
+    cache_fill_init(fill);
+    if (cache_fill_append(fill, bench_response, bench_response_len) < 0) return -1;
+    cache_fill_check(fill, 1);
+    return fill->abandoned ? -1 : 0;
+}
+
+static int bench_add(int id) {
+    cache_fill fill;
+    cache_key key;
+    if (bench_fill(&fill) < 0) return -1;
+    bench_key(&key, id);
+    if (!add_to_cache(&fill, &key, NULL)) {
+        cache_fill_abandon(&fill);
+        return -1;
+    }
+    return 0;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* bench_thread(void* arg) {
+    bench_worker* worker = (bench_worker*)arg;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (worker->index + 1);
+
+    if (worker->op == BENCH_ADD) {
+        worker->fills = (cache_fill*)malloc(worker->ops * sizeof(cache_fill));
+        for (int i = 0; worker->fills && i < worker->ops; i++) {
+            bench_fill(&worker->fills[i]);
+        }
+    }
+    pthread_barrier_wait(&bench_start);
+    worker->start = now_ns();
+
+    for (int i = 0; i < worker->ops; i++) {
+        if (worker->op == BENCH_FIND) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            cache_key key;
+            int freshness;
+            bench_key(&key, rng % worker->resident);
+            cache_element* element = find_in_cache(&key, &freshness);
+            if (element) {
+                worker->hits++;
+                release_cache_element(element);
+            }
+        } else if (worker->op == BENCH_ADD) {
+            if (!worker->fills) break;
+            cache_key key;
+            bench_key(&key, worker->first_key + i);
+            if (add_to_cache(&worker->fills[i], &key, NULL)) {
+                worker->hits++;
+            } else {
+                cache_fill_abandon(&worker->fills[i]);
+            }
+        } else {
+            remove_lru_element();
+        }
+    }
+
+    worker->end = now_ns();
+    free(worker->fills);
+    slab_thread_flush();
+    return NULL;
+}
+
+// Run ops operations split across threads, returns millions of operations per second
+static double bench_run(int op, int threads, int ops, int resident, int first_key, long* hits) {
+    bench_worker workers[BENCH_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    pthread_barrier_init(&bench_start, NULL, threads + 1);
+
+    for (int t = 0; t < threads; t++) {
+        workers[t].op = op;
+        workers[t].index = t;
+        workers[t].ops = ops / threads;
+        workers[t].resident = resident > 0 ? resident : 1;
+        workers[t].first_key = first_key + t * (ops / threads);
+        if (pthread_create(&workers[t].thread, NULL, bench_thread, &workers[t]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&bench_start);
+    double start = 0, end = 0;
+    *hits = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        *hits += workers[t].hits;
+        if (t == 0 || workers[t].start < start) start = workers[t].start;
+        if (workers[t].end > end) end = workers[t].end;
+    }
+    pthread_barrier_destroy(&bench_start);
+
+    return (ops / threads) * threads / ((end - start) / 1e3);
+}
+
+// Evict everything so each measurement starts from the same state
+static void bench_drain() {
+    while (cache_total_size() > 0) {
+        remove_lru_element();
+    }
+}
+
+// Add keys until the cache holds percent of its budget, returns the key count
+static int bench_fill_to(int percent) {
+    long target = (long)MAX_SIZE / 100 * percent;
+    int id = 0;
+    while (cache_total_size() < target) {
+        if (bench_add(id) < 0) {
+            fprintf(stderr, "Fill failed at key %d\n", id);
+            exit(1);
+        }
+        id++;
+        // A full cache evicts as it goes, stop once it no longer grows
+        if (percent >= 100 && id > (long)MAX_SIZE / bench_object_bytes) break;
+    }
+    return id;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) bench_object_bytes = atoi(argv[1]);
+    if (argc > 2) {
+        if (strcmp(argv[2], "lru") == 0) config.cache_policy = CACHE_POLICY_LRU;
+        else if (strcmp(argv[2], "clock") == 0) config.cache_policy = CACHE_POLICY_CLOCK;
+        else if (strcmp(argv[2], "gdsf") == 0) config.cache_policy = CACHE_POLICY_GDSF;
+        else bench_object_bytes = 0;
+    }
+    if (bench_object_bytes <= 0 || bench_object_bytes > MAX_ELEMENT_SIZE / 2) {
+        fprintf(stderr, "Usage: %s [object-bytes] [lru|clock|gdsf]\n", argv[0]);
+        return 1;
+    }
+
+    bench_response = (char*)malloc(bench_object_bytes + 256);
+    bench_response_len = sprintf(bench_response, "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n"
+                                 "Content-Length: %d\r\n\r\n", bench_object_bytes);
+    memset(bench_response + bench_response_len, 'x', bench_object_bytes);
+    bench_response_len += bench_object_bytes;
+
+    init_cache();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Policy: %s, %d shards, %d MB cache, %d byte objects, %ld CPUs\n\n",
+           config.cache_policy == CACHE_POLICY_GDSF ? "gdsf" :
+           config.cache_policy == CACHE_POLICY_CLOCK ? "clock" : "lru",
+           cache_shard_count, MAX_SIZE / (1024 * 1024), bench_object_bytes, cpus);
+    printf("%-6s %8s %8s %12s %7s %12s %12s\n", "fill", "objects", "threads", "find Mops/s", "hit%",
+           "add Mops/s", "evict Mops/s");
+
+    for (int f = 0; f < BENCH_FILL_LEVEL_COUNT; f++) {
+        for (int t = 0; t < BENCH_THREAD_COUNT_COUNT; t++) {
+            int threads = bench_thread_counts[t];
+            if (threads > BENCH_MAX_THREADS) continue;
+            long hits, added, evicted;
+
+            bench_drain();
+            int resident = bench_fill_to(bench_fill_levels[f]);
+            size_t objects = 0;
+            for (int s = 0; s < cache_shard_count; s++) objects += cache_shards[s].count;
+            size_t filled = objects;
+            double find = bench_run(BENCH_FIND, threads, BENCH_FIND_OPS, resident, 0, &hits);
+
+            // Inserts land on top of the fill level, evicting once the cache is full
+            double add = bench_run(BENCH_ADD, threads, BENCH_ADD_OPS, resident, resident, &added);
+
+            // Evict at most half of what is cached so every call finds a victim
+            objects = 0;
+            for (int s = 0; s < cache_shard_count; s++) objects += cache_shards[s].count;
+            int removals = objects / 2 < BENCH_REMOVE_OPS ? objects / 2 : BENCH_REMOVE_OPS;
+            double evict = bench_run(BENCH_REMOVE, threads, removals, resident, 0, &evicted);
+
+            printf("%5d%% %8zu %8d %12.2f %6.1f%% %12.2f %12.2f\n", bench_fill_levels[f], filled, threads,
+                   find, 100.0 * hits / (BENCH_FIND_OPS / threads * threads), add, evict);
+        }
+    }
+
+    bench_drain();
+    return 0;
+}
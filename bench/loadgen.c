@@ -0,0 +1,543 @@
+// End-to-end load generator with a built-in mock origin.
+//
+//   make bench/loadgen
+//   ./proxy_server 8080 &
+//   ./bench/loadgen --proxy=127.0.0.1:8080 --connections=1000 --dist=zipf
+//
+// Every connection is a client thread sending keep-alive GETs through the
+// proxy for objects of the mock origin, which this program serves on
+// --origin-port. Requests the origin never saw were hits, which gives the
+// hit ratio without relying on the proxy's own accounting. Reports
+// throughput, latency percentiles, hit ratio and errors.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define LOADGEN_THREAD_STACK (128 * 1024) // Client and origin threads need little stack
+#define LOADGEN_BUF_SIZE 65536
+#define LOADGEN_MAX_HEADER 8192
+#define LOADGEN_SINK_SIZE 16384         // Bodies are read and dropped in pieces this large
+#define LOADGEN_CLOSED -2               // read_response(): closed before the response started
+#define LOADGEN_TIMEOUT 10              // Seconds before a stalled response counts as an error
+
+enum { DIST_ZIPF, DIST_UNIFORM, DIST_SCAN };
+
+// Runtime configuration, overridable from the command line
+struct {
+    const char* proxy_host;
+    int proxy_port;
+    int origin_port;
+    int connections;
+    int duration;                   // Seconds of measurement after the warm-up
+    int warmup;                     // Seconds of load before measuring
+    int keys;
+    int dist;
+    double zipf_s;
+    int object_size;
+    int origin_delay_ms;            // Added to every origin response
+    int keepalive;
+} config = {
+    .proxy_host = "127.0.0.1",
+    .proxy_port = 8080,
+    .origin_port = 9090,
+    .connections = 64,
+    .duration = 10,
+    .warmup = 2,
+    .keys = 10000,
+    .dist = DIST_ZIPF,
+    .zipf_s = 0.99,
+    .object_size = 1024,
+    .origin_delay_ms = 0,
+    .keepalive = 1,
+};
+
+// Latencies of one client thread, in microseconds
+typedef struct latency_log {
+    long* usec;
+    long count;
+    long cap;
+} latency_log;
+
+typedef struct client {
+    pthread_t thread;
+    int index;
+    uint64_t rng;
+    long requests;                  // Completed while measuring
+    long errors;
+    long reconnects;
+    latency_log latencies;
+} client;
+
+static struct sockaddr_in proxy_addr;
+static double* zipf_cdf;            // Cumulative key probabilities
+static long scan_next;              // Next key of the sequential scan (atomic)
+static volatile int measuring;
+static volatile int running = 1;
+static long origin_requests;        // Served while measuring (atomic)
+static char* origin_body;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Zipf keys by binary search over the cumulative distribution, key 0 being
+// the most popular
+static int zipf_init() {
+    zipf_cdf = (double*)malloc(config.keys * sizeof(double));
+    if (!zipf_cdf) return -1;
+    double sum = 0;
+    for (int k = 0; k < config.keys; k++) {
+        sum += 1.0 / pow(k + 1, config.zipf_s);
+        zipf_cdf[k] = sum;
+    }
+    for (int k = 0; k < config.keys; k++) {
+        zipf_cdf[k] /= sum;
+    }
+    return 0;
+}
+
+static int next_key(client* c) {
+    if (config.dist == DIST_SCAN) {
+        return __atomic_fetch_add(&scan_next, 1, __ATOMIC_RELAXED) % config.keys;
+    }
+    uint64_t r = next_random(&c->rng);
+    if (config.dist == DIST_UNIFORM) {
+        return r % config.keys;
+    }
+    double u = (r >> 11) * (1.0 / 9007199254740992.0);
+    int low = 0, high = config.keys - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static void latency_add(latency_log* log, long usec) {
+    if (log->count == log->cap) {
+        long cap = log->cap ? log->cap * 2 : 4096;
+        long* usecs = (long*)realloc(log->usec, cap * sizeof(long));
+        if (!usecs) return;
+        log->usec = usecs;
+        log->cap = cap;
+    }
+    log->usec[log->count++] = usec;
+}
+
+static int compare_long(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int send_all(int fd, const char* data, int len, int flags) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL | flags);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Case-insensitive header lookup in a NUL-terminated header block
+static const char* header_value(const char* headers, const char* name) {
+    int len = strlen(name);
+    for (const char* line = strstr(headers, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, len) == 0 && line[2 + len] == ':') {
+            const char* value = line + 3 + len;
+            while (*value == ' ') value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// Read one response, keeping bytes past its end in buf. Returns the status
+// code, LOADGEN_CLOSED if the connection closed before any of it arrived,
+// or -1 on failure; close_after is set if the connection cannot be reused.
+static int read_response(int fd, char* buf, int* buffered, int* close_after) {
+    char* header_end;
+    while (!(header_end = memmem(buf, *buffered, "\r\n\r\n", 4))) {
+        if (*buffered >= LOADGEN_MAX_HEADER) return -1;
+        ssize_t received = recv(fd, buf + *buffered, LOADGEN_BUF_SIZE - 1 - *buffered, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received == 0 && *buffered == 0) return LOADGEN_CLOSED;
+        if (received <= 0) return -1;
+        *buffered += received;
+    }
+
+    int header_len = header_end - buf + 4;
+    char saved = buf[header_len - 2];
+    buf[header_len - 2] = '\0';
+    int status = strncmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : -1;
+    const char* length = header_value(buf, "Content-Length");
+    const char* connection = header_value(buf, "Connection");
+    *close_after = !length || (connection && strncasecmp(connection, "close", 5) == 0);
+    long body = length ? atol(length) : -1;
+    buf[header_len - 2] = saved;
+
+    // Without a length the body runs to the end of the connection
+    long remaining = -1;
+    if (body >= 0 && *buffered - header_len >= body) {
+        *buffered -= header_len + body;
+        memmove(buf, buf + header_len + body, *buffered);
+        remaining = 0;
+    } else if (body >= 0) {
+        remaining = body - (*buffered - header_len);
+        *buffered = 0;
+    } else {
+        *buffered = 0;
+    }
+    while (remaining != 0) {
+        char sink[LOADGEN_SINK_SIZE];
+        ssize_t received = recv(fd, sink, remaining > 0 && remaining < (long)sizeof(sink) ? remaining : (long)sizeof(sink), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return body < 0 ? status : -1;
+        if (remaining > 0) remaining -= received;
+    }
+    return status;
+}
+
+static int connect_proxy() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    struct timeval timeout = { LOADGEN_TIMEOUT, 0 };
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* client_thread(void* arg) {
+    client* c = (client*)arg;
+    char* buf = (char*)malloc(LOADGEN_BUF_SIZE);
+    int fd = -1, buffered = 0, reused = 0;
+
+    while (running && buf) {
+        if (fd < 0) {
+            fd = connect_proxy();
+            buffered = 0;
+            if (fd < 0) {
+                if (measuring) c->errors++;
+                usleep(10000);
+                continue;
+            }
+            if (measuring) c->reconnects++;
+        }
+
+        char request[512];
+        int len = snprintf(request, sizeof(request),
+                           "GET http://127.0.0.1:%d/objects/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n%s\r\n",
+                           config.origin_port, next_key(c), config.origin_port,
+                           config.keepalive ? "" : "Connection: close\r\n");
+
+        int counted = measuring;
+        double start = now_sec();
+        int close_after = 1;
+        int status = send_all(fd, request, len, 0) < 0 ? -1 : read_response(fd, buf, &buffered, &close_after);
+
+        // Closed before any of the response arrived: the proxy ended the
+        // persistent connection, retry once on a new one as browsers do
+        if (status == LOADGEN_CLOSED && reused) {
+            close(fd);
+            fd = connect_proxy();
+            buffered = 0;
+            if (measuring) c->reconnects++;
+            status = fd < 0 || send_all(fd, request, len, 0) < 0 ? -1 : read_response(fd, buf, &buffered, &close_after);
+        }
+        long usec = (now_sec() - start) * 1e6;
+
+        if (counted && measuring) {
+            if (status == 200) {
+                c->requests++;
+                latency_add(&c->latencies, usec);
+            } else {
+                c->errors++;
+            }
+        }
+        if (status < 0 || close_after || !config.keepalive) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+        reused = fd >= 0;
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Mock origin: one thread per proxy connection, answering every request
+// with a cacheable object of the configured size
+static void* origin_connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[LOADGEN_MAX_HEADER];
+    int buffered = 0;
+
+    while (1) {
+        char* header_end;
+        while (!(header_end = memmem(buf, buffered, "\r\n\r\n", 4))) {
+            if (buffered == (int)sizeof(buf)) goto done;
+            ssize_t received = recv(fd, buf + buffered, sizeof(buf) - buffered, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) goto done;
+            buffered += received;
+        }
+        int request_len = header_end - buf + 4;
+        buf[request_len - 2] = '\0';
+        const char* connection = header_value(buf, "Connection");
+        int close_after = connection && strncasecmp(connection, "close", 5) == 0;
+        buffered -= request_len;
+        memmove(buf, buf + request_len, buffered);
+
+        if (measuring) __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+        if (config.origin_delay_ms > 0) usleep(config.origin_delay_ms * 1000);
+
+        char headers[256];
+        int len = snprintf(headers, sizeof(headers),
+                           "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                           "Cache-Control: max-age=3600\r\nContent-Length: %d\r\n%s\r\n",
+                           config.object_size, close_after ? "Connection: close\r\n" : "");
+        // Headers and body leave in the same segments, not as a small write
+        // waiting for a delayed ACK
+        if (send_all(fd, headers, len, MSG_MORE) < 0 || send_all(fd, origin_body, config.object_size, 0) < 0 ||
+            close_after) {
+            break;
+        }
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+static void* origin_thread(void* arg) {
+    int listener = (int)(intptr_t)arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOADGEN_THREAD_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(1000);
+                continue;
+            }
+            perror("Origin accept failed");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, origin_connection, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+static int start_origin() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Origin socket failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.origin_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 4096) < 0) {
+        perror("Origin bind failed");
+        close(listener);
+        return -1;
+    }
+
+    origin_body = (char*)malloc(config.object_size);
+    if (!origin_body) return -1;
+    memset(origin_body, 'x', config.object_size);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, origin_thread, (void*)(intptr_t)listener) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+static int parse_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--proxy=", 8) == 0) {
+            static char host[256];
+            const char* colon = strrchr(arg + 8, ':');
+            if (!colon || colon - (arg + 8) >= (int)sizeof(host)) return -1;
+            memcpy(host, arg + 8, colon - (arg + 8));
+            host[colon - (arg + 8)] = '\0';
+            config.proxy_host = host;
+            config.proxy_port = atoi(colon + 1);
+        } else if (strncmp(arg, "--origin-port=", 14) == 0) {
+            config.origin_port = atoi(arg + 14);
+        } else if (strncmp(arg, "--connections=", 14) == 0) {
+            config.connections = atoi(arg + 14);
+        } else if (strncmp(arg, "--duration=", 11) == 0) {
+            config.duration = atoi(arg + 11);
+        } else if (strncmp(arg, "--warmup=", 9) == 0) {
+            config.warmup = atoi(arg + 9);
+        } else if (strncmp(arg, "--keys=", 7) == 0) {
+            config.keys = atoi(arg + 7);
+        } else if (strcmp(arg, "--dist=zipf") == 0) {
+            config.dist = DIST_ZIPF;
+        } else if (strcmp(arg, "--dist=uniform") == 0) {
+            config.dist = DIST_UNIFORM;
+        } else if (strcmp(arg, "--dist=scan") == 0) {
+            config.dist = DIST_SCAN;
+        } else if (strncmp(arg, "--zipf=", 7) == 0) {
+            config.zipf_s = atof(arg + 7);
+        } else if (strncmp(arg, "--size=", 7) == 0) {
+            config.object_size = atoi(arg + 7);
+        } else if (strncmp(arg, "--origin-delay-ms=", 18) == 0) {
+            config.origin_delay_ms = atoi(arg + 18);
+        } else if (strcmp(arg, "--close") == 0) {
+            config.keepalive = 0;
+        } else {
+            return -1;
+        }
+    }
+    if (config.proxy_port <= 0 || config.origin_port <= 0 || config.connections <= 0 ||
+        config.duration <= 0 || config.warmup < 0 || config.keys <= 0 || config.zipf_s <= 0 ||
+        config.object_size < 0 || config.origin_delay_ms < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (parse_options(argc, argv) < 0) {
+        printf("Usage: %s [--proxy=HOST:PORT] [--origin-port=N] [--connections=N] [--duration=SECONDS]"
+               " [--warmup=SECONDS] [--keys=N] [--dist=zipf|uniform|scan] [--zipf=S] [--size=BYTES]"
+               " [--origin-delay-ms=MS] [--close]\n", argv[0]);
+        return 1;
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.proxy_host, NULL, &hints, &result) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", config.proxy_host);
+        return 1;
+    }
+    memcpy(&proxy_addr, result->ai_addr, sizeof(proxy_addr));
+    proxy_addr.sin_port = htons(config.proxy_port);
+    freeaddrinfo(result);
+
+    if ((config.dist == DIST_ZIPF && zipf_init() < 0) || start_origin() < 0) {
+        return 1;
+    }
+
+    const char* dist = config.dist == DIST_SCAN ? "scan" : config.dist == DIST_UNIFORM ? "uniform" : "zipf";
+    printf("Proxy %s:%d, origin 127.0.0.1:%d, %d connections, %d keys (%s", config.proxy_host,
+           config.proxy_port, config.origin_port, config.connections, config.keys, dist);
+    if (config.dist == DIST_ZIPF) printf(" s=%.2f", config.zipf_s);
+    printf("), %d byte objects, %s\n", config.object_size, config.keepalive ? "keep-alive" : "connection per request");
+
+    client* clients = (client*)calloc(config.connections, sizeof(client));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOADGEN_THREAD_STACK);
+    int started = 0;
+    for (int i = 0; clients && i < config.connections; i++) {
+        clients[i].index = i;
+        clients[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (pthread_create(&clients[i].thread, &attr, client_thread, &clients[i]) != 0) {
+            perror("pthread_create failed");
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) return 1;
+
+    sleep(config.warmup);
+    measuring = 1;
+    double start = now_sec();
+    sleep(config.duration);
+    measuring = 0;
+    double elapsed = now_sec() - start;
+    running = 0;
+
+    long requests = 0, errors = 0, reconnects = 0, count = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        reconnects += clients[i].reconnects;
+        count += clients[i].latencies.count;
+    }
+
+    long* latencies = (long*)malloc((count ? count : 1) * sizeof(long));
+    long merged = 0;
+    for (int i = 0; latencies && i < started; i++) {
+        memcpy(latencies + merged, clients[i].latencies.usec, clients[i].latencies.count * sizeof(long));
+        merged += clients[i].latencies.count;
+        free(clients[i].latencies.usec);
+    }
+    qsort(latencies, merged, sizeof(long), compare_long);
+
+    long origin = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+    double hit_ratio = requests > 0 ? 1.0 - (double)(origin < requests ? origin : requests) / requests : 0;
+    printf("\nRequests: %ld in %.2f s (%.0f req/s), %ld errors, %ld reconnects\n",
+           requests, elapsed, requests / elapsed, errors, reconnects);
+    printf("Throughput: %.2f MB/s\n", requests * (double)config.object_size / elapsed / (1024 * 1024));
+    if (merged > 0) {
+        long sum = 0;
+        for (long i = 0; i < merged; i++) sum += latencies[i];
+        printf("Latency: mean %.2f ms, p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+               sum / 1e3 / merged, latencies[merged / 2] / 1e3, latencies[(long)(merged * 0.99)] / 1e3,
+               latencies[(long)(merged * 0.999)] / 1e3, latencies[merged - 1] / 1e3);
+    }
+    printf("Hit Ratio: %.2f%% (%ld origin requests)\n", hit_ratio * 100, origin);
+
+    free(latencies);
+    free(clients);
+    free(zipf_cdf);
+    return errors > 0 && requests == 0;
+}
@@ -0,0 +1,152 @@
+#include "cache_peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct peer_point {
+    uint64_t hash;
+    int member;
+} peer_point;
+
+static struct {
+    cache_peer members[CACHE_PEER_MAX];
+    int count;
+    peer_point* points;                 // count * CACHE_PEER_VNODES, sorted by hash
+    int point_count;
+} ring;
+
+// FNV-1a of a ring point name
+static uint64_t peer_hash(const char* str, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// splitmix64 finalizer, so similar names and keys land far apart on the ring
+static uint64_t peer_mix(uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+static int peer_point_compare(const void* a, const void* b) {
+    uint64_t x = ((const peer_point*)a)->hash, y = ((const peer_point*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// Split "host:port" into member, returns -1 if it is not one
+static int peer_parse(const char* str, int len, cache_peer* member) {
+    const char* colon = NULL;
+    for (int i = 0; i < len; i++) {
+        if (str[i] == ':') colon = str + i;
+    }
+    if (!colon || colon == str || colon - str >= CACHE_PEER_HOST_LEN) return -1;
+
+    int port = 0;
+    for (const char* p = colon + 1; p < str + len; p++) {
+        if (*p < '0' || *p > '9' || port > 65535) return -1;
+        port = port * 10 + (*p - '0');
+    }
+    if (port <= 0 || port > 65535) return -1;
+
+    memset(member, 0, sizeof(*member));
+    memcpy(member->host, str, colon - str);
+    member->port = port;
+    return 0;
+}
+
+int cache_peer_init(const char* members, const char* self) {
+    cache_peer self_member;
+    if (!self || peer_parse(self, strlen(self), &self_member) < 0) {
+        fprintf(stderr, "--peer-self must be this node's host:port from --peers\n");
+        return -1;
+    }
+
+    ring.count = 0;
+    const char* item = members;
+    while (*item) {
+        int len = strcspn(item, ",");
+        if (ring.count == CACHE_PEER_MAX) {
+            fprintf(stderr, "At most %d peers are supported\n", CACHE_PEER_MAX);
+            return -1;
+        }
+        cache_peer* member = &ring.members[ring.count];
+        if (peer_parse(item, len, member) < 0) {
+            fprintf(stderr, "Bad peer '%.*s', expected host:port\n", len, item);
+            return -1;
+        }
+        member->self = strcmp(member->host, self_member.host) == 0 && member->port == self_member.port;
+        for (int i = 0; i < ring.count; i++) {
+            if (strcmp(ring.members[i].host, member->host) == 0 && ring.members[i].port == member->port) {
+                fprintf(stderr, "Peer %s:%d is listed twice\n", member->host, member->port);
+                return -1;
+            }
+        }
+        ring.count++;
+        item += len;
+        if (*item == ',') item++;
+    }
+
+    int found = 0;
+    for (int i = 0; i < ring.count; i++) found |= ring.members[i].self;
+    if (!found) {
+        fprintf(stderr, "--peer-self %s is not one of --peers\n", self);
+        return -1;
+    }
+
+    ring.points = (peer_point*)malloc(ring.count * CACHE_PEER_VNODES * sizeof(peer_point));
+    if (!ring.points) return -1;
+    ring.point_count = 0;
+    for (int i = 0; i < ring.count; i++) {
+        for (int v = 0; v < CACHE_PEER_VNODES; v++) {
+            char name[CACHE_PEER_HOST_LEN + 32];
+            int len = snprintf(name, sizeof(name), "%s:%d#%d", ring.members[i].host, ring.members[i].port, v);
+            ring.points[ring.point_count].hash = peer_mix(peer_hash(name, len));
+            ring.points[ring.point_count].member = i;
+            ring.point_count++;
+        }
+    }
+    qsort(ring.points, ring.point_count, sizeof(peer_point), peer_point_compare);
+    return 0;
+}
+
+cache_peer* cache_peer_owner(uint64_t hash) {
+    if (ring.point_count == 0) return NULL;
+    hash = peer_mix(hash);
+
+    // First point at or after the hash, wrapping around
+    int low = 0, high = ring.point_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring.points[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (int i = 0; i < ring.point_count; i++) {
+        cache_peer* member = &ring.members[ring.points[(low + i) % ring.point_count].member];
+        if (member->self) return NULL;
+        if (!__atomic_load_n(&member->down, __ATOMIC_RELAXED)) return member;
+    }
+    return NULL;
+}
+
+void cache_peer_set_down(cache_peer* peer, int down) {
+    __atomic_store_n(&peer->down, down, __ATOMIC_RELAXED);
+}
+
+int cache_peer_count() {
+    return ring.count;
+}
+
+cache_peer* cache_peer_at(int index) {
+    return &ring.members[index];
+}
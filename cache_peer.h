@@ -0,0 +1,57 @@
+#ifndef CACHE_PEER_H
+#define CACHE_PEER_H
+
+#include <stdint.h>
+
+/*
+ * Consistent-hash ring of cooperating cache nodes
+ *
+ * Every node of a fleet is configured with the same member list, so they
+ * all agree on which node owns a cache key: each member is placed on a
+ * 64-bit ring at CACHE_PEER_VNODES points derived from its "host:port",
+ * and a key belongs to the member at the first point at or after its
+ * hash. Adding or removing a member only moves the keys next to its
+ * points. A member marked down is skipped, its keys pass to the next live
+ * member along the ring until it is marked up again.
+ */
+
+#define CACHE_PEER_MAX 64               // Members of a ring, this node included
+#define CACHE_PEER_VNODES 160           // Ring points per member
+#define CACHE_PEER_HOST_LEN 256
+
+typedef struct cache_peer {
+    char host[CACHE_PEER_HOST_LEN];
+    int port;
+    int self;                           // This node
+    int down;                           // Failed its last check or fetch (atomic)
+    long fetches;                       // Misses fetched through it (atomic)
+    long failures;                      // Fetches it could not serve (atomic)
+} cache_peer;
+
+/*
+ * cache_peer_init() builds the ring from a comma separated "host:port"
+ * list of all members; self names this node and must be one of them.
+ * Returns -1 (with a message on stderr) if the list is malformed.
+ */
+int cache_peer_init(const char* members, const char* self);
+
+/*
+ * cache_peer_owner() returns the live member owning the key with this
+ * hash, or NULL if it is this node
+ */
+cache_peer* cache_peer_owner(uint64_t hash);
+
+/*
+ * cache_peer_set_down() marks a member down (its keys go to the next live
+ * member) or up again
+ */
+void cache_peer_set_down(cache_peer* peer, int down);
+
+/*
+ * cache_peer_count() returns the number of members, 0 without a ring,
+ * and cache_peer_at() the member at index
+ */
+int cache_peer_count();
+cache_peer* cache_peer_at(int index);
+
+#endif /* CACHE_PEER_H */
@@ -0,0 +1,111 @@
+#include "cache_sketch.h"
+#include <stdlib.h>
+
+#define SKETCH_COUNTERS_PER_WORD 16     // 4-bit counters in a 64-bit word
+#define SKETCH_MIN_WIDTH 1024           // Smallest row width in counters
+
+struct cache_sketch {
+    uint64_t* table;                    // CACHE_SKETCH_DEPTH rows of width counters
+    size_t width;                       // Counters per row, a power of two
+    int width_bits;                     // log2(width)
+    size_t row_words;
+    long sample_size;                   // Accesses between decays
+    long additions;                     // Accesses since the last decay (atomic)
+    long decays;                        // (atomic)
+};
+
+// Odd multipliers giving each row an independent index
+static const uint64_t sketch_seeds[CACHE_SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+cache_sketch* cache_sketch_create(size_t expected_items) {
+    cache_sketch* sketch = (cache_sketch*)calloc(1, sizeof(cache_sketch));
+    if (!sketch) return NULL;
+
+    sketch->width = SKETCH_MIN_WIDTH;
+    sketch->width_bits = 10;
+    while (sketch->width < expected_items) {
+        sketch->width <<= 1;
+        sketch->width_bits++;
+    }
+    sketch->row_words = sketch->width / SKETCH_COUNTERS_PER_WORD;
+    sketch->sample_size = (long)sketch->width * CACHE_SKETCH_SAMPLE_FACTOR;
+
+    sketch->table = (uint64_t*)calloc(sketch->row_words * CACHE_SKETCH_DEPTH, sizeof(uint64_t));
+    if (!sketch->table) {
+        free(sketch);
+        return NULL;
+    }
+    return sketch;
+}
+
+// Counter of the key in one row, as a position in the table
+static size_t sketch_counter(cache_sketch* sketch, uint64_t hash, int row) {
+    uint64_t mixed = (hash ^ (hash >> 31)) * sketch_seeds[row];
+    return row * sketch->width + (mixed >> (64 - sketch->width_bits));
+}
+
+static int sketch_get(cache_sketch* sketch, size_t counter) {
+    uint64_t word = __atomic_load_n(&sketch->table[counter / SKETCH_COUNTERS_PER_WORD], __ATOMIC_RELAXED);
+    return (word >> ((counter % SKETCH_COUNTERS_PER_WORD) * 4)) & 0xf;
+}
+
+// Increment one counter unless it already reached `from + 1` or saturated
+static void sketch_bump(cache_sketch* sketch, size_t counter, int from) {
+    uint64_t* word = &sketch->table[counter / SKETCH_COUNTERS_PER_WORD];
+    int shift = (counter % SKETCH_COUNTERS_PER_WORD) * 4;
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (((old >> shift) & 0xf) == (uint64_t)from && from < CACHE_SKETCH_MAX_COUNT) {
+        if (__atomic_compare_exchange_n(word, &old, old + ((uint64_t)1 << shift), 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+// Halve every counter; accesses recorded meanwhile still land
+static void sketch_decay(cache_sketch* sketch) {
+    size_t words = sketch->row_words * CACHE_SKETCH_DEPTH;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t old = __atomic_load_n(&sketch->table[i], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&sketch->table[i], &old, (old >> 1) & 0x7777777777777777ULL, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_add_fetch(&sketch->decays, 1, __ATOMIC_RELAXED);
+}
+
+void cache_sketch_increment(cache_sketch* sketch, uint64_t hash) {
+    size_t counters[CACHE_SKETCH_DEPTH];
+    int counts[CACHE_SKETCH_DEPTH];
+    int min = CACHE_SKETCH_MAX_COUNT;
+
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        counters[row] = sketch_counter(sketch, hash, row);
+        counts[row] = sketch_get(sketch, counters[row]);
+        if (counts[row] < min) min = counts[row];
+    }
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        if (counts[row] == min) sketch_bump(sketch, counters[row], min);
+    }
+
+    // Exactly one thread sees the count reach the sample size
+    if (__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED) == sketch->sample_size) {
+        sketch_decay(sketch);
+        __atomic_sub_fetch(&sketch->additions, sketch->sample_size, __ATOMIC_RELAXED);
+    }
+}
+
+int cache_sketch_estimate(cache_sketch* sketch, uint64_t hash) {
+    int min = CACHE_SKETCH_MAX_COUNT;
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        int count = sketch_get(sketch, sketch_counter(sketch, hash, row));
+        if (count < min) min = count;
+    }
+    return min;
+}
+
+long cache_sketch_decays(cache_sketch* sketch) {
+    return __atomic_load_n(&sketch->decays, __ATOMIC_RELAXED);
+}
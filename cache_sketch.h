@@ -0,0 +1,47 @@
+#ifndef CACHE_SKETCH_H
+#define CACHE_SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frequency sketch for cache admission
+ *
+ * A count-min sketch of 4-bit counters, CACHE_SKETCH_DEPTH per key, packed
+ * sixteen to a 64-bit word and updated with atomic compare-and-swap so any
+ * thread can record an access without a lock. Only the smallest of a key's
+ * counters are incremented (conservative update), which keeps estimates
+ * for rarely seen keys from being inflated by collisions. After every
+ * CACHE_SKETCH_SAMPLE_FACTOR * width accesses all counters are halved, so
+ * the estimates follow recent popularity rather than all-time totals.
+ */
+
+#define CACHE_SKETCH_DEPTH 4            // Counters per key
+#define CACHE_SKETCH_MAX_COUNT 15       // Counters saturate at this value
+#define CACHE_SKETCH_SAMPLE_FACTOR 10   // Accesses per counter between decays
+
+typedef struct cache_sketch cache_sketch;
+
+/*
+ * cache_sketch_create() sizes the sketch for about expected_items distinct
+ * keys (rounded up to a power of two). Returns NULL if out of memory.
+ */
+cache_sketch* cache_sketch_create(size_t expected_items);
+
+/*
+ * cache_sketch_increment() records one access to the key with this hash
+ */
+void cache_sketch_increment(cache_sketch* sketch, uint64_t hash);
+
+/*
+ * cache_sketch_estimate() returns the estimated recent access count of the
+ * key, between 0 and CACHE_SKETCH_MAX_COUNT
+ */
+int cache_sketch_estimate(cache_sketch* sketch, uint64_t hash);
+
+/*
+ * cache_sketch_decays() returns how many times the counters were halved
+ */
+long cache_sketch_decays(cache_sketch* sketch);
+
+#endif /* CACHE_SKETCH_H */
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include "cache_slab.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define SLAB_MIN_CHUNK 64           // Smallest size class
+#define SLAB_MAX_CLASSES 48         // Upper bound on the number of size classes
+#define SLAB_GROWTH_FACTOR 1.25     // Ratio between consecutive size classes
+#define SLAB_MAGAZINE_SIZE 8        // Free chunks cached per thread per class
+
+// Slab page header, stored at the start of each aligned page
+typedef struct slab_page {
+    struct slab_page* next;         // Next page in the class partial list or idle list
+    struct slab_page* prev;         // Previous page in the class partial list
+    int class_id;                   // Size class all chunks in this page belong to
+    int used;                       // Chunks handed out (including thread magazines)
+    int capacity;                   // Chunks that fit in the page
+    int carved;                     // Chunks carved so far, the rest is untouched
+    void* free_list;                // Freed chunks, linked through their first word
+} slab_page;
+
+#define SLAB_PAGE_HEADER ((sizeof(slab_page) + 63) & ~(size_t)63)
+
+typedef struct slab_class {
+    size_t chunk_size;
+    slab_page* partial;             // Pages with at least one free chunk
+    pthread_mutex_t mutex;
+} slab_class;
+
+static slab_class slab_classes[SLAB_MAX_CLASSES];
+static int slab_class_count;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_thread_key;
+
+// Empty pages shared by all classes
+static struct {
+    slab_page* idle;
+    int idle_count;
+    size_t mapped;
+    pthread_mutex_t mutex;
+} slab_pages = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// Per-thread free chunk magazines
+static __thread struct {
+    void* chunks[SLAB_MAGAZINE_SIZE];
+    int count;
+} slab_magazines[SLAB_MAX_CLASSES];
+static __thread int slab_thread_registered;
+
+static void slab_thread_exit(void* arg) {
+    slab_thread_flush();
+}
+
+static void slab_init() {
+    size_t size = SLAB_MIN_CHUNK;
+    while (size < SLAB_MAX_CHUNK && slab_class_count < SLAB_MAX_CLASSES - 1) {
+        slab_classes[slab_class_count++].chunk_size = size;
+        size = ((size_t)(size * SLAB_GROWTH_FACTOR) + 15) & ~(size_t)15;
+    }
+    slab_classes[slab_class_count++].chunk_size = SLAB_MAX_CHUNK;
+
+    for (int i = 0; i < slab_class_count; i++) {
+        pthread_mutex_init(&slab_classes[i].mutex, NULL);
+    }
+    pthread_key_create(&slab_thread_key, slab_thread_exit);
+}
+
+static int slab_class_for(size_t size) {
+    int low = 0, high = slab_class_count - 1;
+    if (size > SLAB_MAX_CHUNK) return -1;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (slab_classes[mid].chunk_size >= size) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+static slab_page* slab_page_of(void* ptr) {
+    return (slab_page*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+// Get an empty page for a class, reusing an idle page when possible
+static slab_page* slab_page_get(int class_id) {
+    pthread_mutex_lock(&slab_pages.mutex);
+    slab_page* page = slab_pages.idle;
+    if (page) {
+        slab_pages.idle = page->next;
+        slab_pages.idle_count--;
+    }
+    pthread_mutex_unlock(&slab_pages.mutex);
+
+    if (!page) {
+        // Over-map so the page can be aligned, then trim the excess
+        char* raw = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+
+        char* aligned = (char*)(((uintptr_t)raw + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+        if (aligned > raw) munmap(raw, aligned - raw);
+        munmap(aligned + SLAB_PAGE_SIZE, raw + SLAB_PAGE_SIZE - aligned);
+        page = (slab_page*)aligned;
+
+        pthread_mutex_lock(&slab_pages.mutex);
+        slab_pages.mapped += SLAB_PAGE_SIZE;
+        pthread_mutex_unlock(&slab_pages.mutex);
+    }
+
+    memset(page, 0, sizeof(slab_page));
+    page->class_id = class_id;
+    page->capacity = (SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / slab_classes[class_id].chunk_size;
+    return page;
+}
+
+// Release a page whose chunks are all free
+static void slab_page_release(slab_page* page) {
+    pthread_mutex_lock(&slab_pages.mutex);
+    if (slab_pages.idle_count < SLAB_IDLE_PAGES) {
+        page->next = slab_pages.idle;
+        slab_pages.idle = page;
+        slab_pages.idle_count++;
+        page = NULL;
+    } else {
+        slab_pages.mapped -= SLAB_PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&slab_pages.mutex);
+
+    if (page) {
+        munmap(page, SLAB_PAGE_SIZE);
+    }
+}
+
+static void slab_partial_unlink(slab_class* cls, slab_page* page) {
+    if (page->prev) page->prev->next = page->next;
+    if (page->next) page->next->prev = page->prev;
+    if (cls->partial == page) cls->partial = page->next;
+    page->next = page->prev = NULL;
+}
+
+static void slab_partial_push(slab_class* cls, slab_page* page) {
+    page->prev = NULL;
+    page->next = cls->partial;
+    if (cls->partial) cls->partial->prev = page;
+    cls->partial = page;
+}
+
+// Take one chunk from the class (caller holds the class lock)
+static void* slab_take_locked(slab_class* cls, int class_id) {
+    slab_page* page = cls->partial;
+    if (!page) {
+        page = slab_page_get(class_id);
+        if (!page) return NULL;
+        slab_partial_push(cls, page);
+    }
+
+    void* chunk;
+    if (page->free_list) {
+        chunk = page->free_list;
+        page->free_list = *(void**)chunk;
+    } else {
+        chunk = (char*)page + SLAB_PAGE_HEADER + (size_t)page->carved * cls->chunk_size;
+        page->carved++;
+    }
+
+    if (++page->used == page->capacity) {
+        slab_partial_unlink(cls, page);
+    }
+    return chunk;
+}
+
+// Return one chunk to its page (caller holds the class lock)
+static void slab_return_locked(slab_class* cls, void* chunk) {
+    slab_page* page = slab_page_of(chunk);
+
+    *(void**)chunk = page->free_list;
+    page->free_list = chunk;
+    if (page->used-- == page->capacity) {
+        slab_partial_push(cls, page);
+    }
+
+    // Whole page free: give it back so any class (or the OS) can use it
+    if (page->used == 0) {
+        slab_partial_unlink(cls, page);
+        slab_page_release(page);
+    }
+}
+
+void* slab_alloc(size_t size) {
+    pthread_once(&slab_once, slab_init);
+
+    int class_id = slab_class_for(size);
+    if (class_id < 0) return NULL;
+
+    if (!slab_thread_registered) {
+        slab_thread_registered = 1;
+        pthread_setspecific(slab_thread_key, (void*)1);
+    }
+
+    if (slab_magazines[class_id].count > 0) {
+        return slab_magazines[class_id].chunks[--slab_magazines[class_id].count];
+    }
+
+    // Refill half the magazine under one lock acquisition
+    slab_class* cls = &slab_classes[class_id];
+    pthread_mutex_lock(&cls->mutex);
+    void* chunk = slab_take_locked(cls, class_id);
+    while (chunk && slab_magazines[class_id].count < SLAB_MAGAZINE_SIZE / 2) {
+        void* extra = slab_take_locked(cls, class_id);
+        if (!extra) break;
+        slab_magazines[class_id].chunks[slab_magazines[class_id].count++] = extra;
+    }
+    pthread_mutex_unlock(&cls->mutex);
+
+    return chunk;
+}
+
+void slab_free(void* ptr) {
+    if (ptr == NULL) return;
+
+    int class_id = slab_page_of(ptr)->class_id;
+    if (slab_magazines[class_id].count < SLAB_MAGAZINE_SIZE) {
+        slab_magazines[class_id].chunks[slab_magazines[class_id].count++] = ptr;
+        return;
+    }
+
+    // Magazine full: return half of it plus this chunk in one lock acquisition
+    slab_class* cls = &slab_classes[class_id];
+    pthread_mutex_lock(&cls->mutex);
+    slab_return_locked(cls, ptr);
+    while (slab_magazines[class_id].count > SLAB_MAGAZINE_SIZE / 2) {
+        slab_return_locked(cls, slab_magazines[class_id].chunks[--slab_magazines[class_id].count]);
+    }
+    pthread_mutex_unlock(&cls->mutex);
+}
+
+size_t slab_chunk_size(size_t size) {
+    pthread_once(&slab_once, slab_init);
+
+    int class_id = slab_class_for(size);
+    return class_id < 0 ? 0 : slab_classes[class_id].chunk_size;
+}
+
+void slab_thread_flush() {
+    for (int i = 0; i < slab_class_count; i++) {
+        if (slab_magazines[i].count == 0) continue;
+
+        pthread_mutex_lock(&slab_classes[i].mutex);
+        while (slab_magazines[i].count > 0) {
+            slab_return_locked(&slab_classes[i], slab_magazines[i].chunks[--slab_magazines[i].count]);
+        }
+        pthread_mutex_unlock(&slab_classes[i].mutex);
+    }
+}
+
+size_t slab_mapped_bytes() {
+    pthread_mutex_lock(&slab_pages.mutex);
+    size_t mapped = slab_pages.mapped;
+    pthread_mutex_unlock(&slab_pages.mutex);
+    return mapped;
+}
+
+void slab_release_idle() {
+    pthread_mutex_lock(&slab_pages.mutex);
+    slab_page* page = slab_pages.idle;
+    slab_pages.idle = NULL;
+    slab_pages.mapped -= (size_t)slab_pages.idle_count * SLAB_PAGE_SIZE;
+    slab_pages.idle_count = 0;
+    pthread_mutex_unlock(&slab_pages.mutex);
+
+    while (page) {
+        slab_page* next = page->next;
+        munmap(page, SLAB_PAGE_SIZE);
+        page = next;
+    }
+}
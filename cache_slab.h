@@ -0,0 +1,55 @@
+#ifndef CACHE_SLAB_H
+#define CACHE_SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Slab allocator for cache object storage
+ *
+ * Memory is carved out of 1MB pages obtained directly from mmap, each page
+ * dedicated to one size class. Chunks are freed back to their page, and a
+ * page whose chunks are all free is released as a whole, so cache churn
+ * does not fragment the process heap. Each size class has its own lock and
+ * every thread keeps a small magazine of free chunks per class, so most
+ * allocations and frees never take a lock at all.
+ */
+
+#define SLAB_PAGE_SIZE (1 << 20)    // Size and alignment of a slab page
+#define SLAB_MAX_CHUNK (16 * 1024 + 64) // Largest chunk size served
+#define SLAB_IDLE_PAGES 16          // Empty pages kept mapped for reuse
+
+/*
+ * slab_alloc() returns a chunk of at least size bytes, or NULL if size is
+ * larger than SLAB_MAX_CHUNK or memory is exhausted
+ */
+void* slab_alloc(size_t size);
+
+/*
+ * slab_free() returns a chunk obtained from slab_alloc()
+ */
+void slab_free(void* ptr);
+
+/*
+ * slab_chunk_size() returns the real size of the chunk slab_alloc(size)
+ * would hand out, or 0 if size is not served by the allocator
+ */
+size_t slab_chunk_size(size_t size);
+
+/*
+ * slab_thread_flush() returns the calling thread's cached free chunks to
+ * their pages; call before a thread that used the allocator exits
+ */
+void slab_thread_flush();
+
+/*
+ * slab_mapped_bytes() returns the bytes currently mapped for slab pages,
+ * including empty pages kept for reuse
+ */
+size_t slab_mapped_bytes();
+
+/*
+ * slab_release_idle() unmaps all empty pages kept for reuse
+ */
+void slab_release_idle();
+
+#endif /* CACHE_SLAB_H */
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include "disk_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DISK_RECORD_MAGIC 0x4452554cu   // Marks the start of a record
+#define DISK_RECORD_ALIGN 8             // Records start on this boundary
+
+// Record header, followed by the key and then the response bytes
+typedef struct disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t data_len;
+    uint32_t delimited;
+    uint64_t hash;
+    int64_t creation_time;
+    int64_t expires;
+    int64_t stale_until;
+} disk_record;
+
+// Index entry, all that is kept in memory per stored response
+typedef struct disk_entry {
+    uint64_t hash;
+    uint32_t offset;                    // Record offset in the segment
+    uint32_t data_len;
+    uint16_t key_len;
+    uint16_t segment;
+    int indexed;                        // Still reachable from the index
+    struct disk_entry* hash_next;       // Next entry in the same index bucket
+    struct disk_entry* segment_next;    // Next entry pointing into the same segment
+} disk_entry;
+
+// A free segment is empty; the active one is being appended to; a sealed
+// one is full; a reclaimed one has no index entries left and becomes free
+// once its last pin is dropped
+enum { SEGMENT_FREE, SEGMENT_ACTIVE, SEGMENT_SEALED, SEGMENT_RECLAIMED };
+
+typedef struct disk_segment {
+    int fd;
+    char* map;                          // Read-only mapping of the whole file
+    uint32_t used;                      // Bytes appended or reserved
+    int state;
+    int pins;                           // Readers and writers using the file
+    unsigned long sequence;             // Activation order, the oldest is reclaimed first
+    disk_entry* entries;                // Entries pointing into this segment (indexed or not)
+} disk_segment;
+
+static struct {
+    int enabled;
+    disk_segment segments[DISK_MAX_SEGMENTS];
+    int segment_count;
+    int active;                         // Segment being appended to, -1 if none
+    unsigned long sequence;
+    disk_entry** index;
+    size_t index_size;                  // Always a power of two
+    size_t count;                       // Indexed entries
+    long stored;
+    long dropped;
+    long reclaimed;
+    pthread_mutex_t mutex;              // Protects everything above
+} disk = { .active = -1, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t disk_record_size(int key_len, size_t len) {
+    size_t size = sizeof(disk_record) + key_len + len;
+    return (size + DISK_RECORD_ALIGN - 1) & ~(size_t)(DISK_RECORD_ALIGN - 1);
+}
+
+int disk_cache_init(const char* dir, size_t capacity) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Disk cache directory");
+        return -1;
+    }
+
+    size_t count = capacity / DISK_SEGMENT_SIZE;
+    if (count < 1) count = 1;
+    if (count > DISK_MAX_SEGMENTS) count = DISK_MAX_SEGMENTS;
+
+    disk.index_size = DISK_INDEX_INITIAL_SIZE;
+    disk.index = (disk_entry**)calloc(disk.index_size, sizeof(disk_entry*));
+    if (!disk.index) {
+        perror("Disk cache index allocation failed");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/segment-%04zu.dat", dir, i);
+
+        // Sparse files, blocks are only allocated as records are appended
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, DISK_SEGMENT_SIZE) < 0) {
+            perror("Disk cache segment");
+            if (fd >= 0) close(fd);
+            disk_cache_close();
+            return -1;
+        }
+        char* map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Disk cache segment mmap");
+            close(fd);
+            disk_cache_close();
+            return -1;
+        }
+
+        disk_segment* segment = &disk.segments[disk.segment_count++];
+        memset(segment, 0, sizeof(*segment));
+        segment->fd = fd;
+        segment->map = map;
+        segment->state = SEGMENT_FREE;
+    }
+
+    disk.enabled = 1;
+    return 0;
+}
+
+int disk_cache_enabled() {
+    return disk.enabled;
+}
+
+// Index management (caller holds the lock)
+static void disk_index_resize(size_t new_size) {
+    disk_entry** new_index = (disk_entry**)calloc(new_size, sizeof(disk_entry*));
+    if (!new_index) {
+        return; // Keep the old table, lookups stay correct just slower
+    }
+
+    for (size_t i = 0; i < disk.index_size; i++) {
+        disk_entry* current = disk.index[i];
+        while (current) {
+            disk_entry* next = current->hash_next;
+            size_t bucket = current->hash & (new_size - 1);
+            current->hash_next = new_index[bucket];
+            new_index[bucket] = current;
+            current = next;
+        }
+    }
+
+    free(disk.index);
+    disk.index = new_index;
+    disk.index_size = new_size;
+}
+
+static void disk_index_unlink(disk_entry* entry) {
+    disk_entry** link = &disk.index[entry->hash & (disk.index_size - 1)];
+    while (*link) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            entry->hash_next = NULL;
+            entry->indexed = 0;
+            disk.count--;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+// Entry whose hash and key length match, past the first `skip` such
+// entries of the chain (the caller compares the key itself)
+static disk_entry* disk_index_find(uint64_t hash, int key_len, int skip) {
+    disk_entry* current = disk.index[hash & (disk.index_size - 1)];
+    while (current) {
+        if (current->hash == hash && current->key_len == key_len && skip-- == 0) {
+            return current;
+        }
+        current = current->hash_next;
+    }
+    return NULL;
+}
+
+// Like disk_index_find(), but also compares the stored key through the
+// mapping so a hash collision is never taken for the key. Only used to
+// drop entries, which is rare enough to read the record under the lock.
+static disk_entry* disk_index_find_key(uint64_t hash, const char* key, int key_len) {
+    for (disk_entry* current = disk.index[hash & (disk.index_size - 1)]; current; current = current->hash_next) {
+        if (current->hash != hash || current->key_len != key_len) continue;
+        const disk_record* record = (const disk_record*)(disk.segments[current->segment].map + current->offset);
+        if (record->magic == DISK_RECORD_MAGIC && record->hash == hash &&
+            memcmp((const char*)(record + 1), key, key_len) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+static void disk_index_insert(disk_entry* entry, const char* key) {
+    disk_entry* existing = disk_index_find_key(entry->hash, key, entry->key_len);
+    if (existing) {
+        disk_index_unlink(existing);
+    }
+
+    // Grow at a load factor of 0.75 to keep chains short
+    if ((disk.count + 1) * 4 > disk.index_size * 3) {
+        disk_index_resize(disk.index_size * 2);
+    }
+
+    size_t bucket = entry->hash & (disk.index_size - 1);
+    entry->hash_next = disk.index[bucket];
+    disk.index[bucket] = entry;
+    entry->indexed = 1;
+    disk.count++;
+}
+
+// A reclaimed segment with no pins left can be reused. Its blocks are
+// released so the file system (and the SSD) can reuse them meanwhile.
+static void disk_segment_free_locked(disk_segment* segment) {
+    fallocate(segment->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, DISK_SEGMENT_SIZE);
+    segment->state = SEGMENT_FREE;
+    segment->used = 0;
+}
+
+// Drop every entry of the oldest sealed segment (caller holds the lock)
+static void disk_reclaim_oldest_locked() {
+    disk_segment* oldest = NULL;
+    for (int i = 0; i < disk.segment_count; i++) {
+        disk_segment* segment = &disk.segments[i];
+        if (segment->state == SEGMENT_SEALED && (!oldest || segment->sequence < oldest->sequence)) {
+            oldest = segment;
+        }
+    }
+    if (!oldest) return;
+
+    disk_entry* entry = oldest->entries;
+    while (entry) {
+        disk_entry* next = entry->segment_next;
+        if (entry->indexed) disk_index_unlink(entry);
+        free(entry);
+        entry = next;
+    }
+    oldest->entries = NULL;
+    oldest->state = SEGMENT_RECLAIMED;
+    disk.reclaimed++;
+
+    if (oldest->pins == 0) {
+        disk_segment_free_locked(oldest);
+    }
+}
+
+// Segment with room for `size` more bytes, sealing the active one and
+// reclaiming the oldest as needed. Returns -1 if none is available yet.
+static int disk_segment_for_locked(size_t size) {
+    if (disk.active >= 0 && disk.segments[disk.active].used + size <= DISK_SEGMENT_SIZE) {
+        return disk.active;
+    }
+    if (disk.active >= 0) {
+        disk.segments[disk.active].state = SEGMENT_SEALED;
+        disk.active = -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (int i = 0; i < disk.segment_count; i++) {
+            disk_segment* segment = &disk.segments[i];
+            if (segment->state == SEGMENT_FREE) {
+                segment->state = SEGMENT_ACTIVE;
+                segment->used = 0;
+                segment->sequence = ++disk.sequence;
+                disk.active = i;
+                return i;
+            }
+        }
+        disk_reclaim_oldest_locked();
+    }
+    return -1;
+}
+
+static void disk_unpin_locked(disk_segment* segment) {
+    if (--segment->pins == 0 && segment->state == SEGMENT_RECLAIMED) {
+        disk_segment_free_locked(segment);
+    }
+}
+
+// pwritev() the whole of iov at offset, resuming after partial writes
+static int disk_write_all(int fd, struct iovec* iov, int iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        ssize_t written = pwritev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+int disk_cache_store(uint64_t hash, const char* key, int key_len, const disk_cache_meta* meta,
+                     const struct iovec* iov, int iovcnt, size_t len) {
+    if (!disk.enabled) return -1;
+
+    size_t size = disk_record_size(key_len, len);
+    struct iovec* parts = NULL;
+    disk_entry* entry = (disk_entry*)malloc(sizeof(disk_entry));
+    if (size <= DISK_SEGMENT_SIZE && key_len <= UINT16_MAX && entry) {
+        parts = (struct iovec*)malloc((iovcnt + 2) * sizeof(struct iovec));
+    }
+    if (!parts) {
+        free(entry);
+        pthread_mutex_lock(&disk.mutex);
+        disk.dropped++;
+        pthread_mutex_unlock(&disk.mutex);
+        return -1;
+    }
+
+    // Reserve the space under the lock, write it without
+    pthread_mutex_lock(&disk.mutex);
+    int index = disk_segment_for_locked(size);
+    if (index < 0) {
+        disk.dropped++;
+        pthread_mutex_unlock(&disk.mutex);
+        free(entry);
+        free(parts);
+        return -1;
+    }
+    disk_segment* segment = &disk.segments[index];
+    uint32_t offset = segment->used;
+    segment->used += size;
+    segment->pins++;
+    pthread_mutex_unlock(&disk.mutex);
+
+    disk_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = DISK_RECORD_MAGIC;
+    record.key_len = key_len;
+    record.data_len = len;
+    record.delimited = meta->delimited;
+    record.hash = hash;
+    record.creation_time = meta->creation_time;
+    record.expires = meta->expires;
+    record.stale_until = meta->stale_until;
+
+    parts[0].iov_base = &record;
+    parts[0].iov_len = sizeof(record);
+    parts[1].iov_base = (void*)key;
+    parts[1].iov_len = key_len;
+    memcpy(parts + 2, iov, iovcnt * sizeof(struct iovec));
+    int failed = disk_write_all(segment->fd, parts, iovcnt + 2, offset);
+    free(parts);
+
+    // The pin keeps the segment from being reused, but it may have been
+    // reclaimed if the tier went around while this write ran
+    pthread_mutex_lock(&disk.mutex);
+    if (!failed && segment->state != SEGMENT_RECLAIMED) {
+        entry->hash = hash;
+        entry->offset = offset;
+        entry->data_len = len;
+        entry->key_len = key_len;
+        entry->segment = index;
+        entry->segment_next = segment->entries;
+        segment->entries = entry;
+        disk_index_insert(entry, key);
+        disk.stored++;
+    } else {
+        disk.dropped++;
+        free(entry);
+        failed = 1;
+    }
+    disk_unpin_locked(segment);
+    pthread_mutex_unlock(&disk.mutex);
+    return failed ? -1 : 0;
+}
+
+int disk_cache_lookup(uint64_t hash, const char* key, int key_len, disk_cache_ref* ref) {
+    if (!disk.enabled) return 0;
+
+    // The record is read through the mapping without the lock, since it
+    // may have to come from disk. A hash collision with another key moves
+    // on to the next candidate in the chain.
+    const disk_record* record;
+    const char* stored_key;
+    disk_segment* segment;
+    uint32_t offset;
+    for (int skip = 0;; skip++) {
+        pthread_mutex_lock(&disk.mutex);
+        disk_entry* entry = disk_index_find(hash, key_len, skip);
+        if (!entry) {
+            pthread_mutex_unlock(&disk.mutex);
+            return 0;
+        }
+        segment = &disk.segments[entry->segment];
+        offset = entry->offset;
+        segment->pins++;
+        ref->segment = entry->segment;
+        pthread_mutex_unlock(&disk.mutex);
+
+        record = (const disk_record*)(segment->map + offset);
+        stored_key = (const char*)(record + 1);
+        if (record->magic == DISK_RECORD_MAGIC && record->hash == hash &&
+            memcmp(stored_key, key, key_len) == 0) {
+            break;
+        }
+        disk_cache_release(ref);
+    }
+
+    ref->fd = segment->fd;
+    ref->offset = offset + sizeof(disk_record) + key_len;
+    ref->len = record->data_len;
+    ref->data = stored_key + key_len;
+    ref->meta.creation_time = record->creation_time;
+    ref->meta.expires = record->expires;
+    ref->meta.stale_until = record->stale_until;
+    ref->meta.delimited = record->delimited;
+    return 1;
+}
+
+void disk_cache_release(disk_cache_ref* ref) {
+    pthread_mutex_lock(&disk.mutex);
+    disk_unpin_locked(&disk.segments[ref->segment]);
+    pthread_mutex_unlock(&disk.mutex);
+}
+
+void disk_cache_remove(uint64_t hash, const char* key, int key_len) {
+    if (!disk.enabled) return;
+
+    // The entry itself is freed when its segment is reclaimed
+    pthread_mutex_lock(&disk.mutex);
+    disk_entry* entry = disk_index_find_key(hash, key, key_len);
+    if (entry) {
+        disk_index_unlink(entry);
+    }
+    pthread_mutex_unlock(&disk.mutex);
+}
+
+void disk_cache_stats(long* entries, long* stored, long* dropped, long* reclaimed, size_t* used) {
+    pthread_mutex_lock(&disk.mutex);
+    *entries = disk.count;
+    *stored = disk.stored;
+    *dropped = disk.dropped;
+    *reclaimed = disk.reclaimed;
+    *used = 0;
+    for (int i = 0; i < disk.segment_count; i++) {
+        if (disk.segments[i].state == SEGMENT_ACTIVE || disk.segments[i].state == SEGMENT_SEALED) {
+            *used += disk.segments[i].used;
+        }
+    }
+    pthread_mutex_unlock(&disk.mutex);
+}
+
+void disk_cache_close() {
+    pthread_mutex_lock(&disk.mutex);
+    disk.enabled = 0;
+    for (int i = 0; i < disk.segment_count; i++) {
+        disk_segment* segment = &disk.segments[i];
+        disk_entry* entry = segment->entries;
+        while (entry) {
+            disk_entry* next = entry->segment_next;
+            free(entry);
+            entry = next;
+        }
+        munmap(segment->map, DISK_SEGMENT_SIZE);
+        close(segment->fd);
+    }
+    disk.segment_count = 0;
+    disk.active = -1;
+    free(disk.index);
+    disk.index = NULL;
+    disk.count = 0;
+    pthread_mutex_unlock(&disk.mutex);
+}
@@ -0,0 +1,96 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Disk-backed second cache tier
+ *
+ * Responses evicted from the memory cache are appended to fixed-size
+ * segment files in a cache directory. An in-memory hash index maps key
+ * hashes to record offsets; the keys themselves stay on disk, and are
+ * compared through a read-only mapping of the segment. Hits are sent
+ * straight from the segment file with sendfile(). Once every segment is
+ * in use the oldest one is reclaimed as a whole: its index entries are
+ * dropped and the file is reused as soon as no reader has it pinned.
+ * The tier starts empty, segment files are recreated by disk_cache_init().
+ */
+
+#define DISK_SEGMENT_SIZE (64 << 20)    // Size of one segment file
+#define DISK_MAX_SEGMENTS 1024          // Upper bound on segment files
+#define DISK_INDEX_INITIAL_SIZE 4096    // Initial index bucket count (power of two)
+
+// Metadata stored with each response
+typedef struct disk_cache_meta {
+    time_t creation_time;
+    time_t expires;
+    time_t stale_until;
+    int delimited;                      // Response framing lets the client connection be reused
+} disk_cache_meta;
+
+/*
+ * A pinned response: the segment file cannot be reused until the reference
+ * is released
+ */
+typedef struct disk_cache_ref {
+    int fd;                             // Segment file holding the response
+    off_t offset;                       // Response bytes in the file
+    size_t len;
+    const char* data;                   // The same bytes through the segment mapping
+    disk_cache_meta meta;
+    int segment;
+} disk_cache_ref;
+
+/*
+ * disk_cache_init() creates capacity / DISK_SEGMENT_SIZE segment files in
+ * dir (at least one). Returns 0, or -1 if the directory or files cannot be
+ * set up, leaving the tier disabled.
+ */
+int disk_cache_init(const char* dir, size_t capacity);
+
+/*
+ * disk_cache_enabled() is true once disk_cache_init() succeeded
+ */
+int disk_cache_enabled();
+
+/*
+ * disk_cache_store() appends a response of len bytes, gathered from iov,
+ * replacing any stored copy of the key. Returns 0, or -1 if the response
+ * was not stored (too large, no reclaimable segment or a write error).
+ */
+int disk_cache_store(uint64_t hash, const char* key, int key_len, const disk_cache_meta* meta,
+                     const struct iovec* iov, int iovcnt, size_t len);
+
+/*
+ * disk_cache_lookup() finds a stored response. Returns 1 and a pinned
+ * reference to release with disk_cache_release(), or 0.
+ */
+int disk_cache_lookup(uint64_t hash, const char* key, int key_len, disk_cache_ref* ref);
+
+/*
+ * disk_cache_release() unpins a reference from disk_cache_lookup()
+ */
+void disk_cache_release(disk_cache_ref* ref);
+
+/*
+ * disk_cache_remove() drops the index entry of a key, comparing the
+ * stored key so a colliding one is left alone
+ */
+void disk_cache_remove(uint64_t hash, const char* key, int key_len);
+
+/*
+ * disk_cache_stats() reports indexed responses, responses stored, stores
+ * dropped, segments reclaimed and bytes appended to live segments
+ */
+void disk_cache_stats(long* entries, long* stored, long* dropped, long* reclaimed, size_t* used);
+
+/*
+ * disk_cache_close() unmaps and closes the segment files
+ */
+void disk_cache_close();
+
+#endif /* DISK_CACHE_H */
@@ -1,4 +1,13 @@
+#define _GNU_SOURCE
 #include "proxy_parse.h"
+#include "cache_slab.h"
+#include "resolver.h"
+#include "disk_cache.h"
+#include "cache_sketch.h"
+#include "proxy_stats.h"
+#include "request_reader.h"
+#include "work_queue.h"
+#include "cache_peer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,98 +26,520 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <zlib.h>
 
 #define MAX_BYTES 8192              // Increased buffer size for better performance
+#define UPSTREAM_REQUEST_MAX (MAX_REQ_LEN + MAX_BYTES) // Largest request forwarded upstream
 #define MAX_CLIENTS 1200            // Increased to handle 1000+ concurrent requests
-#define THREAD_POOL_SIZE 50         // Fixed thread pool size
+#define THREAD_POOL_SIZE 50         // Workers started with the thread pool
+#define WORKERS_MIN 8               // Default --workers-min, across all listener groups
+#define WORKERS_MAX 512             // Default --workers-max
+#define WORKERS_TICK_MS 500         // Interval between worker pool sizing decisions
+#define WORKERS_GROW_WAIT_MS 5      // Mean queue wait that calls for more workers...
+#define WORKERS_IO_BOUND_PERCENT 75 // ...when at least this share of them is blocked on I/O
+#define WORKERS_IDLE_TICKS 20       // Ticks with spare workers and an empty queue before some retire
 #define MAX_SIZE 200*(1<<20)        // Size of the cache (200MB)
 #define MAX_ELEMENT_SIZE 10*(1<<20) // Max size of cache element (10MB)
-#define QUEUE_SIZE 2000             // Request queue size
+#define QUEUE_SIZE 2048             // Request queue size per listener group (power of two)
+#define QUEUE_PARK_MS 100           // Longest a parked worker sleeps before it looks for work to steal
 #define CONNECTION_TIMEOUT 30       // Connection timeout in seconds
+#define KEEPALIVE_TIMEOUT 5         // Idle seconds before a persistent client connection is closed
+#define SHUTDOWN_DRAIN_SECONDS 5    // Longest shutdown waits for workers to finish their connections
+#define KEEPALIVE_MAX_REQUESTS 100  // Requests served per persistent client connection
+#define CACHE_KEY_LEN 2048          // Max length of a canonical cache key
+#define CACHE_KEY_GZIP "\naccept-encoding:gzip" // Key suffix of the gzip variant with compressed storage
+#define CACHE_SEGMENT_SIZE (16*1024) // Data bytes per fill segment (served by the largest slab class)
+#define CACHE_INDEX_INITIAL_SIZE 1024 // Initial hash index bucket count per shard (power of two)
+#define CACHE_HEAP_INITIAL_SIZE 1024 // Initial GDSF heap capacity per shard
+#define CACHE_SHARDS 16             // Default cache shard count (power of two)
+#define MAX_CACHE_SHARDS 256        // Upper bound for --cache-shards
+#define EVENT_MAX_LOOPS 64          // Upper bound for --event-loops
+#define MAX_LISTENERS 64            // Upper bound for --listeners
+#define EVENT_MAX_EVENTS 256        // epoll events handled per wakeup
+#define EVENT_MAX_CLIENTS 65536     // Concurrent connection limit in event mode
+#define POOL_BUCKETS 256            // Connection pool hash buckets (power of two)
+#define POOL_MAX_PER_ORIGIN 16      // Idle upstream connections kept per (host, port)
+#define POOL_MAX_IDLE 512           // Idle upstream connections kept in total
+#define POOL_IDLE_TIMEOUT 60        // Seconds an idle upstream connection is kept
+#define POOL_REAP_INTERVAL 5        // Seconds between reaper passes over the pool
+#define HAPPY_EYEBALLS_DELAY_MS 250 // Head start of each upstream address before the next is tried
+#define INFLIGHT_BUCKETS 1024       // Hash buckets of the in-flight fetch table (power of two)
+#define FOLLOW_SOLO 1               // follow_inflight(): response is not shared, fetch it alone
+#define CACHE_HEURISTIC_FRACTION 10 // Heuristic lifetime is 1/N of the time since Last-Modified
+#define CACHE_HEURISTIC_MAX (24*60*60) // Upper bound of a heuristic lifetime in seconds
+#define CACHE_VALIDATOR_LEN 256     // Max length of a stored ETag or Last-Modified value
+#define SEND_IOV_MAX 64             // Segments gathered into one sendmsg() call
+#define RELAY_PIPE_SIZE (64*1024)   // Bytes spliced through the relay pipe per call
+#define DISK_CACHE_SIZE_MB 10240    // Default --disk-cache-size
+#define DEMOTE_QUEUE_MAX (64*(1<<20)) // Bytes of evicted elements waiting to be written to disk
+#define ADMISSION_WINDOW_PERCENT 1  // Share of each shard's budget kept as the admission window
+#define ADMISSION_SKETCH_ITEMS (MAX_SIZE / 4096) // Distinct keys the frequency sketch is sized for
+#define ADMISSION_REJECTED_SLOTS 4096 // Recently rejected keys remembered, for the regret count
+#define COMPRESS_MIN_BYTES 1024     // Bodies smaller than this are stored as they are
+#define COMPRESS_LEVEL 6            // zlib level of bodies compressed in the background
+#define COMPRESS_MIN_SAVING 10      // Percent a gzipped copy must save to replace the original
+#define COMPRESS_QUEUE_SIZE 1024    // Elements waiting for the compressor, more stay uncompressed
+#define SNAPSHOT_INTERVAL 300       // Default --snapshot-interval in seconds
+#define SNAPSHOT_MAGIC 0x50414e53u  // Cache snapshot file marker
+#define SNAPSHOT_VERSION 2
+#define METRICS_PATH "/metrics"     // Path of the stats endpoint served by the proxy itself
+#define PEER_HEADER "X-Proxy-Peer"  // Marks a request fetched on behalf of another node
+#define PEER_CONNECT_TIMEOUT_MS 250 // Longest wait for a connection to a peer
+#define PEER_CHECK_INTERVAL_MS 500  // Interval between liveness checks of the peers
 
-// Enhanced cache element structure
+// Connection engines
+#define MODE_THREAD 0               // Thread pool, one blocking worker per connection
+#define MODE_EVENT  1               // epoll event loops with non-blocking sockets
+
+// Cache admission policies
+#define CACHE_ADMISSION_ALL     0   // Every storable response enters the cache
+#define CACHE_ADMISSION_TINYLFU 1   // W-TinyLFU: new elements pass a small window, then must be
+                                    // more frequent than the victims they would displace
+
+// Compressed cache storage
+#define CACHE_COMPRESS_OFF  0       // Bodies are stored as the origin sent them
+#define CACHE_COMPRESS_GZIP 1       // Text bodies of the gzip variant are gzipped in the background
+
+// Cache replacement policies
+#define CACHE_POLICY_LRU   0        // Strict LRU: hits move to the head under the write lock
+#define CACHE_POLICY_CLOCK 1        // CLOCK: hits set a reference bit under the read lock
+#define CACHE_POLICY_GDSF  2        // Greedy-Dual-Size-Frequency: evicts the element with the lowest
+                                    // inflation + hits * fetch cost / size, kept in a min-heap
+
+#define CACHE_HEAP_NONE ((size_t)-1) // heap_index of an element not on the GDSF heap
+
+// Freshness of a cached element (find_in_cache)
+enum {
+    CACHE_FRESH,                    // Can be served as is
+    CACHE_STALE_USABLE,             // Stale, but may be served while a refresh runs
+    CACHE_STALE                     // Must be revalidated before it is served
+};
+
+// Cache snapshot file layout: a header, then one record per element, each
+// followed by its key and response bytes and padded to 8 bytes. Shards are
+// written least recently used first so loading restores their order.
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+} snapshot_header;
+
+typedef struct snapshot_record {
+    uint32_t key_len;
+    uint32_t data_len;
+    int64_t creation_time;
+    int64_t lru_time;
+    int64_t expires;
+    int64_t stale_until;
+    uint32_t access_count;
+    uint32_t delimited;
+    uint32_t cost_ms;
+    uint32_t reserved;
+} snapshot_record;
+
+// Slab-allocated buffer segment; responses are stored as chains of these
+typedef struct cache_segment {
+    struct cache_segment* next;
+    int len;                        // Bytes used
+    int cap;                        // Bytes available in data
+    char data[];
+} cache_segment;
+
+// Response being accumulated for the cache while it is relayed
+typedef struct cache_fill {
+    cache_segment* head;
+    cache_segment* tail;
+    int total;                      // Bytes buffered so far
+    int checked;                    // Response headers have been inspected
+    int abandoned;                  // Too large or uncacheable, no longer buffering
+    int status;                     // Response status, once checked
+    int sized;                      // Checked response of a known length that fits
+    time_t expires;                 // Freshness computed when the headers were checked
+    time_t stale_until;
+    int cost_ms;                    // Time the origin took to deliver the response
+    int shared;                     // Others may be reading the segments: keep them until the
+                                    // fill is freed rather than freeing or trimming them
+    cache_segment* retired;         // Segments dropped while shared
+} cache_fill;
+
+// Incremental parser that finds where an upstream response ends
+typedef struct response_framer {
+    int state;                      // FRAME_* below
+    char header[MAX_BYTES];         // Header block of the final (non-1xx) response
+    int header_len;
+    int status;
+    int keep_alive;                 // Origin allows another request on the connection
+    long remaining;                 // Body or chunk bytes still expected
+    int line_len;                   // Bytes in the current chunk-size or trailer line
+    int in_extension;               // Skipping a chunk extension
+    long header_bytes;              // Bytes consumed by header blocks, interim ones included
+} response_framer;
+
+enum {
+    FRAME_HEADERS,                  // Collecting the header block
+    FRAME_BODY,                     // Content-Length body
+    FRAME_CHUNK_SIZE,               // Chunk-size line
+    FRAME_CHUNK_DATA,               // Chunk data
+    FRAME_CHUNK_END,                // CRLF after chunk data
+    FRAME_TRAILERS,                 // Trailer section after the last chunk
+    FRAME_UNTIL_CLOSE,              // Body ends when the origin closes
+    FRAME_DONE                      // Response complete
+};
+
+// Enhanced cache element structure. The key and data are immutable once
+// the element is published; readers hold a reference while using them.
 typedef struct cache_element {
-    char* data;                     // Response data
+    cache_segment* segments;        // Response data, handed over from the fill
     int len;                        // Length of data
-    char* url;                      // Request URL (key)
+    int size;                       // Slab bytes used by the element, accounted against the shard budget
+    int delimited;                  // Response framing lets the client connection be reused
+    char* url;                      // Canonical cache key (see build_cache_key), stored inline after the element
+    int url_len;                    // Length of the cache key
     time_t lru_time_track;          // LRU timestamp
     time_t creation_time;           // Cache creation time
+    time_t expires;                 // Fresh until (atomic, refreshed by revalidation)
+    time_t stale_until;             // May be served stale while refreshing until (atomic)
+    int refreshing;                 // A background refresh is running (atomic)
+    char* etag;                     // Validators sent when revalidating, stored inline after the key
+    char* last_modified;            // (empty if the response had none)
     int access_count;               // Access frequency counter
+    int referenced;                 // CLOCK reference bit, set atomically on hits
+    int in_window;                  // On the shard's admission window rather than its main list
+    int cost_ms;                    // Origin fetch time, the GDSF cost of a miss
+    double priority;                // GDSF priority, set while the element is on the heap
+    size_t heap_index;              // Position on the shard's GDSF heap, or CACHE_HEAP_NONE
+    int refcount;                   // One for the cache, one per in-flight reader
+    uint64_t hash;                  // Hash of the cache key, compared before the key itself
     struct cache_element* next;     // Next element pointer
     struct cache_element* prev;     // Previous element pointer (for O(1) removal)
+    struct cache_element* hash_next; // Next element in the same index bucket
 } cache_element;
 
-// Work queue structure for thread pool
-typedef struct work_item {
-    int client_socket;
-    struct sockaddr_in client_addr;
-    struct work_item* next;
-} work_item;
+// Canonical cache key built from the parsed request
+typedef struct cache_key {
+    char str[CACHE_KEY_LEN];        // "METHOD http://host:port/path" plus keyed headers
+    int len;
+    uint64_t hash;
+} cache_key;
+
+// Request headers that select a cached variant. Responses that Vary on
+// anything else are not cached, since their key could not tell them apart.
+static const char* cache_key_headers[] = { "Accept-Encoding", NULL };
+
+// States of an in-flight fetch
+enum {
+    INFLIGHT_FILLING,               // Leader is receiving the response
+    INFLIGHT_DONE,                  // Response complete, all of it is in the segments
+    INFLIGHT_FAILED,                // Leader gave up before the response completed
+    INFLIGHT_UNCACHEABLE            // Response is not being buffered, followers can't share it
+};
+
+struct event_conn;
+
+// A cache miss being fetched by one request (the leader) while others for
+// the same key (followers) stream the response from its fill as it arrives
+typedef struct cache_inflight {
+    cache_key key;
+    cache_fill fill;
+    cache_segment* head;            // First segment, where followers start reading
+    int state;                      // INFLIGHT_* above
+    int finished;                   // Leader has called cache_inflight_finish()
+    int revalidating;               // Leader sent a conditional request for a stale element
+    int peered;                     // Fetched from the owning peer: shared, but stored there only
+    int delimited;                  // Response framing lets client connections be reused
+    int leader_behind;              // Leader's own client is still being sent the segments
+    cache_element* element;         // Cache element now owning the segments, if shared
+    int refcount;                   // Leader plus followers
+    int listed;                     // Still in the in-flight table, joinable
+    struct event_conn* waiters;     // Event engine followers waiting for more data
+    pthread_mutex_t mutex;          // Protects everything above
+    pthread_cond_t cond;            // Broadcast to thread engine followers on progress
+    struct cache_inflight* next;    // Next fetch in the same table bucket
+} cache_inflight;
 
-typedef struct work_queue {
-    work_item* head;
-    work_item* tail;
+// Thread engine listener group: a listening socket with its own accept
+// thread, queue and workers. With --reuseport every group binds its own
+// SO_REUSEPORT socket and its threads are pinned to one CPU, so the kernel
+// spreads connections over the groups and each is served where it was
+// accepted. Otherwise there is a single unpinned group. Workers with an
+// empty queue steal from the other groups before they park.
+typedef struct listener_group {
+    int socket;
+    int cpu;                        // CPU the group's threads run on, -1 if not pinned
+    work_queue queue;
+    pthread_t accept_thread;
+    long accepted;                  // Connections accepted (atomic)
+    long stolen;                    // Connections its workers took from other groups (atomic)
+    
+    // Adaptive worker pool, sized by worker_pool_thread() between its bounds
+    int min_workers;
+    int max_workers;
+    int workers;                    // Live worker threads (atomic)
+    int busy;                       // Workers serving a connection (atomic)
+    int io_blocked;                 // Workers waiting on a socket or another fetch (atomic)
+    int retiring;                   // Workers asked to exit once idle (atomic)
+    long dequeued;                  // Connections taken by its workers (atomic)
+    long wait_us;                   // Total time those spent queued (atomic)
+} listener_group;
+
+// Idle connections to one upstream (host, port), kept as a LIFO stack so
+// the most recently used (warmest) socket is handed out first
+typedef struct pool_origin {
+    char* host;
+    int port;
+    uint64_t hash;
+    int sockets[POOL_MAX_PER_ORIGIN]; // Oldest at 0, top of the stack at count - 1
+    time_t last_used[POOL_MAX_PER_ORIGIN];
     int count;
+    struct pool_origin* next;       // Next origin in the same bucket
+} pool_origin;
+
+typedef struct pool_bucket {
+    pool_origin* origins;
     pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-} work_queue;
+} pool_bucket;
 
-// Connection pool for upstream servers
+// Connection pool for upstream servers, hashed by origin with a lock per bucket
 typedef struct connection_pool {
-    int* sockets;
-    char** hosts;
-    int* ports;
-    time_t* last_used;
-    int size;
-    int capacity;
-    pthread_mutex_t mutex;
+    pool_bucket buckets[POOL_BUCKETS];
+    int idle;                       // Idle connections across all origins (atomic)
+    long reused;                    // Checkouts that returned a live connection (atomic)
+    long stale;                     // Idle connections found closed by the peer (atomic)
 } connection_pool;
 
+// Cache shard: an independent LRU list, hash index and share of the size
+// budget, which it may borrow past while the cache has room. Under
+// TinyLFU admission new elements first go to a small window list. Under
+// GDSF the main list elements are also kept on a binary min-heap ordered
+// by priority.
+typedef struct cache_shard {
+    cache_element* head;            // Most recently used element
+    cache_element* tail;            // Least recently used element
+    cache_element* window_head;     // Admission window, most recently used first
+    cache_element* window_tail;
+    int size;                       // Bytes accounted to this shard, window included
+    int budget;                     // Share of MAX_SIZE, exceeded while the cache as a whole has room
+    int window_size;                // Bytes on the admission window
+    int window_budget;
+    cache_element** heap;           // GDSF heap, lowest priority at 0
+    size_t heap_len;
+    size_t heap_cap;
+    double inflation;               // GDSF clock: priority of the last evicted element
+    cache_element** index;          // Hash index over the LRU list (chained buckets)
+    size_t index_size;              // Number of buckets, always a power of two
+    size_t count;                   // Number of elements in the shard
+    pthread_rwlock_t rwlock;        // Protects everything above
+} cache_shard;
+
+// Runtime configuration, overridable from the command line
+struct {
+    int cache_shards;
+    int cache_policy;
+    int cache_admission;
+    int cache_compress;
+    int mode;
+    int event_loops;                // 0 means one per online CPU
+    int reuseport;                  // One SO_REUSEPORT listener per group or event loop, pinned
+    int listeners;                  // Thread engine listener groups, 0 means one per usable CPU
+    int workers_min;                // Worker pool bounds, across all listener groups
+    int workers_max;
+    const char* disk_cache_dir;     // Disk tier directory, NULL when disabled
+    long disk_cache_size;           // Disk tier size in MB
+    const char* snapshot_path;      // Cache snapshot file, NULL when disabled
+    int snapshot_interval;          // Seconds between periodic snapshots
+    const char* peers;              // Members of the cache peering ring, NULL when disabled
+    const char* peer_self;          // This node's member name in peers
+} config = {
+    .cache_shards = CACHE_SHARDS,
+    .cache_policy = CACHE_POLICY_LRU,
+    .cache_admission = CACHE_ADMISSION_ALL,
+    .cache_compress = CACHE_COMPRESS_OFF,
+    .mode = MODE_THREAD,
+    .event_loops = 0,
+    .reuseport = 0,
+    .listeners = 0,
+    .workers_min = WORKERS_MIN,
+    .workers_max = WORKERS_MAX,
+    .disk_cache_dir = NULL,
+    .disk_cache_size = DISK_CACHE_SIZE_MB,
+    .snapshot_path = NULL,
+    .snapshot_interval = SNAPSHOT_INTERVAL,
+    .peers = NULL,
+    .peer_self = NULL,
+};
+
 // Global variables
 int port_number = 8080;
 int proxy_socketId;
-pthread_t worker_threads[THREAD_POOL_SIZE];
-work_queue request_queue;
+listener_group listener_groups[MAX_LISTENERS];
+int listener_group_count;
+static __thread listener_group* worker_group; // Group of the calling worker thread, NULL elsewhere
+
+// Worker pool scaling totals (atomic)
+struct {
+    long started;                   // Workers added on demand
+    long retired;                   // Idle workers retired
+} worker_pool;
 pthread_mutex_t connection_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t connection_available = PTHREAD_COND_INITIALIZER;
 int active_connection_count = 0;
-volatile int server_running = 1;
+volatile sig_atomic_t server_running = 1;
+sigset_t shutdown_signals;          // Handled by the main thread only, see main()
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER; // One snapshot writer at a time
 
-// Cache globals with enhanced thread safety
-cache_element* cache_head;
-cache_element* cache_tail;
-int cache_size;
-pthread_rwlock_t cache_rwlock;  // Read-write lock for better performance
+// Cache globals: the cache is split into shards selected by key hash
+cache_shard* cache_shards;
+int cache_shard_count;
 pthread_mutex_t cache_stats_mutex;
 
-// Performance statistics
+// TinyLFU admission state. Counters are atomic since they are updated
+// under shard locks.
+struct {
+    cache_sketch* sketch;           // Access frequency of keys, hits and misses alike
+    long admitted;                  // Window elements moved to a main list
+    long rejected;                  // Window elements dropped in favour of the main list victim
+    long rejected_misses;           // Misses on keys rejected earlier (the filter's regret)
+    uint64_t rejected_keys[ADMISSION_REJECTED_SLOTS]; // Hashes of recent rejections (atomic)
+} admission;
+
+// Fetches in flight, by cache key
+struct {
+    cache_inflight* buckets[INFLIGHT_BUCKETS];
+    pthread_mutex_t mutex;
+} inflight_table = {{NULL}, PTHREAD_MUTEX_INITIALIZER};
+
+// Elements evicted for space, waiting to be written to the disk tier
+// (linked through next)
+struct {
+    cache_element* head;
+    cache_element* tail;
+    long bytes;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+} demote_queue = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// Elements waiting for background compression, each holding a reference
 struct {
-    long total_requests;
-    long cache_hits;
-    long cache_misses;
-    long bytes_served;
-    double avg_response_time;
+    cache_element* elements[COMPRESS_QUEUE_SIZE];
+    int head;
+    int count;
     pthread_mutex_t mutex;
-} stats = {0, 0, 0, 0, 0.0, PTHREAD_MUTEX_INITIALIZER};
+    pthread_cond_t ready;
+} compress_queue = {{NULL}, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
 // Connection pool
-connection_pool conn_pool = {NULL, NULL, NULL, NULL, 0, 100, PTHREAD_MUTEX_INITIALIZER};
+connection_pool conn_pool;
 
 // Function prototypes
 void* worker_thread(void* arg);
-void enqueue_request(int client_socket, struct sockaddr_in client_addr);
-work_item* dequeue_request();
+void* event_loop_thread(void* arg);
+void run_event_loops();
+void run_stats_loop();
+void enqueue_request(work_queue* queue, int client_socket, struct sockaddr_in client_addr);
+int dequeue_request(listener_group* group, work_item* item);
+int open_listener(int reuseport);
+int usable_cpus(int* cpus, int max);
+void pin_thread(pthread_t thread, int cpu);
+void* accept_thread(void* arg);
+void start_listener_groups();
+int start_worker(listener_group* group);
+void worker_pool_counts(int* workers, int* busy, int* blocked);
+void* worker_pool_thread(void* arg);
 void init_connection_pool();
 int get_pooled_connection(char* host, int port);
 void return_pooled_connection(int socket, char* host, int port);
-cache_element* find_in_cache(char* url);
-int add_to_cache(char* data, int size, char* url);
-void remove_lru_element();
+void* pool_reaper_thread(void* arg);
+int build_cache_key(ParsedRequest *request, cache_key *key);
+int response_vary_is_keyed(const char* response, int len);
+int find_response_header(const char* response, int len, const char* name, char* value, size_t value_len);
+cache_element* find_in_cache(cache_key* key, int* freshness);
+int cache_element_freshness(cache_element* element, time_t now);
+void cache_element_revalidated(cache_element* element, const char* response, int len);
+time_t parse_http_date(const char* value);
+int response_lifetime(const char* response, int len, time_t now, int aged, time_t* expires, time_t* stale_until);
+int response_is_storable(const char* response, int len, time_t now, time_t* expires, time_t* stale_until);
+void add_validators(ParsedRequest* request, cache_element* stale);
+void cache_refresh_start(const char* raw_request, int len, cache_key* key, cache_element* stale);
+void* cache_refresh_thread(void* arg);
+void release_cache_element(cache_element* element);
+void cache_demote(cache_element* element);
+void* disk_writer_thread(void* arg);
+void cache_compress_enqueue(cache_element* element);
+void* cache_compress_thread(void* arg);
+int find_on_disk(cache_key* key, disk_cache_ref* ref);
+int send_disk_element(int socket, disk_cache_ref* ref);
+int add_to_cache(cache_fill* fill, cache_key* key, cache_element** ref);
+void cache_fill_init(cache_fill* fill);
+char* cache_fill_space(cache_fill* fill, int* avail);
+void cache_fill_commit(cache_fill* fill, int bytes);
+int cache_fill_append(cache_fill* fill, const char* data, int len);
+void cache_fill_check(cache_fill* fill, int complete);
+void cache_fill_abandon(cache_fill* fill);
+cache_inflight* cache_inflight_create(cache_key* key);
+cache_inflight* cache_inflight_join(cache_key* key, int* leader);
+char* cache_inflight_space(cache_inflight* inflight, int* avail);
+int cache_inflight_filling(cache_inflight* inflight);
+int cache_inflight_followed(cache_inflight* inflight);
+void cache_inflight_commit(cache_inflight* inflight, int bytes);
+void cache_inflight_finish(cache_inflight* inflight, int complete, int delimited);
+void cache_inflight_revalidated(cache_inflight* inflight, cache_element* element);
+int cache_inflight_next(cache_inflight* inflight, cache_segment** segment, int* offset, const char** data);
+void cache_inflight_leave(cache_inflight* inflight, struct event_conn* conn);
+void cache_inflight_release(cache_inflight* inflight);
+int leader_send_fill(int socket, cache_inflight* inflight, cache_segment** segment, int* offset, int wait);
+int leader_fill_unsent(cache_inflight* inflight, cache_segment** segment, int* offset);
+void leader_fill_skip(cache_inflight* inflight, cache_segment** segment, int* offset, long bytes);
+int follow_inflight(int client_socket, cache_inflight* inflight, int* reusable);
+int fetch_coalesced(int client_socket, ParsedRequest* request, cache_key* key, cache_element* stale, int* reusable);
+void event_wake_followers(struct event_conn* conn);
+int send_cache_element(int socket, cache_element* element);
+int segment_iov(cache_segment* segment, int offset, struct iovec* iov, int max);
+void segment_advance(cache_segment** segment, int* offset, size_t bytes);
+int framer_advance(response_framer* framer, long bytes);
+long framer_splice_len(response_framer* framer);
+ssize_t splice_body(int from, int to, int pipe_fds[2], long len, int* client_failed);
+int remove_lru_element(cache_shard* spare);
+void init_cache();
+int cache_total_size();
+int parse_options(int argc, char *argv[]);
 void update_cache_stats();
-int handle_request_optimized(int client_socket, ParsedRequest *request, char *temp_req);
+int handle_request_optimized(int client_socket, ParsedRequest *request, cache_inflight *inflight,
+                             cache_element *stale, int *reusable);
+int send_all(int socket, const char* data, int len);
+int response_is_delimited(const char* response, int len);
+void framer_init(response_framer* framer);
+int framer_feed(response_framer* framer, const char* data, int len);
+void framer_eof(response_framer* framer);
+int framer_reusable(response_framer* framer);
+int open_remote_connection(char* host_addr, int port_num);
+int open_upstream_connection(char* host_addr, int port_num, int timeout_ms);
+int connect_peer(cache_peer* peer, int* pooled);
+cache_peer* peer_for_fetch(ParsedRequest* request, cache_inflight* inflight);
+void peer_fetch_failed(cache_peer* peer, cache_inflight* inflight);
+void* cache_peer_check_thread(void* arg);
+int connect_happy_eyeballs(resolver_addrs* addrs, int port_num, int timeout_ms);
+int client_wants_keepalive(ParsedRequest *request);
+int accepts_gzip(const char* accept_encoding);
+void serve_client_connection(int client_socket, work_queue* queue);
+int build_upstream_request(ParsedRequest *request, char *buf, int buflen, int to_peer);
+void record_response_stats(struct timeval *start_time, int bytes);
+void record_request_stats(int outcome, struct timeval *start_time);
+int is_metrics_request(const char* request, int len);
+char* build_metrics_response(int* len);
 int setup_nonblocking_socket(int socket);
 void cleanup_resources();
+int cache_snapshot_write(const char* path);
+int cache_snapshot_load(const char* path);
+void* cache_snapshot_thread(void* arg);
 void signal_handler(int sig);
 void print_stats();
 
@@ -140,10 +571,18 @@ int sendErrorMessage(int socket, int status_code) {
             status_text = "Internal Server Error";
             html_content = "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>";
             break;
+        case 431:
+            status_text = "Request Header Fields Too Large";
+            html_content = "<HTML><HEAD><TITLE>431 Request Header Fields Too Large</TITLE></HEAD>\n<BODY><H1>431 Request Header Fields Too Large</H1>\n</BODY></HTML>";
+            break;
         case 501:
             status_text = "Not Implemented";
             html_content = "<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>";
             break;
+        case 503:
+            status_text = "Service Unavailable";
+            html_content = "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>";
+            break;
         case 505:
             status_text = "HTTP Version Not Supported";
             html_content = "<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>";
@@ -151,6 +590,7 @@ int sendErrorMessage(int socket, int status_code) {
         default:
             return -1;
     }
+    stats_add(STATS_ERRORS, 1);
 
     int content_len = strlen(html_content);
     snprintf(str, sizeof(str), 
@@ -166,526 +606,4936 @@ int sendErrorMessage(int socket, int status_code) {
     return send(socket, str, strlen(str), MSG_NOSIGNAL);
 }
 
-// Enhanced connection establishment with timeout and connection pooling
-int connectRemoteServer(char* host_addr, int port_num) {
+// Workers count themselves while blocked on I/O, which tells the pool
+// sizing whether more threads would help
+static inline void worker_io_begin() {
+    if (worker_group) __atomic_add_fetch(&worker_group->io_blocked, 1, __ATOMIC_RELAXED);
+}
+
+static inline void worker_io_end() {
+    if (worker_group) __atomic_sub_fetch(&worker_group->io_blocked, 1, __ATOMIC_RELAXED);
+}
+
+// Enhanced connection establishment with timeout and connection pooling.
+// Sets *pooled when the connection came from the pool, since the origin
+// may have closed it while it was idle.
+int connectRemoteServer(char* host_addr, int port_num, int* pooled) {
     // Try to get connection from pool first
     int remoteSocket = get_pooled_connection(host_addr, port_num);
     if (remoteSocket > 0) {
+        *pooled = 1;
         return remoteSocket;
     }
 
-    // Create new connection
-    remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (remoteSocket < 0) {
-        perror("Error creating socket");
-        return -1;
-    }
-
-    // Set socket to non-blocking for timeout control
-    setup_nonblocking_socket(remoteSocket);
+    *pooled = 0;
+    return open_remote_connection(host_addr, port_num);
+}
 
-    // Set socket options for performance
-    int opt = 1;
-    setsockopt(remoteSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(remoteSocket, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+// Open a new upstream connection
+int open_remote_connection(char* host_addr, int port_num) {
+    return open_upstream_connection(host_addr, port_num, CONNECTION_TIMEOUT * 1000);
+}
 
-    struct hostent *host = gethostbyname(host_addr);
-    if (host == NULL) {
+// Open a new upstream connection, giving up on connecting after timeout_ms
+int open_upstream_connection(char* host_addr, int port_num, int timeout_ms) {
+    resolver_addrs addrs;
+    worker_io_begin();
+    int resolved = resolver_lookup(host_addr, &addrs);
+    worker_io_end();
+    if (resolved != RESOLVER_OK) {
         fprintf(stderr, "Host resolution failed for %s\n", host_addr);
-        close(remoteSocket);
         return -1;
     }
 
-    struct sockaddr_in server_addr;
-    bzero((char*)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-    bcopy((char *)host->h_addr, (char *)&server_addr.sin_addr.s_addr, host->h_length);
-
-    // Connect with timeout
-    int result = connect(remoteSocket, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    if (result < 0 && errno != EINPROGRESS) {
-        close(remoteSocket);
+    int remoteSocket = connect_happy_eyeballs(&addrs, port_num, timeout_ms);
+    if (remoteSocket < 0) {
         return -1;
     }
 
-    // Wait for connection to complete with timeout
-    if (errno == EINPROGRESS) {
-        fd_set write_fds;
-        struct timeval timeout;
-        FD_ZERO(&write_fds);
-        FD_SET(remoteSocket, &write_fds);
-        timeout.tv_sec = CONNECTION_TIMEOUT;
-        timeout.tv_usec = 0;
-
-        result = select(remoteSocket + 1, NULL, &write_fds, NULL, &timeout);
-        if (result <= 0) {
-            close(remoteSocket);
-            return -1;
-        }
-
-        int so_error;
-        socklen_t len = sizeof(so_error);
-        getsockopt(remoteSocket, SOL_SOCKET, SO_ERROR, &so_error, &len);
-        if (so_error != 0) {
-            close(remoteSocket);
-            return -1;
-        }
-    }
+    // Set socket options for performance
+    int opt = 1;
+    setsockopt(remoteSocket, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
 
-    // Set back to blocking mode for data transfer
+    // Set back to blocking mode for data transfer, bounding each read
     int flags = fcntl(remoteSocket, F_GETFL, 0);
     fcntl(remoteSocket, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval read_timeout = { .tv_sec = CONNECTION_TIMEOUT, .tv_usec = 0 };
+    setsockopt(remoteSocket, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
 
     return remoteSocket;
 }
 
-// Optimized request handling with better memory management and performance
-int handle_request_optimized(int client_socket, ParsedRequest *request, char *temp_req)  {
-    struct timeval start_time, end_time;
-    gettimeofday(&start_time, NULL);
+// Cache peering: a miss on a key that another node of the ring owns is
+// fetched through that node, which answers from its cache or fetches and
+// stores it. The response is relayed (and shared with local followers)
+// but not stored here, so each object is cached once across the fleet.
 
-    char *send_buffer = (char*)malloc(MAX_BYTES);
-    if (!send_buffer) {
-        return -1;
+// Connection to a peer, pooled like origin connections but opened with a
+// short timeout so a dead peer is given up on quickly
+int connect_peer(cache_peer* peer, int* pooled) {
+    int peerSocket = get_pooled_connection(peer->host, peer->port);
+    if (peerSocket > 0) {
+        *pooled = 1;
+        return peerSocket;
     }
+    *pooled = 0;
+    return open_upstream_connection(peer->host, peer->port, PEER_CONNECT_TIMEOUT_MS);
+}
 
-    // Build HTTP request more efficiently
-    int len = snprintf(send_buffer, MAX_BYTES, 
-        "GET %s %s\r\n"
-        "Host: %s\r\n"
-        "Connection: keep-alive\r\n"
-        "User-Agent: HighPerformanceProxy/2.0\r\n",
-        request->path, request->version, request->host);
-       int server_port = (request->port != NULL) ? atoi(request->port) : 80;
-    if (ParsedRequest_unparse_headers(request, send_buffer + len, MAX_BYTES - len) < 0) {
-        printf("Warning: Header unparsing failed, proceeding anyway\n");
+// The peer a miss is to be fetched from, or NULL for the origin. Requests
+// a peer sent are never passed on, nor are uncacheable ones.
+cache_peer* peer_for_fetch(ParsedRequest* request, cache_inflight* inflight) {
+    if (!config.peers || inflight->state != INFLIGHT_FILLING || ParsedRequest_getHeader(request, PEER_HEADER)) {
+        return NULL;
+    }
+    cache_peer* peer = cache_peer_owner(inflight->key.hash);
+    if (peer) {
+        inflight->peered = 1;
+        __atomic_add_fetch(&peer->fetches, 1, __ATOMIC_RELAXED);
+        stats_add(STATS_PEER_FETCHES, 1);
     }
+    return peer;
+}
 
-   
-    int remoteSocket = connectRemoteServer(request->host, server_port);
+// A peer could not be reached or closed without answering: mark it down
+// until the checker sees it again, the fetch goes to the origin instead
+void peer_fetch_failed(cache_peer* peer, cache_inflight* inflight) {
+    fprintf(stderr, "Peer %s:%d failed, fetching from the origin\n", peer->host, peer->port);
+    cache_peer_set_down(peer, 1);
+    __atomic_add_fetch(&peer->failures, 1, __ATOMIC_RELAXED);
+    stats_add(STATS_PEER_FAILURES, 1);
+    inflight->peered = 0;
+}
 
-    if (remoteSocket < 0) {
-        free(send_buffer);
-        return -1;
+// Checks every other member of the ring by connecting to it, so a failed
+// peer is skipped within a check interval and a recovered one used again
+void* cache_peer_check_thread(void* arg) {
+    while (server_running) {
+        for (int i = 0; i < cache_peer_count(); i++) {
+            cache_peer* peer = cache_peer_at(i);
+            if (peer->self) continue;
+            int checkSocket = open_upstream_connection(peer->host, peer->port, PEER_CONNECT_TIMEOUT_MS);
+            int down = checkSocket < 0;
+            if (!down) close(checkSocket);
+            if (down != __atomic_load_n(&peer->down, __ATOMIC_RELAXED)) {
+                printf("Peer %s:%d is %s\n", peer->host, peer->port, down ? "down" : "up");
+                cache_peer_set_down(peer, down);
+            }
+        }
+        usleep(PEER_CHECK_INTERVAL_MS * 1000);
     }
+    return NULL;
+}
 
-    // Send request to upstream server
-    ssize_t bytes_sent = send(remoteSocket, send_buffer, strlen(send_buffer), MSG_NOSIGNAL);
-    if (bytes_sent < 0) {
-        close(remoteSocket);
-        free(send_buffer);
-        return -1;
-    }
+static long elapsed_ms(struct timeval* since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
 
-    // Receive and forward response with dynamic buffer
-    char *response_buffer = (char*)malloc(MAX_ELEMENT_SIZE);
-    if (!response_buffer) {
-        close(remoteSocket);
-        free(send_buffer);
-        return -1;
-    }
+static long elapsed_us(struct timeval* since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_usec - since->tv_usec);
+}
 
-    int total_received = 0;
-    int buffer_size = MAX_ELEMENT_SIZE;
-    ssize_t bytes_received;
+// Happy-eyeballs connect (RFC 8305): start with the first address and, while
+// attempts are still pending, start the next one every HAPPY_EYEBALLS_DELAY_MS
+// (or at once when one fails). The first connection to complete wins.
+// Returns a non-blocking connected socket, or -1.
+int connect_happy_eyeballs(resolver_addrs* addrs, int port_num, int timeout_ms) {
+    struct pollfd attempts[RESOLVER_MAX_ADDRS];
+    int started = 0, pending = 0, winner = -1;
+    int start_now = 1;
+    struct timeval start, last_start;
+    gettimeofday(&start, NULL);
+    last_start = start;
 
-    while ((bytes_received = recv(remoteSocket, send_buffer, MAX_BYTES - 1, 0)) > 0) {
-        // Forward to client immediately for better latency
-        ssize_t bytes_forwarded = send(client_socket, send_buffer, bytes_received, MSG_NOSIGNAL);
-        if (bytes_forwarded < 0) {
-            break;
+    while (winner < 0) {
+        long since_start = elapsed_ms(&last_start);
+        if (started < addrs->count && (start_now || since_start >= HAPPY_EYEBALLS_DELAY_MS)) {
+            struct sockaddr_storage addr = addrs->addrs[started];
+            resolver_set_port(&addr, port_num);
+            attempts[started].fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            attempts[started].events = POLLOUT;
+            attempts[started].revents = 0;
+            gettimeofday(&last_start, NULL);
+            
+            int fd = attempts[started].fd;
+            if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, addrs->lens[started]) == 0) {
+                winner = fd;
+                attempts[started].fd = -1;
+            } else if (fd >= 0 && errno == EINPROGRESS) {
+                pending++;
+                start_now = 0;
+            } else {
+                if (fd >= 0) close(fd);
+                attempts[started].fd = -1;
+                start_now = 1;
+            }
+            started++;
+            continue;
         }
-
-        // Store in response buffer for caching
-        if (total_received + bytes_received < buffer_size) {
-            memcpy(response_buffer + total_received, send_buffer, bytes_received);
-            total_received += bytes_received;
-        } else if (total_received < MAX_ELEMENT_SIZE) {
-            // Expand buffer if needed
-            buffer_size = total_received + bytes_received + MAX_BYTES;
-            if (buffer_size <= MAX_ELEMENT_SIZE) {
-                response_buffer = (char*)realloc(response_buffer, buffer_size);
-                if (response_buffer) {
-                    memcpy(response_buffer + total_received, send_buffer, bytes_received);
-                    total_received += bytes_received;
-                }
+        if (pending == 0) break; // Every address failed
+        
+        long remaining = timeout_ms - elapsed_ms(&start);
+        if (remaining <= 0) break;
+        long wait = remaining;
+        if (started < addrs->count && HAPPY_EYEBALLS_DELAY_MS - since_start < wait) {
+            wait = HAPPY_EYEBALLS_DELAY_MS - since_start;
+        }
+        
+        worker_io_begin();
+        int ready = poll(attempts, started, wait);
+        worker_io_end();
+        if (ready < 0 && errno != EINTR) break;
+        for (int i = 0; i < started && ready > 0 && winner < 0; i++) {
+            if (attempts[i].fd < 0 || attempts[i].revents == 0) continue;
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error == 0) {
+                winner = attempts[i].fd;
+            } else {
+                close(attempts[i].fd);
+                start_now = 1;
             }
+            attempts[i].fd = -1;
+            pending--;
         }
     }
-
-    if (total_received > 0) {
-        response_buffer[total_received] = '\0';
-        add_to_cache(response_buffer, total_received, temp_req);
-        
-        // Update statistics
-        pthread_mutex_lock(&stats.mutex);
-        stats.bytes_served += total_received;
-        gettimeofday(&end_time, NULL);
-        double response_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0 + 
-                              (end_time.tv_usec - start_time.tv_usec) / 1000.0;
-        stats.avg_response_time = (stats.avg_response_time * stats.total_requests + response_time) / 
-                                 (stats.total_requests + 1);
-        stats.total_requests++;
-        pthread_mutex_unlock(&stats.mutex);
+    
+    // Abandon the attempts that lost the race
+    for (int i = 0; i < started; i++) {
+        if (attempts[i].fd >= 0) close(attempts[i].fd);
     }
+    return winner;
+}
 
-    // Try to return connection to pool instead of closing
-    return_pooled_connection(remoteSocket, request->host, server_port);
-    
-    free(send_buffer);
-    free(response_buffer);
-    return 0;
+// Wait until a socket is ready, returns 1 when ready, 0 on timeout, -1 on error
+static int wait_socket(int socket, short events, int timeout_ms) {
+    struct pollfd pfd = { .fd = socket, .events = events, .revents = 0 };
+    int ready;
+    worker_io_begin();
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    worker_io_end();
+    return ready;
 }
 
-// Optimized cache lookup with read-write locks
-cache_element* find_in_cache(char* url) {
-    pthread_rwlock_rdlock(&cache_rwlock);
-    
-    cache_element* current = cache_head;
-    while (current != NULL) {
-        if (strcmp(current->url, url) == 0) {
-            // Move to front (most recently used)
-            pthread_rwlock_unlock(&cache_rwlock);
-            pthread_rwlock_wrlock(&cache_rwlock);
-            
-            // Double-check the element still exists
-            if (current && strcmp(current->url, url) == 0) {
-                current->lru_time_track = time(NULL);
-                current->access_count++;
-                
-                // Move to front if not already there
-                if (current != cache_head) {
-                    // Remove from current position
-                    if (current->prev) current->prev->next = current->next;
-                    if (current->next) current->next->prev = current->prev;
-                    if (current == cache_tail) cache_tail = current->prev;
-                    
-                    // Move to front
-                    current->prev = NULL;
-                    current->next = cache_head;
-                    if (cache_head) cache_head->prev = current;
-                    cache_head = current;
-                    if (!cache_tail) cache_tail = current;
-                }
-                
-                pthread_rwlock_unlock(&cache_rwlock);
-                
-                // Update statistics
-                pthread_mutex_lock(&stats.mutex);
-                stats.cache_hits++;
-                pthread_mutex_unlock(&stats.mutex);
-                
-                return current;
+// Send a whole buffer on a possibly non-blocking socket
+int send_all(int socket, const char* data, int len) {
+    int sent = 0;
+    while (sent < len) {
+        ssize_t bytes_sent = send(socket, data + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_socket(socket, POLLOUT, CONNECTION_TIMEOUT * 1000) > 0) {
+                continue;
             }
-            pthread_rwlock_unlock(&cache_rwlock);
-            return NULL;
+            return -1;
         }
-        current = current->next;
+        sent += bytes_sent;
     }
-    
-    pthread_rwlock_unlock(&cache_rwlock);
-    
-    // Update statistics
-    pthread_mutex_lock(&stats.mutex);
-    stats.cache_misses++;
-    pthread_mutex_unlock(&stats.mutex);
-    
-    return NULL;
+    return 0;
 }
 
-// Enhanced LRU removal with better algorithm
-void remove_lru_element() {
-    pthread_rwlock_wrlock(&cache_rwlock);
-    
-    if (!cache_tail) {
-        pthread_rwlock_unlock(&cache_rwlock);
-        return;
-    }
-    
-    cache_element* lru = cache_tail;
-    time_t oldest_time = lru->lru_time_track;
+// Move up to len body bytes from one socket to another through a pipe,
+// without copying them through user space. Blocks on `from` like recv().
+// Returns the bytes moved, 0 at end of stream or -1 on an upstream error.
+// *client_failed is set if `to` failed, which leaves data in the pipe.
+ssize_t splice_body(int from, int to, int pipe_fds[2], long len, int* client_failed) {
+    ssize_t moved;
+    worker_io_begin();
+    do {
+        moved = splice(from, NULL, pipe_fds[1], NULL, len, SPLICE_F_MOVE);
+    } while (moved < 0 && errno == EINTR);
+    worker_io_end();
+    if (moved <= 0) return moved;
     
-    // Find least recently used element
-    cache_element* current = cache_tail;
-    while (current != NULL) {
-        if (current->lru_time_track < oldest_time) {
-            oldest_time = current->lru_time_track;
-            lru = current;
+    ssize_t left = moved;
+    while (left > 0) {
+        ssize_t out = splice(pipe_fds[0], NULL, to, NULL, left, SPLICE_F_MOVE);
+        if (out < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_socket(to, POLLOUT, CONNECTION_TIMEOUT * 1000) > 0) {
+                continue;
+            }
+            if (errno == EINTR) continue;
+            *client_failed = 1;
+            break;
         }
-        current = current->prev;
+        left -= out;
     }
-    
-    // Remove the LRU element
-    if (lru->prev) lru->prev->next = lru->next;
-    if (lru->next) lru->next->prev = lru->prev;
-    if (lru == cache_head) cache_head = lru->next;
-    if (lru == cache_tail) cache_tail = lru->prev;
-    
-    cache_size -= (lru->len + strlen(lru->url) + sizeof(cache_element));
-    
-    free(lru->data);
-    free(lru->url);
-    free(lru);
-    
-    pthread_rwlock_unlock(&cache_rwlock);
+    return moved;
 }
 
-// Optimized cache addition
-int add_to_cache(char* data, int size, char* url) {
-    int element_size = size + strlen(url) + sizeof(cache_element);
-    
-    if (element_size > MAX_ELEMENT_SIZE) {
-        return 0;
-    }
-    
-    pthread_rwlock_wrlock(&cache_rwlock);
-    
-    // Make space if needed
-    while (cache_size + element_size > MAX_SIZE && cache_tail) {
-        pthread_rwlock_unlock(&cache_rwlock);
-        remove_lru_element();
-        pthread_rwlock_wrlock(&cache_rwlock);
+// Per-thread pipe for splice_body(), created on first use
+static __thread int relay_pipe[2] = {-1, -1};
+
+static int* thread_relay_pipe() {
+    if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0) {
+        relay_pipe[0] = relay_pipe[1] = -1;
+        return NULL;
     }
-    
-    cache_element* element = (cache_element*)malloc(sizeof(cache_element));
-    if (!element) {
-        pthread_rwlock_unlock(&cache_rwlock);
+    return relay_pipe;
+}
+
+// Drop a pipe left holding data
+static void thread_relay_pipe_reset() {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+// True if the client can tell where this response ends without the
+// connection closing: a bodiless status, chunked encoding or Content-Length.
+// `response` must start with the status line and hold the whole header block.
+int response_is_delimited(const char* response, int len) {
+    const char* header_end = memmem(response, len, "\r\n\r\n", 4);
+    if (!header_end || len < 12 || strncmp(response, "HTTP/1.", 7) != 0) {
         return 0;
     }
+    int header_len = header_end - response + 4;
+    char value[128];
     
-    element->data = (char*)malloc(size + 1);
-    element->url = (char*)malloc(strlen(url) + 1);
-    
-    if (!element->data || !element->url) {
-        free(element->data);
-        free(element->url);
-        free(element);
-        pthread_rwlock_unlock(&cache_rwlock);
+    if (find_response_header(response, header_len, "Connection", value, sizeof(value)) >= 0 &&
+        strcasestr(value, "close")) {
         return 0;
     }
-    
-    memcpy(element->data, data, size);
-    element->data[size] = '\0';
-    strcpy(element->url, url);
-    element->len = size;
-    element->lru_time_track = time(NULL);
-    element->creation_time = time(NULL);
-    element->access_count = 1;
-    element->prev = NULL;
-    element->next = cache_head;
-    
-    if (cache_head) cache_head->prev = element;
-    cache_head = element;
-    if (!cache_tail) cache_tail = element;
-    
-    cache_size += element_size;
-    
-    pthread_rwlock_unlock(&cache_rwlock);
-    return 1;
+    int status = atoi(response + 9);
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        return 1;
+    }
+    if (find_response_header(response, header_len, "Transfer-Encoding", value, sizeof(value)) >= 0) {
+        return strcasestr(value, "chunked") != NULL;
+    }
+    return find_response_header(response, header_len, "Content-Length", value, sizeof(value)) >= 0;
 }
 
-// Worker thread function for thread pool
-void* worker_thread(void* arg) {
-    while (server_running) {
-        work_item* item = dequeue_request();
-        if (!item) continue;
-        
-        int client_socket = item->client_socket;
-        free(item);
-        
-        // Process the client request
-        char *buffer = (char*)calloc(MAX_BYTES, sizeof(char));
-        if (!buffer) {
-            close(client_socket);
-            pthread_mutex_lock(&connection_limit_mutex);
-active_connection_count--;
-pthread_cond_signal(&connection_available);
-pthread_mutex_unlock(&connection_limit_mutex);
-            continue;
+// Upstream response framing: finds where a response ends, so it completes
+// as soon as its last byte arrives and the connection can carry the next
+// request instead of being read until the origin closes it
+void framer_init(response_framer* framer) {
+    framer->state = FRAME_HEADERS;
+    framer->header_len = 0;
+    framer->status = 0;
+    framer->keep_alive = 0;
+    framer->remaining = 0;
+    framer->line_len = 0;
+    framer->in_extension = 0;
+    framer->header_bytes = 0;
+}
+
+// Responses we cannot frame are relayed until the origin closes
+static void framer_until_close(response_framer* framer) {
+    framer->state = FRAME_UNTIL_CLOSE;
+    framer->keep_alive = 0;
+}
+
+// Pick the body framing from a complete header block
+static void framer_parse_headers(response_framer* framer) {
+    char value[128];
+    int len = framer->header_len;
+    
+    if (len < 12 || strncmp(framer->header, "HTTP/1.", 7) != 0) {
+        framer_until_close(framer);
+        return;
+    }
+    framer->status = atoi(framer->header + 9);
+    framer->keep_alive = framer->header[7] == '1';
+    if (find_response_header(framer->header, len, "Connection", value, sizeof(value)) >= 0) {
+        if (strcasestr(value, "close")) {
+            framer->keep_alive = 0;
+        } else if (strcasestr(value, "keep-alive")) {
+            framer->keep_alive = 1;
         }
-        
-        ssize_t bytes_received = recv(client_socket, buffer, MAX_BYTES - 1, 0);
-        
-        // Ensure we receive the complete HTTP request
-        while (bytes_received > 0 && !strstr(buffer, "\r\n\r\n")) {
-            ssize_t additional = recv(client_socket, buffer + strlen(buffer), 
-                                    MAX_BYTES - strlen(buffer) - 1, 0);
-            if (additional <= 0) break;
-            bytes_received += additional;
+    }
+    
+    if (framer->status >= 100 && framer->status < 200 && framer->status != 101) {
+        // Interim response, the final one follows
+        framer->header_len = 0;
+    } else if (framer->status == 101) {
+        framer_until_close(framer);
+    } else if (framer->status == 204 || framer->status == 304) {
+        framer->state = FRAME_DONE;
+    } else if (find_response_header(framer->header, len, "Transfer-Encoding", value, sizeof(value)) >= 0) {
+        if (strcasestr(value, "chunked")) {
+            framer->state = FRAME_CHUNK_SIZE;
+        } else {
+            framer_until_close(framer);
         }
+    } else if (find_response_header(framer->header, len, "Content-Length", value, sizeof(value)) >= 0) {
+        char* end;
+        framer->remaining = strtol(value, &end, 10);
+        if (end == value || framer->remaining < 0) {
+            framer_until_close(framer);
+        } else {
+            framer->state = framer->remaining > 0 ? FRAME_BODY : FRAME_DONE;
+        }
+    } else {
+        framer_until_close(framer);
+    }
+}
+
+// Feed received bytes, returns how many of them belong to the response.
+// framer->state is FRAME_DONE once the response is complete; bytes past
+// that point are not part of it.
+int framer_feed(response_framer* framer, const char* data, int len) {
+    int pos = 0;
+    
+    while (pos < len && framer->state != FRAME_DONE) {
+        char c = data[pos];
+        long take;
         
-        if (bytes_received > 0) {
-            char *temp_req = strdup(buffer);
-            if (temp_req) {
-                // Check cache first
-                cache_element* cached = find_in_cache(temp_req);
+        switch (framer->state) {
+            case FRAME_HEADERS:
+                if (framer->header_len == (int)sizeof(framer->header) - 1) {
+                    framer_until_close(framer);
+                    break;
+                }
+                framer->header[framer->header_len++] = c;
+                framer->header_bytes++;
+                pos++;
+                if (c == '\n' && framer->header_len >= 4 &&
+                    memcmp(framer->header + framer->header_len - 4, "\r\n\r\n", 4) == 0) {
+                    framer->header[framer->header_len] = '\0';
+                    framer_parse_headers(framer);
+                }
+                break;
                 
-                if (cached != NULL) {
-                    // Serve from cache - send in optimal chunks
-                    size_t sent = 0;
-                    while (sent < cached->len) {
-                        size_t chunk_size = (cached->len - sent > MAX_BYTES) ? 
-                                          MAX_BYTES : (cached->len - sent);
-                        ssize_t bytes_sent = send(client_socket, cached->data + sent, 
-                                                chunk_size, MSG_NOSIGNAL);
-                        if (bytes_sent <= 0) break;
-                        sent += bytes_sent;
-                    }
-                    printf("Cache hit: %s\n", temp_req);
+            case FRAME_BODY:
+            case FRAME_CHUNK_DATA:
+                take = len - pos < framer->remaining ? len - pos : framer->remaining;
+                pos += take;
+                framer->remaining -= take;
+                if (framer->remaining == 0) {
+                    framer->state = framer->state == FRAME_BODY ? FRAME_DONE : FRAME_CHUNK_END;
+                }
+                break;
+                
+            case FRAME_CHUNK_SIZE:
+                pos++;
+                if (c == '\n') {
+                    framer->state = framer->remaining > 0 ? FRAME_CHUNK_DATA : FRAME_TRAILERS;
+                    framer->line_len = 0;
+                    framer->in_extension = 0;
+                } else if (framer->in_extension || c == '\r' || c == ' ' || c == '\t') {
+                    // Chunk extensions and whitespace are ignored
+                } else if (c == ';') {
+                    framer->in_extension = 1;
+                } else if (isxdigit((unsigned char)c) && framer->line_len < 15) {
+                    framer->remaining = framer->remaining * 16 +
+                        (isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10);
+                    framer->line_len++;
                 } else {
-                    // Parse and handle request
-                    ParsedRequest* request = ParsedRequest_create();
-                    if (ParsedRequest_parse(request, buffer, strlen(buffer)) == 0) {
-                        if (strcmp(request->method, "GET") == 0 && 
-                            request->host && request->path) {
-                            if (handle_request_optimized(client_socket, request, temp_req) < 0) {
-                                sendErrorMessage(client_socket, 500);
-                            }
-                        } else {
-                            sendErrorMessage(client_socket, 501);
-                        }
-                    } else {
-                        sendErrorMessage(client_socket, 400);
-                    }
-                    ParsedRequest_destroy(request);
+                    framer_until_close(framer);
                 }
-                free(temp_req);
-            }
+                break;
+                
+            case FRAME_CHUNK_END:
+                pos++;
+                if (c == '\n') {
+                    framer->state = FRAME_CHUNK_SIZE;
+                } else if (c != '\r') {
+                    framer_until_close(framer);
+                }
+                break;
+                
+            case FRAME_TRAILERS:
+                // Trailer lines up to an empty one
+                pos++;
+                if (c == '\n') {
+                    if (framer->line_len == 0) framer->state = FRAME_DONE;
+                    framer->line_len = 0;
+                } else if (c != '\r') {
+                    framer->line_len++;
+                }
+                break;
+                
+            case FRAME_UNTIL_CLOSE:
+                pos = len;
+                break;
         }
-        
-        free(buffer);
-        shutdown(client_socket, SHUT_RDWR);
-        close(client_socket);
-        pthread_mutex_lock(&connection_limit_mutex);
-active_connection_count--;
-pthread_cond_signal(&connection_available);
-pthread_mutex_unlock(&connection_limit_mutex);
     }
-    return NULL;
+    return pos;
 }
 
-// Request queue management
-void enqueue_request(int client_socket, struct sockaddr_in client_addr) {
-    work_item* item = (work_item*)malloc(sizeof(work_item));
-    if (!item) {
-        close(client_socket);
-        return;
-    }
-    
-    item->client_socket = client_socket;
-    item->client_addr = client_addr;
-    item->next = NULL;
-    
-    pthread_mutex_lock(&request_queue.mutex);
-    
-    while (request_queue.count >= QUEUE_SIZE) {
-        pthread_cond_wait(&request_queue.not_full, &request_queue.mutex);
-    }
-    
-    if (request_queue.tail) {
-        request_queue.tail->next = item;
-    } else {
-        request_queue.head = item;
+// The origin closed the connection, which ends a close-delimited body
+void framer_eof(response_framer* framer) {
+    if (framer->state == FRAME_UNTIL_CLOSE) {
+        framer->state = FRAME_DONE;
     }
-    request_queue.tail = item;
-    request_queue.count++;
-    
-    pthread_cond_signal(&request_queue.not_empty);
-    pthread_mutex_unlock(&request_queue.mutex);
 }
 
-work_item* dequeue_request() {
-    pthread_mutex_lock(&request_queue.mutex);
-    
-    while (request_queue.count == 0 && server_running) {
-        pthread_cond_wait(&request_queue.not_empty, &request_queue.mutex);
-    }
-    
-    if (!server_running) {
-        pthread_mutex_unlock(&request_queue.mutex);
-        return NULL;
+// Body bytes that may be moved without being inspected (spliced), 0 if
+// the framing needs to see them
+long framer_splice_len(response_framer* framer) {
+    if (framer->state == FRAME_BODY) {
+        return framer->remaining < RELAY_PIPE_SIZE ? framer->remaining : RELAY_PIPE_SIZE;
     }
+    return framer->state == FRAME_UNTIL_CLOSE ? RELAY_PIPE_SIZE : 0;
+}
+
+// Account body bytes moved without framer_feed(), at most
+// framer_splice_len() of them. Returns 0, or -1 if the state does not allow it.
+int framer_advance(response_framer* framer, long bytes) {
+    if (framer->state == FRAME_UNTIL_CLOSE) return 0;
+    if (framer->state != FRAME_BODY || bytes > framer->remaining) return -1;
     
-    work_item* item = request_queue.head;
-    request_queue.head = item->next;
-    if (!request_queue.head) {
-        request_queue.tail = NULL;
+    framer->remaining -= bytes;
+    if (framer->remaining == 0) {
+        framer->state = FRAME_DONE;
     }
-    request_queue.count--;
-    
-    pthread_cond_signal(&request_queue.not_full);
-    pthread_mutex_unlock(&request_queue.mutex);
-    
-    return item;
+    return 0;
 }
 
-// Connection pool implementation
-void init_connection_pool() {
-    pthread_mutex_lock(&conn_pool.mutex);
-    conn_pool.sockets = (int*)malloc(conn_pool.capacity * sizeof(int));
-    conn_pool.hosts = (char**)malloc(conn_pool.capacity * sizeof(char*));
-    conn_pool.ports = (int*)malloc(conn_pool.capacity * sizeof(int));
-    conn_pool.last_used = (time_t*)malloc(conn_pool.capacity * sizeof(time_t));
-    
-    for (int i = 0; i < conn_pool.capacity; i++) {
-        conn_pool.sockets[i] = -1;
-        conn_pool.hosts[i] = NULL;
+// True when the upstream connection can carry another request
+int framer_reusable(response_framer* framer) {
+    return framer->state == FRAME_DONE && framer->keep_alive;
+}
+
+// HTTP/1.1 connections persist unless the client asks to close them,
+// HTTP/1.0 ones only if the client asks for keep-alive
+int client_wants_keepalive(ParsedRequest *request) {
+    const char* connection = ParsedRequest_getHeader(request, "Connection");
+    if (!connection) {
+        connection = ParsedRequest_getHeader(request, "Proxy-Connection");
     }
-    pthread_mutex_unlock(&conn_pool.mutex);
+    if (request->version && strcmp(request->version, "HTTP/1.0") == 0) {
+        return connection && strcasestr(connection, "keep-alive");
+    }
+    return !(connection && strcasestr(connection, "close"));
 }
 
-int get_pooled_connection(char* host, int port) {
-    pthread_mutex_lock(&conn_pool.mutex);
-    
-    for (int i = 0; i < conn_pool.size; i++) {
-        if (conn_pool.sockets[i] > 0 && conn_pool.hosts[i] && 
-            strcmp(conn_pool.hosts[i], host) == 0 && conn_pool.ports[i] == port) {
-            
-            // Check if connection is still valid and not too old
-            time_t now = time(NULL);
-            if (now - conn_pool.last_used[i] < 60) { // 60 second timeout
-                int socket = conn_pool.sockets[i];
-                conn_pool.sockets[i] = -1;
-                free(conn_pool.hosts[i]);
-                conn_pool.hosts[i] = NULL;
-                
-                pthread_mutex_unlock(&conn_pool.mutex);
-                return socket;
-            } else {
-                // Connection too old, close it
-                close(conn_pool.sockets[i]);
-                conn_pool.sockets[i] = -1;
-                free(conn_pool.hosts[i]);
-                conn_pool.hosts[i] = NULL;
+// Look up one coding in an Accept-Encoding value: -1 if it is not listed,
+// 0 if it is refused with q=0, 1 if it is accepted
+static int accept_encoding_lookup(const char* value, const char* coding) {
+    size_t coding_len = strlen(coding);
+    while (*value) {
+        value += strspn(value, " \t,");
+        size_t item_len = strcspn(value, ",");
+        size_t name_len = strcspn(value, ";,");
+        while (name_len > 0 && (value[name_len - 1] == ' ' || value[name_len - 1] == '\t')) name_len--;
+        
+        if (name_len == coding_len && strncasecmp(value, coding, coding_len) == 0) {
+            for (const char* param = value + name_len; param + 1 < value + item_len; param++) {
+                if ((*param == 'q' || *param == 'Q') && param[1] == '=') {
+                    return strtod(param + 2, NULL) > 0;
+                }
             }
+            return 1;
         }
+        value += item_len;
     }
-    
-    pthread_mutex_unlock(&conn_pool.mutex);
     return -1;
 }
 
-void return_pooled_connection(int socket, char* host, int port) {
-    pthread_mutex_lock(&conn_pool.mutex);
-    
-    // Find empty slot
-    for (int i = 0; i < conn_pool.capacity; i++) {
-        if (conn_pool.sockets[i] == -1) {
-            conn_pool.sockets[i] = socket;
-            conn_pool.hosts[i] = strdup(host);
-            conn_pool.ports[i] = port;
-            conn_pool.last_used[i] = time(NULL);
-            if (i >= conn_pool.size) conn_pool.size = i + 1;
-            
-            pthread_mutex_unlock(&conn_pool.mutex);
-            return;
-        }
-    }
-    
-    // Pool full, just close the connection
-    pthread_mutex_unlock(&conn_pool.mutex);
-    close(socket);
+// Whether a client sending this Accept-Encoding (NULL if none) takes gzip
+int accepts_gzip(const char* accept_encoding) {
+    if (!accept_encoding) return 0;
+    int gzip = accept_encoding_lookup(accept_encoding, "gzip");
+    if (gzip < 0) gzip = accept_encoding_lookup(accept_encoding, "x-gzip");
+    if (gzip < 0) gzip = accept_encoding_lookup(accept_encoding, "*");
+    return gzip > 0;
+}
+
+// Build the request sent upstream, returns its length or -1 if it does
+// not fit in buflen. A peer is another proxy, it gets the absolute URL.
+int build_upstream_request(ParsedRequest *request, char *buf, int buflen, int to_peer) {
+    int len;
+    if (to_peer) {
+        len = snprintf(buf, buflen, "GET http://%s%s%s%s%s %s\r\n",
+                       request->host, request->port ? ":" : "", request->port ? request->port : "",
+                       request->path[0] == '/' ? "" : "/", request->path, request->version);
+    } else {
+        len = snprintf(buf, buflen, "GET %s %s\r\n", request->path, request->version);
+    }
+    if (len < 0 || len >= buflen) {
+        return -1;
+    }
+    int line_len = snprintf(buf + len, buflen - len,
+        "Host: %s\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: HighPerformanceProxy/2.0\r\n"
+        "%s",
+        request->host, to_peer ? PEER_HEADER ": 1\r\n" : "");
+    if (line_len < 0 || line_len >= buflen - len) {
+        return -1;
+    }
+    len += line_len;
+    ParsedRequest_removeHeader(request, PEER_HEADER);
+    
+    // Whole responses are fetched so they can be stored, later Range
+    // requests are cut from the cached copy (see cache_range_element)
+    ParsedRequest_removeHeader(request, "Range");
+    ParsedRequest_removeHeader(request, "If-Range");
+    
+    // Compressed storage asks for gzip or no coding at all, whichever the
+    // cache key says (see build_cache_key), so stored variants stay apart
+    if (config.cache_compress) {
+        int gzip = accepts_gzip(ParsedRequest_getHeader(request, "Accept-Encoding"));
+        ParsedRequest_removeHeader(request, "Accept-Encoding");
+        if (gzip && ParsedRequest_setHeader(request, "Accept-Encoding", "gzip") < 0) {
+            return -1;
+        }
+    }
+    int headers_len = ParsedRequest_unparse_headers(request, buf + len, buflen - len);
+    return headers_len < 0 ? -1 : len + headers_len;
+}
+
+// Account a completed upstream fetch
+void record_response_stats(struct timeval *start_time, int bytes) {
+    stats_add(STATS_FETCHES, 1);
+    stats_add(STATS_FETCH_TIME_US, elapsed_us(start_time));
+    stats_add(STATS_BYTES_FETCHED, bytes);
+}
+
+// Account an answered client request. outcome is STATS_HIT, STATS_MISS
+// or STATS_ERROR.
+void record_request_stats(int outcome, struct timeval *start_time) {
+    stats_add(STATS_REQUESTS, 1);
+    stats_record_latency(outcome, elapsed_us(start_time));
+}
+
+// Optimized request handling with better memory management and performance
+// The response is fetched as the leader of inflight, filling it for the cache
+// and any followers. With a stale element the request is made conditional,
+// and a 304 serves (and refreshes) the element instead. A negative
+// client_socket fetches for the cache only. Sets *reusable when the
+// forwarded response leaves the client connection usable.
+int handle_request_optimized(int client_socket, ParsedRequest *request, cache_inflight *inflight,
+                             cache_element *stale, int *reusable)  {
+    struct timeval start_time;
+    gettimeofday(&start_time, NULL);
+
+    char *send_buffer = (char*)malloc(UPSTREAM_REQUEST_MAX);
+    if (!send_buffer) {
+        cache_inflight_finish(inflight, 0, 0);
+        return -1;
+    }
+
+    if (stale) {
+        add_validators(request, stale);
+        inflight->revalidating = 1;
+    }
+    // A plain miss on a key another node owns is asked of that node
+    cache_peer* peer = stale ? NULL : peer_for_fetch(request, inflight);
+    int request_len = build_upstream_request(request, send_buffer, UPSTREAM_REQUEST_MAX, peer != NULL);
+    if (request_len < 0) {
+        free(send_buffer);
+        cache_inflight_finish(inflight, 0, 0);
+        return -1;
+    }
+    char* upstream_host = request->host;
+    int server_port = (request->port != NULL) ? atoi(request->port) : 80;
+   
+    int pooled;
+    int remoteSocket = peer ? connect_peer(peer, &pooled) : connectRemoteServer(request->host, server_port, &pooled);
+    if (remoteSocket < 0 && peer) {
+        peer_fetch_failed(peer, inflight);
+        peer = NULL;
+        request_len = build_upstream_request(request, send_buffer, UPSTREAM_REQUEST_MAX, 0);
+        remoteSocket = request_len < 0 ? -1 : connectRemoteServer(request->host, server_port, &pooled);
+    } else if (peer) {
+        upstream_host = peer->host;
+        server_port = peer->port;
+    }
+
+    if (remoteSocket < 0) {
+        free(send_buffer);
+        cache_inflight_finish(inflight, 0, 0);
+        return -1;
+    }
+
+    // Send request to upstream server
+    // (a pooled or peer connection that fails is retried below)
+    if (send_all(remoteSocket, send_buffer, request_len) < 0 && !pooled && !peer) {
+        close(remoteSocket);
+        free(send_buffer);
+        cache_inflight_finish(inflight, 0, 0);
+        return -1;
+    }
+
+    // Relay the response, filling cache segments directly from recv
+    response_framer* framer = (response_framer*)malloc(sizeof(response_framer));
+    if (!framer) {
+        close(remoteSocket);
+        free(send_buffer);
+        cache_inflight_finish(inflight, 0, 0);
+        return -1;
+    }
+    framer_init(framer);
+    
+    *reusable = 0;
+    int total_received = 0;
+    int overrun = 0;
+    int holding = stale != NULL;    // Status of a revalidation not known yet
+    int revalidated = 0;
+    // Bytes received into the fill reach the client through its own
+    // position in it, so the fetch goes on at the upstream's pace for the
+    // followers however slowly the client reads, and after it went away
+    int from_fill = !holding && client_socket >= 0;
+    cache_segment* own_segment = NULL;
+    int own_offset = 0;
+    int client_failed = 0;
+    ssize_t bytes_received;
+    
+    while (framer->state != FRAME_DONE) {
+        int filling = cache_inflight_filling(inflight);
+        if (client_failed && (!filling || !cache_inflight_followed(inflight))) {
+            framer_init(framer); // Nobody is left to read the rest
+            break;
+        }
+        // Once the response is no longer buffered the client first gets
+        // the rest of the fill, then the bytes relayed past it
+        if (!filling && from_fill) {
+            if (client_socket >= 0 && leader_send_fill(client_socket, inflight, &own_segment, &own_offset, 1) < 0) {
+                framer_init(framer);
+                break;
+            }
+            from_fill = 0;
+        }
+        
+        // A body that is neither cached nor inspected is spliced straight
+        // from the upstream socket to the client
+        long splice_len = framer_splice_len(framer);
+        int *pipe_fds;
+        if (splice_len > 0 && !holding && client_socket >= 0 && !filling &&
+            (pipe_fds = thread_relay_pipe()) != NULL) {
+            int splice_failed = 0;
+            ssize_t moved = splice_body(remoteSocket, client_socket, pipe_fds, splice_len, &splice_failed);
+            if (splice_failed) {
+                thread_relay_pipe_reset();
+                framer_init(framer); // Incomplete, neither side can be reused
+                break;
+            }
+            if (moved <= 0) {
+                if (moved == 0) framer_eof(framer);
+                break;
+            }
+            framer_advance(framer, moved);
+            total_received += moved;
+            continue;
+        }
+        
+        int avail;
+        char *chunk = cache_inflight_space(inflight, &avail);
+        if (!chunk) {
+            if (from_fill) continue;
+            chunk = send_buffer;
+            avail = MAX_BYTES - 1;
+        } else if (from_fill && client_socket >= 0) {
+            // The client gets what it takes without blocking; the upstream
+            // is only waited on while it reads the rest
+            int unsent = leader_send_fill(client_socket, inflight, &own_segment, &own_offset, 0);
+            if (unsent < 0) {
+                client_socket = -1;
+                client_failed = 1;
+                continue;
+            }
+            if (unsent > 0) {
+                struct pollfd fds[2] = {{remoteSocket, POLLIN, 0}, {client_socket, POLLOUT, 0}};
+                worker_io_begin();
+                int ready = poll(fds, 2, CONNECTION_TIMEOUT * 1000);
+                worker_io_end();
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready <= 0) break;
+                if (!fds[0].revents) continue;
+            }
+        }
+        
+        worker_io_begin();
+        bytes_received = recv(remoteSocket, chunk, avail, 0);
+        worker_io_end();
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received <= 0 && total_received == 0 && (pooled || peer)) {
+            // The upstream closed the pooled connection while it was idle,
+            // retry once on a fresh one. A peer that does not answer on a
+            // fresh connection is left for the origin.
+            close(remoteSocket);
+            if (!pooled) {
+                peer_fetch_failed(peer, inflight);
+                peer = NULL;
+                upstream_host = request->host;
+                server_port = (request->port != NULL) ? atoi(request->port) : 80;
+            }
+            pooled = 0;
+            remoteSocket = peer ? open_upstream_connection(peer->host, peer->port, PEER_CONNECT_TIMEOUT_MS)
+                                : open_remote_connection(upstream_host, server_port);
+            if (remoteSocket < 0) break;
+            request_len = build_upstream_request(request, send_buffer, UPSTREAM_REQUEST_MAX, peer != NULL);
+            if (request_len < 0 || send_all(remoteSocket, send_buffer, request_len) < 0) break;
+            continue;
+        }
+        if (bytes_received <= 0) {
+            if (bytes_received == 0) framer_eof(framer);
+            break;
+        }
+        
+        // Only the bytes belonging to this response are relayed
+        int used = framer_feed(framer, chunk, bytes_received);
+        overrun = used < bytes_received;
+        total_received += used;
+        if (chunk != send_buffer) {
+            cache_inflight_commit(inflight, used);
+        }
+        
+        // A revalidation response is held back until its status is known.
+        // A 304 is not relayed at all; otherwise the client is sent the
+        // fill past any interim responses, or if the response is not being
+        // buffered the header block (which the framer kept) goes out
+        // first, then the body bytes so far.
+        char *relay = chunk;
+        int relay_len = chunk != send_buffer ? 0 : used;
+        if (holding) {
+            relay_len = 0;
+            if (framer->state != FRAME_HEADERS) {
+                holding = 0;
+                if (framer->status == 304) {
+                    revalidated = 1;
+                } else if (chunk != send_buffer) {
+                    from_fill = client_socket >= 0;
+                    own_segment = NULL;
+                    own_offset = 0;
+                    leader_fill_skip(inflight, &own_segment, &own_offset,
+                                     framer->header_bytes - framer->header_len);
+                } else {
+                    relay_len = total_received - framer->header_bytes;
+                    relay = chunk + used - relay_len;
+                    if (client_socket >= 0 && send_all(client_socket, framer->header, framer->header_len) < 0) {
+                        framer_init(framer);
+                        break;
+                    }
+                }
+            }
+        }
+        
+        // Forward to client immediately for better latency
+        if (client_socket >= 0 && relay_len > 0 && send_all(client_socket, relay, relay_len) < 0) {
+            framer_init(framer); // Incomplete, neither side can be reused
+            break;
+        }
+    }
+    
+    int complete = framer->state == FRAME_DONE;
+    if (complete && revalidated) {
+        cache_element_revalidated(stale, framer->header, framer->header_len);
+        cache_inflight_revalidated(inflight, stale);
+        *reusable = stale->delimited;
+        if (client_socket >= 0 && send_cache_element(client_socket, stale) < 0) {
+            *reusable = 0;
+        }
+    } else {
+        int delimited = complete && response_is_delimited(framer->header, framer->header_len);
+        // Followers are not kept waiting for the rest to reach the client,
+        // which holds on to the segments until then
+        int behind = 0;
+        *reusable = delimited && !client_failed;
+        if (complete && from_fill && client_socket >= 0) {
+            behind = leader_send_fill(client_socket, inflight, &own_segment, &own_offset, 0);
+            if (behind < 0) *reusable = behind = 0;
+        }
+        inflight->leader_behind = behind;
+        inflight->fill.cost_ms = elapsed_ms(&start_time);
+        cache_inflight_finish(inflight, complete, delimited);
+        if (behind && leader_send_fill(client_socket, inflight, &own_segment, &own_offset, 1) < 0) {
+            *reusable = 0;
+        }
+    }
+    if (total_received > 0) {
+        record_response_stats(&start_time, total_received);
+    }
+
+    // Only a connection left at a response boundary can be reused
+    if (remoteSocket >= 0) {
+        if (framer_reusable(framer) && !overrun) {
+            return_pooled_connection(remoteSocket, upstream_host, server_port);
+        } else {
+            close(remoteSocket);
+        }
+    }
+    
+    free(framer);
+    free(send_buffer);
+    return total_received > 0 ? 0 : -1;
+}
+
+// Make a request for a stale element conditional on its validators. The
+// client's own conditions are dropped, a 304 must answer ours.
+void add_validators(ParsedRequest* request, cache_element* stale) {
+    ParsedRequest_removeHeader(request, "If-None-Match");
+    ParsedRequest_removeHeader(request, "If-Modified-Since");
+    if (stale->etag[0]) {
+        ParsedRequest_setHeader(request, "If-None-Match", stale->etag);
+    }
+    if (stale->last_modified[0]) {
+        ParsedRequest_setHeader(request, "If-Modified-Since", stale->last_modified);
+    }
+}
+
+// Background refresh of an element served stale (stale-while-revalidate)
+typedef struct cache_refresh {
+    char* raw_request;
+    int len;
+    cache_key key;
+    cache_element* stale;
+} cache_refresh;
+
+// Start refreshing a stale element in the background, unless a refresh of
+// it is already running. raw_request is the client request it was served for.
+void cache_refresh_start(const char* raw_request, int len, cache_key* key, cache_element* stale) {
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&stale->refreshing, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    cache_refresh* refresh = (cache_refresh*)malloc(sizeof(cache_refresh));
+    char* copy = (char*)malloc(len + 1);
+    pthread_t thread;
+    if (refresh && copy) {
+        memcpy(copy, raw_request, len);
+        copy[len] = '\0';
+        refresh->raw_request = copy;
+        refresh->len = len;
+        refresh->key = *key;
+        refresh->stale = stale;
+        __atomic_fetch_add(&stale->refcount, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&thread, NULL, cache_refresh_thread, refresh) == 0) {
+            pthread_detach(thread);
+            return;
+        }
+        release_cache_element(stale);
+    }
+    free(refresh);
+    free(copy);
+    __atomic_store_n(&stale->refreshing, 0, __ATOMIC_RELEASE);
+}
+
+void* cache_refresh_thread(void* arg) {
+    cache_refresh* refresh = (cache_refresh*)arg;
+    cache_element* stale = refresh->stale;
+    
+    ParsedRequest* request = ParsedRequest_create();
+    if (request && ParsedRequest_parse(request, refresh->raw_request, refresh->len) == 0) {
+        // A fetch of the key that is already running refreshes it anyway
+        int leader = 0, reusable;
+        cache_inflight* inflight = cache_inflight_join(&refresh->key, &leader);
+        if (inflight && leader) {
+            handle_request_optimized(-1, request, inflight, stale, &reusable);
+        }
+        if (inflight) cache_inflight_release(inflight);
+    }
+    if (request) ParsedRequest_destroy(request);
+    
+    __atomic_store_n(&stale->refreshing, 0, __ATOMIC_RELEASE);
+    release_cache_element(stale);
+    free(refresh->raw_request);
+    free(refresh);
+    return NULL;
+}
+
+// Segments come from the slab allocator, which recycles them per size class
+static cache_segment* segment_alloc_sized(int cap) {
+    cache_segment* segment = (cache_segment*)slab_alloc(sizeof(cache_segment) + cap);
+    if (!segment) return NULL;
+    segment->next = NULL;
+    segment->len = 0;
+    segment->cap = slab_chunk_size(sizeof(cache_segment) + cap) - sizeof(cache_segment);
+    return segment;
+}
+
+static cache_segment* segment_alloc() {
+    return segment_alloc_sized(CACHE_SEGMENT_SIZE);
+}
+
+static void segment_free(cache_segment* segment) {
+    slab_free(segment);
+}
+
+static void segment_chain_free(cache_segment* segment) {
+    while (segment) {
+        cache_segment* next = segment->next;
+        segment_free(segment);
+        segment = next;
+    }
+}
+
+// Real memory used by a segment chain
+static int segment_chain_size(cache_segment* segment) {
+    int size = 0;
+    for (; segment; segment = segment->next) {
+        size += sizeof(cache_segment) + segment->cap;
+    }
+    return size;
+}
+
+void cache_fill_init(cache_fill* fill) {
+    memset(fill, 0, sizeof(*fill));
+}
+
+// Return free space at the end of the fill, adding a segment if needed
+char* cache_fill_space(cache_fill* fill, int* avail) {
+    if (!fill->tail || fill->tail->len == fill->tail->cap) {
+        cache_segment* segment = segment_alloc();
+        if (!segment) return NULL;
+        if (fill->tail) {
+            fill->tail->next = segment;
+        } else {
+            fill->head = segment;
+        }
+        fill->tail = segment;
+    }
+    *avail = fill->tail->cap - fill->tail->len;
+    return fill->tail->data + fill->tail->len;
+}
+
+void cache_fill_commit(cache_fill* fill, int bytes) {
+    fill->tail->len += bytes;
+    fill->total += bytes;
+}
+
+// Copy data into the fill, returns 0 on success
+int cache_fill_append(cache_fill* fill, const char* data, int len) {
+    while (len > 0) {
+        int avail;
+        char* space = cache_fill_space(fill, &avail);
+        if (!space) return -1;
+        if (avail > len) avail = len;
+        memcpy(space, data, avail);
+        cache_fill_commit(fill, avail);
+        data += avail;
+        len -= avail;
+    }
+    return 0;
+}
+
+// Drop the buffered data and stop filling
+void cache_fill_abandon(cache_fill* fill) {
+    if (fill->shared && fill->head) {
+        fill->tail->next = fill->retired;
+        fill->retired = fill->head;
+    } else {
+        segment_chain_free(fill->head);
+    }
+    fill->head = fill->tail = NULL;
+    fill->total = 0;
+    fill->abandoned = 1;
+}
+
+// Give up on the fill as soon as it is clearly too large or uncacheable.
+// `complete` is set once the whole response has been received.
+void cache_fill_check(cache_fill* fill, int complete) {
+    if (fill->abandoned) return;
+    
+    if (fill->total > MAX_ELEMENT_SIZE) {
+        cache_fill_abandon(fill);
+        return;
+    }
+    if (fill->checked) return;
+    
+    // Headers are inspected once they are complete in the first segment
+    cache_segment* head = fill->head;
+    char* header_end = head ? memmem(head->data, head->len, "\r\n\r\n", 4) : NULL;
+    if (!header_end) {
+        if (complete || (head && head->len == head->cap)) {
+            cache_fill_abandon(fill); // No usable header block
+        }
+        return;
+    }
+    fill->checked = 1;
+    
+    int header_len = header_end - head->data + 4;
+    char value[256];
+    fill->status = strncmp(head->data, "HTTP/1.", 7) == 0 ? atoi(head->data + 9) : 0;
+    if (!response_is_storable(head->data, header_len, time(NULL), &fill->expires, &fill->stale_until)) {
+        cache_fill_abandon(fill);
+        return;
+    }
+    // Without a Content-Length (chunked or close-delimited) the size is only
+    // known once the response is complete
+    if (find_response_header(head->data, header_len, "Content-Length", value, sizeof(value)) >= 0) {
+        if (atol(value) > MAX_ELEMENT_SIZE) {
+            cache_fill_abandon(fill);
+            return;
+        }
+        fill->sized = find_response_header(head->data, header_len, "Transfer-Encoding", value, sizeof(value)) < 0;
+    }
+    if (find_response_header(head->data, header_len, "Cache-Control", value, sizeof(value)) >= 0 &&
+        (strcasestr(value, "no-store") || strcasestr(value, "private"))) {
+        cache_fill_abandon(fill);
+        return;
+    }
+    if (!response_vary_is_keyed(head->data, header_len)) {
+        cache_fill_abandon(fill);
+    }
+}
+
+// Describe a segment chain from (segment, offset) as an iovec array, so
+// it can be sent with one gathering call. Returns the iovec count.
+int segment_iov(cache_segment* segment, int offset, struct iovec* iov, int max) {
+    int count = 0;
+    for (; segment && count < max; segment = segment->next, offset = 0) {
+        if (segment->len == offset) continue;
+        iov[count].iov_base = segment->data + offset;
+        iov[count].iov_len = segment->len - offset;
+        count++;
+    }
+    return count;
+}
+
+// Move (segment, offset) forward past bytes that were sent
+void segment_advance(cache_segment** segment, int* offset, size_t bytes) {
+    while (*segment) {
+        size_t left = (*segment)->len - *offset;
+        if (bytes < left) {
+            *offset += bytes;
+            return;
+        }
+        bytes -= left;
+        *segment = (*segment)->next;
+        *offset = 0;
+    }
+}
+
+// Send a cached element to a client, up to SEND_IOV_MAX segments per call
+int send_cache_element(int socket, cache_element* element) {
+    cache_segment* segment = element->segments;
+    int offset = 0;
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    
+    while ((msg.msg_iovlen = segment_iov(segment, offset, iov, SEND_IOV_MAX)) > 0) {
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_socket(socket, POLLOUT, CONNECTION_TIMEOUT * 1000) > 0) {
+                continue;
+            }
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        segment_advance(&segment, &offset, sent);
+    }
+    return 0;
+}
+
+// FNV-1a hash of a cache key
+static uint64_t cache_hash(const char* str, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Append to a cache key, failing if it no longer fits
+static int cache_key_append(cache_key* key, const char* str, int len, int lowercase) {
+    if (key->len + len >= CACHE_KEY_LEN) {
+        return -1;
+    }
+    for (int i = 0; i < len; i++) {
+        key->str[key->len++] = lowercase ? tolower((unsigned char)str[i]) : str[i];
+    }
+    key->str[key->len] = '\0';
+    return 0;
+}
+
+// Build the canonical cache key for a request: method, lowercased host,
+// explicit port, path, and the values of cache_key_headers. Other headers
+// (User-Agent, Cookie, ordering...) do not affect the key. With compressed
+// storage Accept-Encoding is reduced to gzip or nothing, which leaves two
+// variants of each object: the gzip one ends in CACHE_KEY_GZIP.
+// Returns 0 on success, -1 if the request cannot be keyed.
+int build_cache_key(ParsedRequest *request, cache_key *key) {
+    if (!request->method || !request->host || !request->path) {
+        return -1;
+    }
+    
+    const char* port = request->port ? request->port : "80";
+    const char* path = request->path[0] ? request->path : "/";
+    key->len = 0;
+    
+    if (cache_key_append(key, request->method, strlen(request->method), 0) < 0 ||
+        cache_key_append(key, " http://", 8, 0) < 0 ||
+        cache_key_append(key, request->host, strlen(request->host), 1) < 0 ||
+        cache_key_append(key, ":", 1, 0) < 0 ||
+        cache_key_append(key, port, strlen(port), 0) < 0 ||
+        (path[0] != '/' && cache_key_append(key, "/", 1, 0) < 0) ||
+        cache_key_append(key, path, strlen(path), 0) < 0) {
+        return -1;
+    }
+    
+    for (int i = 0; cache_key_headers[i] != NULL; i++) {
+        const char* value = ParsedRequest_getHeader(request, cache_key_headers[i]);
+        // Compressed storage only tells clients that take gzip from the rest
+        if (config.cache_compress && strcasecmp(cache_key_headers[i], "Accept-Encoding") == 0) {
+            value = accepts_gzip(value) ? "gzip" : NULL;
+        }
+        if (value == NULL) continue;
+        if (cache_key_append(key, "\n", 1, 0) < 0 ||
+            cache_key_append(key, cache_key_headers[i], strlen(cache_key_headers[i]), 1) < 0 ||
+            cache_key_append(key, ":", 1, 0) < 0 ||
+            cache_key_append(key, value, strlen(value), 0) < 0) {
+            return -1;
+        }
+    }
+    
+    key->hash = cache_hash(key->str, key->len);
+    return 0;
+}
+
+// Find a header in a raw HTTP response header block and copy its value.
+// Returns the value length, or -1 if the header is not present.
+int find_response_header(const char* response, int len, const char* name,
+                                char* value, size_t value_len) {
+    size_t name_len = strlen(name);
+    const char* end = response + len;
+    const char* line = memchr(response, '\n', len);
+    
+    while (line != NULL && ++line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) line_end = end;
+        if (line_end - line <= 1) break; // Blank line ends the headers
+        
+        if ((size_t)(line_end - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char* start = line + name_len + 1;
+            const char* stop = line_end;
+            while (start < stop && (*start == ' ' || *start == '\t')) start++;
+            while (stop > start && isspace((unsigned char)stop[-1])) stop--;
+            
+            size_t copy = stop - start;
+            if (copy >= value_len) copy = value_len - 1;
+            memcpy(value, start, copy);
+            value[copy] = '\0';
+            return (int)copy;
+        }
+        line = line_end;
+    }
+    return -1;
+}
+
+// A response can be cached under our key only if every header it Varies
+// on is part of the key
+int response_vary_is_keyed(const char* response, int len) {
+    char vary[512];
+    if (find_response_header(response, len, "Vary", vary, sizeof(vary)) < 0) {
+        return 1;
+    }
+    
+    char* saveptr = NULL;
+    for (char* token = strtok_r(vary, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ' || *token == '\t') token++;
+        char* token_end = token + strlen(token);
+        while (token_end > token && isspace((unsigned char)token_end[-1])) *--token_end = '\0';
+        if (*token == '\0') continue;
+        
+        int keyed = 0;
+        for (int i = 0; cache_key_headers[i] != NULL; i++) {
+            if (strcasecmp(token, cache_key_headers[i]) == 0) {
+                keyed = 1;
+                break;
+            }
+        }
+        if (!keyed) return 0; // Includes "Vary: *"
+    }
+    return 1;
+}
+
+// Parse an HTTP date (IMF-fixdate, or the obsolete RFC 850 and asctime
+// forms). Returns -1 if it is not a valid date.
+time_t parse_http_date(const char* value) {
+    static const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %d %H:%M:%S %Y",
+        NULL
+    };
+    for (int i = 0; formats[i] != NULL; i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(value, formats[i], &tm);
+        if (end && *end == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+// Freshness lifetime of a response (RFC 9111): sets when it stops being
+// fresh and until when it may still be served stale while it is being
+// refreshed. `aged` applies the response's Date and Age headers, for a
+// response just received; without it the lifetime starts now. Returns 1 if
+// the lifetime is explicit (Cache-Control or Expires), 0 if heuristic.
+int response_lifetime(const char* response, int len, time_t now, int aged, time_t* expires, time_t* stale_until) {
+    char value[512];
+    long max_age = -1, s_maxage = -1, stale_while_revalidate = 0;
+    int no_cache = 0, must_revalidate = 0;
+    
+    if (find_response_header(response, len, "Cache-Control", value, sizeof(value)) >= 0) {
+        char* saveptr = NULL;
+        for (char* token = strtok_r(value, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+            while (*token == ' ' || *token == '\t') token++;
+            if (strncasecmp(token, "s-maxage=", 9) == 0) {
+                s_maxage = atol(token + 9);
+            } else if (strncasecmp(token, "max-age=", 8) == 0) {
+                max_age = atol(token + 8);
+            } else if (strncasecmp(token, "stale-while-revalidate=", 23) == 0) {
+                stale_while_revalidate = atol(token + 23);
+            } else if (strncasecmp(token, "no-cache", 8) == 0) {
+                no_cache = 1;
+            } else if (strncasecmp(token, "must-revalidate", 15) == 0 ||
+                       strncasecmp(token, "proxy-revalidate", 16) == 0) {
+                must_revalidate = 1;
+            }
+        }
+    }
+    
+    time_t date = now;
+    if (aged && find_response_header(response, len, "Date", value, sizeof(value)) >= 0) {
+        time_t parsed = parse_http_date(value);
+        if (parsed >= 0) date = parsed;
+    }
+    
+    // A shared cache prefers s-maxage, then max-age, then Expires
+    int explicit_lifetime = 1;
+    long lifetime = 0;
+    if (no_cache) {
+        lifetime = 0;
+    } else if (s_maxage >= 0) {
+        lifetime = s_maxage;
+    } else if (max_age >= 0) {
+        lifetime = max_age;
+    } else if (find_response_header(response, len, "Expires", value, sizeof(value)) >= 0) {
+        time_t expiry = parse_http_date(value);
+        lifetime = expiry >= 0 ? (long)(expiry - date) : 0; // Invalid dates mean already expired
+    } else {
+        explicit_lifetime = 0;
+        if (find_response_header(response, len, "Last-Modified", value, sizeof(value)) >= 0) {
+            time_t modified = parse_http_date(value);
+            if (modified >= 0 && modified < date) {
+                lifetime = (date - modified) / CACHE_HEURISTIC_FRACTION;
+                if (lifetime > CACHE_HEURISTIC_MAX) lifetime = CACHE_HEURISTIC_MAX;
+            }
+        }
+    }
+    
+    // Time the response already spent in other caches or in transit
+    long age = 0;
+    if (aged) {
+        age = now > date ? now - date : 0;
+        if (find_response_header(response, len, "Age", value, sizeof(value)) >= 0 && atol(value) > age) {
+            age = atol(value);
+        }
+    }
+    
+    *expires = now + lifetime - age;
+    *stale_until = *expires;
+    if (!no_cache && !must_revalidate && stale_while_revalidate > 0) {
+        *stale_until += stale_while_revalidate;
+    }
+    return explicit_lifetime;
+}
+
+// Decide whether a just received response can be stored, setting its
+// freshness if so. Only statuses that are cacheable by default are stored
+// without an explicit lifetime, and a response that is stale on arrival
+// is only worth storing if it can be revalidated or served while stale.
+int response_is_storable(const char* response, int len, time_t now, time_t* expires, time_t* stale_until) {
+    if (len < 12 || strncmp(response, "HTTP/1.", 7) != 0) {
+        return 0;
+    }
+    int status = atoi(response + 9);
+    if (status < 200 || status == 206 || status == 304) {
+        return 0;
+    }
+    
+    int explicit_lifetime = response_lifetime(response, len, now, 1, expires, stale_until);
+    int default_cacheable = status == 200 || status == 203 || status == 204 || status == 300 ||
+                            status == 301 || status == 308 || status == 404 || status == 405 ||
+                            status == 410 || status == 414 || status == 501;
+    if (!default_cacheable && !explicit_lifetime) {
+        return 0;
+    }
+    
+    char value[8];
+    int validators = find_response_header(response, len, "ETag", value, sizeof(value)) >= 0 ||
+                     find_response_header(response, len, "Last-Modified", value, sizeof(value)) >= 0;
+    return validators || *stale_until > now;
+}
+
+// Shard selection uses the high bits; the low bits select the index bucket
+static cache_shard* cache_shard_for(uint64_t hash) {
+    return &cache_shards[(hash >> 48) & (cache_shard_count - 1)];
+}
+
+// Set up cache shards; config.cache_shards is rounded up to a power of two
+void init_cache() {
+    cache_shard_count = 1;
+    while (cache_shard_count < config.cache_shards && cache_shard_count < MAX_CACHE_SHARDS) {
+        cache_shard_count <<= 1;
+    }
+    
+    cache_shards = (cache_shard*)calloc(cache_shard_count, sizeof(cache_shard));
+    if (!cache_shards) {
+        perror("Cache shard allocation failed");
+        exit(1);
+    }
+    
+    for (int i = 0; i < cache_shard_count; i++) {
+        cache_shard* shard = &cache_shards[i];
+        shard->budget = MAX_SIZE / cache_shard_count;
+        shard->window_budget = shard->budget / 100 * ADMISSION_WINDOW_PERCENT;
+        shard->index_size = CACHE_INDEX_INITIAL_SIZE;
+        shard->index = (cache_element**)calloc(shard->index_size, sizeof(cache_element*));
+        if (!shard->index) {
+            perror("Cache index allocation failed");
+            exit(1);
+        }
+        if (pthread_rwlock_init(&shard->rwlock, NULL) != 0) {
+            perror("pthread_rwlock_init failed");
+            exit(1);
+        }
+    }
+    
+    if (config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        admission.sketch = cache_sketch_create(ADMISSION_SKETCH_ITEMS);
+        if (!admission.sketch) {
+            perror("Admission sketch allocation failed");
+            exit(1);
+        }
+    }
+}
+
+int cache_total_size() {
+    int total = 0;
+    for (int i = 0; i < cache_shard_count; i++) {
+        total += __atomic_load_n(&cache_shards[i].size, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Hash index management (caller must hold the shard lock)
+static cache_element* cache_index_lookup(cache_shard* shard, cache_key* key) {
+    cache_element* current = shard->index[key->hash & (shard->index_size - 1)];
+    while (current != NULL) {
+        if (current->hash == key->hash && current->url_len == key->len &&
+            memcmp(current->url, key->str, key->len) == 0) {
+            return current;
+        }
+        current = current->hash_next;
+    }
+    return NULL;
+}
+
+static void cache_index_resize(cache_shard* shard, size_t new_size) {
+    cache_element** new_index = (cache_element**)calloc(new_size, sizeof(cache_element*));
+    if (!new_index) {
+        return; // Keep the old table, lookups stay correct just slower
+    }
+    
+    for (size_t i = 0; i < shard->index_size; i++) {
+        cache_element* current = shard->index[i];
+        while (current != NULL) {
+            cache_element* next = current->hash_next;
+            size_t bucket = current->hash & (new_size - 1);
+            current->hash_next = new_index[bucket];
+            new_index[bucket] = current;
+            current = next;
+        }
+    }
+    
+    free(shard->index);
+    shard->index = new_index;
+    shard->index_size = new_size;
+}
+
+static void cache_index_insert(cache_shard* shard, cache_element* element) {
+    // Grow at a load factor of 0.75 to keep chains short
+    if ((shard->count + 1) * 4 > shard->index_size * 3) {
+        cache_index_resize(shard, shard->index_size * 2);
+    }
+    
+    size_t bucket = element->hash & (shard->index_size - 1);
+    element->hash_next = shard->index[bucket];
+    shard->index[bucket] = element;
+    shard->count++;
+}
+
+static void cache_index_remove(cache_shard* shard, cache_element* element) {
+    cache_element** link = &shard->index[element->hash & (shard->index_size - 1)];
+    while (*link != NULL) {
+        if (*link == element) {
+            *link = element->hash_next;
+            element->hash_next = NULL;
+            shard->count--;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    
+    // Shrink once the table is mostly empty
+    if (shard->index_size > CACHE_INDEX_INITIAL_SIZE && shard->count * 8 < shard->index_size) {
+        cache_index_resize(shard, shard->index_size / 2);
+    }
+}
+
+// Operations on one of a shard's element lists (caller must hold the shard write lock)
+static void cache_list_remove(cache_element** head, cache_element** tail, cache_element* element) {
+    if (element->prev) element->prev->next = element->next;
+    if (element->next) element->next->prev = element->prev;
+    if (element == *head) *head = element->next;
+    if (element == *tail) *tail = element->prev;
+    element->prev = NULL;
+    element->next = NULL;
+}
+
+static void cache_list_push(cache_element** head, cache_element** tail, cache_element* element) {
+    element->prev = NULL;
+    element->next = *head;
+    if (*head) (*head)->prev = element;
+    *head = element;
+    if (!*tail) *tail = element;
+}
+
+// Put replacement where element is on the list, taking element off it
+static void cache_list_replace(cache_element** head, cache_element** tail, cache_element* element,
+                               cache_element* replacement) {
+    replacement->prev = element->prev;
+    replacement->next = element->next;
+    if (element->prev) element->prev->next = replacement;
+    if (element->next) element->next->prev = replacement;
+    if (element == *head) *head = replacement;
+    if (element == *tail) *tail = replacement;
+    element->prev = NULL;
+    element->next = NULL;
+}
+
+// Move an element to the head of its list (caller must hold the shard write lock)
+static void cache_move_to_front(cache_shard* shard, cache_element* element) {
+    cache_element** head = element->in_window ? &shard->window_head : &shard->head;
+    cache_element** tail = element->in_window ? &shard->window_tail : &shard->tail;
+    if (element == *head) return;
+    
+    cache_list_remove(head, tail, element);
+    cache_list_push(head, tail, element);
+}
+
+// GDSF heap operations (caller must hold the shard write lock). A hit is
+// worth fetch cost per byte it saves, so small objects that are slow to
+// fetch and often asked for are kept longest. The inflation value ages
+// everything else: each new priority starts from the last evicted one.
+static double cache_gdsf_priority(cache_shard* shard, cache_element* element) {
+    int cost = element->cost_ms > 0 ? element->cost_ms : 1;
+    return shard->inflation + (double)element->access_count * cost / element->size;
+}
+
+static void cache_heap_set(cache_shard* shard, size_t index, cache_element* element) {
+    shard->heap[index] = element;
+    element->heap_index = index;
+}
+
+static void cache_heap_sift_up(cache_shard* shard, size_t index) {
+    cache_element* element = shard->heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (shard->heap[parent]->priority <= element->priority) break;
+        cache_heap_set(shard, index, shard->heap[parent]);
+        index = parent;
+    }
+    cache_heap_set(shard, index, element);
+}
+
+static void cache_heap_sift_down(cache_shard* shard, size_t index) {
+    cache_element* element = shard->heap[index];
+    for (;;) {
+        size_t child = index * 2 + 1;
+        if (child >= shard->heap_len) break;
+        if (child + 1 < shard->heap_len && shard->heap[child + 1]->priority < shard->heap[child]->priority) {
+            child++;
+        }
+        if (element->priority <= shard->heap[child]->priority) break;
+        cache_heap_set(shard, index, shard->heap[child]);
+        index = child;
+    }
+    cache_heap_set(shard, index, element);
+}
+
+static void cache_heap_push(cache_shard* shard, cache_element* element) {
+    element->heap_index = CACHE_HEAP_NONE;
+    if (shard->heap_len == shard->heap_cap) {
+        size_t new_cap = shard->heap_cap ? shard->heap_cap * 2 : CACHE_HEAP_INITIAL_SIZE;
+        cache_element** new_heap = (cache_element**)realloc(shard->heap, new_cap * sizeof(cache_element*));
+        if (!new_heap) {
+            return; // Off the heap, the element is still evicted from the list tail once the heap is empty
+        }
+        shard->heap = new_heap;
+        shard->heap_cap = new_cap;
+    }
+    element->priority = cache_gdsf_priority(shard, element);
+    shard->heap[shard->heap_len] = element;
+    cache_heap_sift_up(shard, shard->heap_len++);
+}
+
+static void cache_heap_remove(cache_shard* shard, cache_element* element) {
+    size_t index = element->heap_index;
+    if (index == CACHE_HEAP_NONE) return;
+    element->heap_index = CACHE_HEAP_NONE;
+    
+    cache_element* last = shard->heap[--shard->heap_len];
+    if (index == shard->heap_len) return;
+    cache_heap_set(shard, index, last);
+    if (index > 0 && shard->heap[(index - 1) / 2]->priority > last->priority) {
+        cache_heap_sift_up(shard, index);
+    } else {
+        cache_heap_sift_down(shard, index);
+    }
+}
+
+// Take the lowest priority element off the heap. It is kept in the slot
+// past the end, so cache_heap_restore() can put it back.
+static cache_element* cache_heap_take(cache_shard* shard) {
+    cache_element* element = shard->heap[0];
+    cache_heap_remove(shard, element);
+    shard->heap[shard->heap_len] = element;
+    return element;
+}
+
+// Put back the last `count` elements cache_heap_take() took, priorities unchanged
+static void cache_heap_restore(cache_shard* shard, size_t count) {
+    while (count-- > 0) {
+        cache_heap_sift_up(shard, shard->heap_len++);
+    }
+}
+
+// Recompute the priority of an element on the heap after a hit
+static void cache_heap_update(cache_shard* shard, cache_element* element) {
+    if (element->heap_index == CACHE_HEAP_NONE) return;
+    element->priority = cache_gdsf_priority(shard, element);
+    cache_heap_sift_down(shard, element->heap_index); // Priorities only grow
+}
+
+// Add an element to the head of the shard's main list (caller must hold the shard write lock)
+static void cache_main_insert(cache_shard* shard, cache_element* element) {
+    element->in_window = 0;
+    cache_list_push(&shard->head, &shard->tail, element);
+    if (config.cache_policy == CACHE_POLICY_GDSF) {
+        cache_heap_push(shard, element);
+    }
+}
+
+// Freshness of a cached element at now
+int cache_element_freshness(cache_element* element, time_t now) {
+    if (now < __atomic_load_n(&element->expires, __ATOMIC_RELAXED)) {
+        return CACHE_FRESH;
+    }
+    if (now < __atomic_load_n(&element->stale_until, __ATOMIC_RELAXED)) {
+        return CACHE_STALE_USABLE;
+    }
+    return CACHE_STALE;
+}
+
+// A conditional request for a stale element was answered 304: the stored
+// response is still valid, with the lifetime the 304 gives it. A 304
+// without freshness information of its own renews the stored lifetime.
+void cache_element_revalidated(cache_element* element, const char* response, int len) {
+    time_t now = time(NULL);
+    time_t expires, stale_until;
+    char value[8];
+    
+    if (find_response_header(response, len, "Cache-Control", value, sizeof(value)) >= 0 ||
+        find_response_header(response, len, "Expires", value, sizeof(value)) >= 0) {
+        response_lifetime(response, len, now, 1, &expires, &stale_until);
+    } else {
+        cache_segment* head = element->segments;
+        char* header_end = memmem(head->data, head->len, "\r\n\r\n", 4);
+        int header_len = header_end ? header_end - head->data + 4 : head->len;
+        response_lifetime(head->data, header_len, now, 0, &expires, &stale_until);
+    }
+    __atomic_store_n(&element->expires, expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&element->stale_until, stale_until, __ATOMIC_RELAXED);
+    
+    stats_add(STATS_REVALIDATED, 1);
+}
+
+// Find an element and count the hit for the replacement policy. Returns
+// it referenced, or NULL.
+static cache_element* cache_lookup(cache_key* key) {
+    cache_shard* shard = cache_shard_for(key->hash);
+    
+    pthread_rwlock_rdlock(&shard->rwlock);
+    cache_element* current = cache_index_lookup(shard, key);
+    
+    if (current != NULL && config.cache_policy == CACHE_POLICY_CLOCK) {
+        // CLOCK hits only mark the element; reordering happens at eviction time
+        __atomic_store_n(&current->referenced, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&current->access_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&current->lru_time_track, time(NULL), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&current->refcount, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&shard->rwlock);
+    } else {
+        pthread_rwlock_unlock(&shard->rwlock);
+        
+        if (current != NULL) {
+            // Move to front (most recently used)
+            pthread_rwlock_wrlock(&shard->rwlock);
+            
+            // Look up again, the element may have been evicted while unlocked
+            current = cache_index_lookup(shard, key);
+            if (current != NULL) {
+                current->lru_time_track = time(NULL);
+                current->access_count++;
+                cache_move_to_front(shard, current);
+                if (config.cache_policy == CACHE_POLICY_GDSF) {
+                    cache_heap_update(shard, current);
+                }
+                __atomic_fetch_add(&current->refcount, 1, __ATOMIC_RELAXED);
+            }
+            pthread_rwlock_unlock(&shard->rwlock);
+        }
+    }
+    return current;
+}
+
+// Compressed storage: gzip variant elements with a text body are replaced
+// by a gzipped copy after insert, off the request path. Clients that take
+// gzip are sent that copy as it is; the rest miss on their own variant and
+// get it inflated when they hit it (see cache_lookup_variant).
+
+// Whether a cached response is worth compressing: a 200 framed by a
+// Content-Length, without a coding, textual and not marked no-transform
+static int cache_element_compressible(cache_element* element) {
+    cache_segment* head = element->segments;
+    char* header_end = memmem(head->data, head->len, "\r\n\r\n", 4);
+    if (!header_end || strncmp(head->data, "HTTP/1.", 7) != 0 || atoi(head->data + 9) != 200) {
+        return 0;
+    }
+    
+    int header_len = header_end - head->data + 4;
+    char value[256];
+    if (find_response_header(head->data, header_len, "Content-Encoding", value, sizeof(value)) >= 0 ||
+        find_response_header(head->data, header_len, "Transfer-Encoding", value, sizeof(value)) >= 0) {
+        return 0;
+    }
+    if (find_response_header(head->data, header_len, "Content-Length", value, sizeof(value)) < 0 ||
+        atol(value) < COMPRESS_MIN_BYTES || atol(value) != element->len - header_len) {
+        return 0;
+    }
+    if (find_response_header(head->data, header_len, "Cache-Control", value, sizeof(value)) >= 0 &&
+        strcasestr(value, "no-transform")) {
+        return 0;
+    }
+    if (find_response_header(head->data, header_len, "Content-Type", value, sizeof(value)) < 0) {
+        return 0;
+    }
+    return strncasecmp(value, "text/", 5) == 0 || strcasestr(value, "json") || strcasestr(value, "javascript") ||
+           strcasestr(value, "ecmascript") || strcasestr(value, "xml");
+}
+
+// Deflate (to gzip) or inflate the body of element, which starts at
+// offset header_len, into fill. Returns 0 on success.
+static int cache_zlib_body(cache_element* element, int header_len, int compress, cache_fill* fill) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int result = compress ? deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+                          : inflateInit2(&stream, 15 + 16);
+    if (result != Z_OK) return -1;
+    
+    cache_segment* segment = element->segments;
+    int offset = header_len;
+    while (segment && offset >= segment->len) {
+        offset -= segment->len;
+        segment = segment->next;
+    }
+    
+    int status = -1;
+    while (1) {
+        if (stream.avail_in == 0 && segment) {
+            stream.next_in = (Bytef*)segment->data + offset;
+            stream.avail_in = segment->len - offset;
+            segment = segment->next;
+            offset = 0;
+        }
+        int avail;
+        char* space = fill->total <= MAX_ELEMENT_SIZE ? cache_fill_space(fill, &avail) : NULL;
+        if (!space) break;
+        
+        stream.next_out = (Bytef*)space;
+        stream.avail_out = avail;
+        int last = segment == NULL; // All input handed to zlib
+        result = compress ? deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH) : inflate(&stream, Z_NO_FLUSH);
+        cache_fill_commit(fill, avail - stream.avail_out);
+        
+        if (result == Z_STREAM_END) {
+            status = 0;
+            break;
+        }
+        // No progress with all input consumed means the body is truncated
+        if ((result != Z_OK && result != Z_BUF_ERROR) ||
+            (last && stream.avail_in == 0 && stream.avail_out > 0 && !compress)) {
+            break;
+        }
+    }
+    
+    if (compress) {
+        deflateEnd(&stream);
+    } else {
+        inflateEnd(&stream);
+    }
+    return status;
+}
+
+// Append the lines of a response header block to fill, leaving out the
+// headers named in skip (NULL terminated) and the blank line ending the
+// block. A strong ETag is made weak when weaken is set, since the bytes
+// change.
+static int cache_copy_headers(const char* headers, int header_len, const char* const* skip, int weaken,
+                              cache_fill* fill) {
+    const char* end = headers + header_len - 2;
+    const char* line = headers;
+    while (line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end ? line_end + 1 : end;
+        
+        int skipped = 0;
+        for (int i = 0; skip[i] && !skipped; i++) {
+            int name_len = strlen(skip[i]);
+            skipped = strncasecmp(line, skip[i], name_len) == 0 && line[name_len] == ':';
+        }
+        
+        int result = 0;
+        if (skipped) {
+            // Replaced by the caller
+        } else if (weaken && strncasecmp(line, "ETag:", 5) == 0) {
+            const char* value = line + 5;
+            while (*value == ' ' || *value == '\t') value++;
+            result = *value == '"' ? (cache_fill_append(fill, "ETag: W/", 8) < 0 ? -1 :
+                                      cache_fill_append(fill, value, line_end - value))
+                                   : cache_fill_append(fill, line, line_end - line);
+        } else {
+            result = cache_fill_append(fill, line, line_end - line);
+        }
+        if (result < 0) return -1;
+        line = line_end;
+    }
+    return 0;
+}
+
+// Move the segments of body to the end of fill
+static void cache_fill_join(cache_fill* fill, cache_fill* body) {
+    if (!body->head) return;
+    if (fill->tail) {
+        fill->tail->next = body->head;
+    } else {
+        fill->head = body->head;
+    }
+    fill->tail = body->tail;
+    fill->total += body->total;
+    body->head = body->tail = NULL;
+    body->total = 0;
+}
+
+// Build element's response with its body gzipped (compress) or inflated
+// into fill, headers adjusted to match. Returns 0 on success.
+static int cache_recode(cache_element* element, int compress, cache_fill* fill) {
+    cache_segment* head = element->segments;
+    char* header_end = memmem(head->data, head->len, "\r\n\r\n", 4);
+    if (!header_end) return -1;
+    int header_len = header_end - head->data + 4;
+    
+    cache_fill body;
+    cache_fill_init(&body);
+    cache_fill_init(fill);
+    if (cache_zlib_body(element, header_len, compress, &body) < 0) {
+        segment_chain_free(body.head);
+        return -1;
+    }
+    
+    // Responses only Vary on Accept-Encoding here (response_vary_is_keyed)
+    char vary[64];
+    int varies = find_response_header(head->data, header_len, "Vary", vary, sizeof(vary)) >= 0;
+    char framing[128];
+    int framing_len = snprintf(framing, sizeof(framing), "%s%sContent-Length: %d\r\n\r\n",
+                               compress ? "Content-Encoding: gzip\r\n" : "",
+                               compress && !varies ? "Vary: Accept-Encoding\r\n" : "", body.total);
+    static const char* const replaced[] = { "Content-Length", "Content-Encoding", NULL };
+    if (cache_copy_headers(head->data, header_len, replaced, compress, fill) < 0 ||
+        cache_fill_append(fill, framing, framing_len) < 0) {
+        segment_chain_free(body.head);
+        segment_chain_free(fill->head);
+        cache_fill_init(fill);
+        return -1;
+    }
+    
+    cache_fill_join(fill, &body);
+    return 0;
+}
+
+// New element with the key, validators and lifetime of like, taking over
+// the fill's segments. It is not in the cache and holds one reference.
+static cache_element* cache_element_derive(cache_element* like, cache_fill* fill) {
+    int etag_len = strlen(like->etag);
+    int last_modified_len = strlen(like->last_modified);
+    size_t header_size = sizeof(cache_element) + like->url_len + 1 + etag_len + 1 + last_modified_len + 1;
+    cache_element* element = (cache_element*)slab_alloc(header_size);
+    if (!element) return NULL;
+    
+    memset(element, 0, sizeof(*element));
+    element->url = (char*)(element + 1);
+    element->etag = element->url + like->url_len + 1;
+    element->last_modified = element->etag + etag_len + 1;
+    memcpy(element->url, like->url, like->url_len + 1);
+    memcpy(element->etag, like->etag, etag_len + 1);
+    memcpy(element->last_modified, like->last_modified, last_modified_len + 1);
+    element->url_len = like->url_len;
+    element->hash = like->hash;
+    
+    element->segments = fill->head;
+    element->len = fill->total;
+    element->size = slab_chunk_size(header_size) + segment_chain_size(fill->head);
+    element->delimited = response_is_delimited(fill->head->data, fill->head->len);
+    fill->head = fill->tail = NULL;
+    fill->total = 0;
+    
+    element->expires = __atomic_load_n(&like->expires, __ATOMIC_RELAXED);
+    element->stale_until = __atomic_load_n(&like->stale_until, __ATOMIC_RELAXED);
+    element->lru_time_track = like->lru_time_track;
+    element->creation_time = like->creation_time;
+    element->access_count = like->access_count;
+    element->cost_ms = like->cost_ms;
+    element->heap_index = CACHE_HEAP_NONE;
+    element->refcount = 1;
+    return element;
+}
+
+// With compressed storage a miss on one variant may be answered by the
+// other one if it is fresh: an identity response suits every client, a
+// gzipped one is sent to gzip clients as it is and inflated for the rest.
+// Returns a referenced element, possibly a private inflated copy, or NULL.
+static cache_element* cache_lookup_variant(cache_key* key) {
+    int suffix_len = sizeof(CACHE_KEY_GZIP) - 1;
+    int gzip = key->len >= suffix_len && memcmp(key->str + key->len - suffix_len, CACHE_KEY_GZIP, suffix_len) == 0;
+    if (!gzip && key->len + suffix_len >= CACHE_KEY_LEN) return NULL;
+    
+    cache_key other;
+    other.len = gzip ? key->len - suffix_len : key->len;
+    memcpy(other.str, key->str, other.len);
+    if (!gzip) {
+        memcpy(other.str + other.len, CACHE_KEY_GZIP, suffix_len);
+        other.len += suffix_len;
+    }
+    other.str[other.len] = '\0';
+    other.hash = cache_hash(other.str, other.len);
+    
+    cache_element* element = cache_lookup(&other);
+    if (!element) return NULL;
+    
+    cache_segment* head = element->segments;
+    char* header_end = memmem(head->data, head->len, "\r\n\r\n", 4);
+    char coding[32];
+    int coded = header_end && find_response_header(head->data, header_end - head->data + 4, "Content-Encoding",
+                                                   coding, sizeof(coding)) >= 0;
+    if (cache_element_freshness(element, time(NULL)) != CACHE_FRESH || !header_end ||
+        (coded && strcasecmp(coding, "gzip") != 0)) {
+        release_cache_element(element);
+        return NULL;
+    }
+    if (!coded || gzip) {
+        return element;
+    }
+    
+    cache_fill fill;
+    cache_element* inflated = NULL;
+    if (cache_recode(element, 0, &fill) == 0) {
+        inflated = cache_element_derive(element, &fill);
+        if (!inflated) segment_chain_free(fill.head);
+    }
+    release_cache_element(element);
+    if (inflated) stats_add(STATS_INFLATED, 1);
+    return inflated;
+}
+
+// Append len bytes of element's response, from offset on, to fill
+static int cache_append_slice(cache_fill* fill, cache_element* element, long offset, long len) {
+    for (cache_segment* segment = element->segments; segment && len > 0; segment = segment->next) {
+        if (offset >= segment->len) {
+            offset -= segment->len;
+            continue;
+        }
+        int bytes = segment->len - offset < len ? segment->len - offset : len;
+        if (cache_fill_append(fill, segment->data + offset, bytes) < 0) return -1;
+        len -= bytes;
+        offset = 0;
+    }
+    return 0;
+}
+
+// Answer a Range request from a cached complete 200: a 206 carrying one
+// range or a multipart/byteranges body for several, a 416 if none of them
+// can be satisfied. Ranges are taken from the stored copy, without asking
+// the origin. Returns a private element to send in place of element, or
+// NULL to send element as it is: without a usable Range header, when
+// If-Range does not match it, or when its body length is not known.
+static cache_element* cache_range_element(cache_element* element, ParsedRequest* request) {
+    ParsedRange ranges[PARSED_MAX_RANGES];
+    int count = ParsedRequest_getRanges(request, ranges, PARSED_MAX_RANGES);
+    if (count <= 0) return NULL;
+    
+    cache_segment* head = element->segments;
+    char* header_end = memmem(head->data, head->len, "\r\n\r\n", 4);
+    if (!header_end || strncmp(head->data, "HTTP/1.", 7) != 0 || atoi(head->data + 9) != 200) {
+        return NULL;
+    }
+    int header_len = header_end - head->data + 4;
+    long length = element->len - header_len;
+    char value[256];
+    if (find_response_header(head->data, header_len, "Transfer-Encoding", value, sizeof(value)) >= 0 ||
+        find_response_header(head->data, header_len, "Content-Length", value, sizeof(value)) < 0 ||
+        atol(value) != length) {
+        return NULL;
+    }
+    
+    // If-Range holds an entity tag or a date; only an exact match with the
+    // stored response's strong validator of that kind lets ranges through
+    const char* if_range = ParsedRequest_getHeader(request, "If-Range");
+    if (if_range) {
+        const char* validator = if_range[0] == '"' ? "ETag" : "Last-Modified";
+        if (find_response_header(head->data, header_len, validator, value, sizeof(value)) < 0 ||
+            strcmp(value, if_range) != 0) {
+            return NULL;
+        }
+    }
+    
+    // Resolve suffix and open ended ranges against the body length,
+    // dropping the ones that start past its end
+    int satisfiable = 0;
+    long total = 0;
+    for (int i = 0; i < count; i++) {
+        long first = ranges[i].first, last = ranges[i].last;
+        if (first < 0) {
+            if (last == 0) continue;
+            first = last < length ? length - last : 0;
+            last = length - 1;
+        } else {
+            if (first >= length) continue;
+            if (last < 0 || last >= length) last = length - 1;
+        }
+        ranges[satisfiable].first = first;
+        ranges[satisfiable].last = last;
+        satisfiable++;
+        total += last - first + 1;
+    }
+    // Overlapping ranges adding up to more than the body get the body
+    if (total > length) return NULL;
+    
+    cache_fill fill, body;
+    cache_fill_init(&fill);
+    cache_fill_init(&body);
+    char line[256];
+    int line_len;
+    int status_len = (char*)memchr(head->data, '\n', header_len) - head->data + 1;
+    
+    if (satisfiable == 0) {
+        line_len = snprintf(line, sizeof(line), "%.8s 416 Range Not Satisfiable\r\n"
+                            "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", head->data, length);
+        if (cache_fill_append(&fill, line, line_len) < 0) goto fail;
+    } else if (satisfiable == 1) {
+        static const char* const replaced[] = { "Content-Length", NULL };
+        line_len = snprintf(line, sizeof(line), "%.8s 206 Partial Content\r\n", head->data);
+        if (cache_fill_append(&fill, line, line_len) < 0 ||
+            cache_copy_headers(head->data + status_len, header_len - status_len, replaced, 0, &fill) < 0) {
+            goto fail;
+        }
+        line_len = snprintf(line, sizeof(line), "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n\r\n",
+                            ranges[0].first, ranges[0].last, length, total);
+        if (cache_fill_append(&fill, line, line_len) < 0 ||
+            cache_append_slice(&fill, element, header_len + ranges[0].first, total) < 0) {
+            goto fail;
+        }
+    } else {
+        // Each part repeats the Content-Type of the whole, which the
+        // multipart type takes the place of
+        static const char* const replaced[] = { "Content-Length", "Content-Type", NULL };
+        char type[256];
+        int typed = find_response_header(head->data, header_len, "Content-Type", type, sizeof(type)) >= 0;
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)element->hash);
+        
+        for (int i = 0; i < satisfiable; i++) {
+            line_len = snprintf(line, sizeof(line), "\r\n--%s\r\n%s%s%sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                boundary, typed ? "Content-Type: " : "", typed ? type : "", typed ? "\r\n" : "",
+                                ranges[i].first, ranges[i].last, length);
+            if (line_len >= (int)sizeof(line) || cache_fill_append(&body, line, line_len) < 0 ||
+                cache_append_slice(&body, element, header_len + ranges[i].first,
+                                   ranges[i].last - ranges[i].first + 1) < 0) {
+                goto fail;
+            }
+        }
+        line_len = snprintf(line, sizeof(line), "\r\n--%s--\r\n", boundary);
+        if (cache_fill_append(&body, line, line_len) < 0) goto fail;
+        
+        line_len = snprintf(line, sizeof(line), "%.8s 206 Partial Content\r\n", head->data);
+        if (cache_fill_append(&fill, line, line_len) < 0 ||
+            cache_copy_headers(head->data + status_len, header_len - status_len, replaced, 0, &fill) < 0) {
+            goto fail;
+        }
+        line_len = snprintf(line, sizeof(line), "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                            "Content-Length: %d\r\n\r\n", boundary, body.total);
+        if (cache_fill_append(&fill, line, line_len) < 0) goto fail;
+        cache_fill_join(&fill, &body);
+    }
+    
+    cache_element* ranged = cache_element_derive(element, &fill);
+    if (!ranged) goto fail;
+    stats_add(STATS_RANGES, 1);
+    return ranged;
+    
+fail:
+    segment_chain_free(body.head);
+    segment_chain_free(fill.head);
+    return NULL;
+}
+
+// Optimized cache lookup with per-shard read-write locks and hash index.
+// Returns a referenced element that the caller must release_cache_element(),
+// and its freshness (CACHE_*). Stale elements still count as misses.
+cache_element* find_in_cache(cache_key* key, int* freshness) {
+    // Admission compares how often keys are asked for, cached or not
+    if (config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        cache_sketch_increment(admission.sketch, key->hash);
+    }
+    
+    cache_element* current = cache_lookup(key);
+    if (current == NULL && config.cache_compress) {
+        current = cache_lookup_variant(key);
+    }
+    
+    *freshness = current ? cache_element_freshness(current, time(NULL)) : CACHE_STALE;
+    
+    // Update statistics
+    if (current != NULL && *freshness != CACHE_STALE) {
+        stats_add(STATS_CACHE_HITS, 1);
+        stats_add(STATS_BYTES_HIT, current->len);
+        if (*freshness == CACHE_STALE_USABLE) stats_add(STATS_STALE_SERVED, 1);
+    } else {
+        stats_add(STATS_CACHE_MISSES, 1);
+    }
+    
+    // A miss on a key the admission filter turned away, counted once per rejection
+    if (current == NULL && config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        uint64_t* slot = &admission.rejected_keys[key->hash % ADMISSION_REJECTED_SLOTS];
+        uint64_t expected = key->hash;
+        if (__atomic_compare_exchange_n(slot, &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&admission.rejected_misses, 1, __ATOMIC_RELAXED);
+        }
+    }
+    
+    return current;
+}
+
+// Unlink an element from its shard's LRU list and hash index (caller must hold the shard lock)
+static void cache_unlink_element(cache_shard* shard, cache_element* element) {
+    if (element->in_window) {
+        cache_list_remove(&shard->window_head, &shard->window_tail, element);
+        shard->window_size -= element->size;
+    } else {
+        cache_list_remove(&shard->head, &shard->tail, element);
+        cache_heap_remove(shard, element);
+    }
+    cache_index_remove(shard, element);
+    shard->size -= element->size;
+}
+
+static void free_cache_element(cache_element* element) {
+    segment_chain_free(element->segments);
+    slab_free(element);
+}
+
+// Drop a reference; the element is freed once it is unlinked and no reader holds it
+void release_cache_element(cache_element* element) {
+    if (__atomic_sub_fetch(&element->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_cache_element(element);
+    }
+}
+
+// Hand an element evicted for space to the disk tier, taking over the
+// cache's reference. Only fresh elements are kept there, and if the disk
+// writer is behind the element is dropped rather than stalling eviction.
+void cache_demote(cache_element* element) {
+    if (!disk_cache_enabled() || time(NULL) >= __atomic_load_n(&element->expires, __ATOMIC_RELAXED)) {
+        release_cache_element(element);
+        return;
+    }
+    
+    pthread_mutex_lock(&demote_queue.mutex);
+    if (demote_queue.bytes + element->len > DEMOTE_QUEUE_MAX) {
+        pthread_mutex_unlock(&demote_queue.mutex);
+        release_cache_element(element);
+        return;
+    }
+    element->next = NULL;
+    if (demote_queue.tail) {
+        demote_queue.tail->next = element;
+    } else {
+        demote_queue.head = element;
+    }
+    demote_queue.tail = element;
+    demote_queue.bytes += element->len;
+    pthread_cond_signal(&demote_queue.ready);
+    pthread_mutex_unlock(&demote_queue.mutex);
+}
+
+// Writes demoted elements to the disk tier
+void* disk_writer_thread(void* arg) {
+    while (server_running) {
+        pthread_mutex_lock(&demote_queue.mutex);
+        while (!demote_queue.head && server_running) {
+            pthread_cond_wait(&demote_queue.ready, &demote_queue.mutex);
+        }
+        if (!demote_queue.head) {
+            pthread_mutex_unlock(&demote_queue.mutex);
+            break;
+        }
+        cache_element* element = demote_queue.head;
+        demote_queue.head = element->next;
+        if (!demote_queue.head) demote_queue.tail = NULL;
+        demote_queue.bytes -= element->len;
+        pthread_mutex_unlock(&demote_queue.mutex);
+        
+        int count = 0;
+        for (cache_segment* segment = element->segments; segment; segment = segment->next) {
+            count++;
+        }
+        struct iovec* iov = (struct iovec*)malloc(count * sizeof(struct iovec));
+        if (iov) {
+            disk_cache_meta meta;
+            meta.creation_time = element->creation_time;
+            meta.expires = __atomic_load_n(&element->expires, __ATOMIC_RELAXED);
+            meta.stale_until = __atomic_load_n(&element->stale_until, __ATOMIC_RELAXED);
+            meta.delimited = element->delimited;
+            
+            count = segment_iov(element->segments, 0, iov, count);
+            disk_cache_store(element->hash, element->url, element->url_len, &meta, iov, count, element->len);
+            free(iov);
+        }
+        release_cache_element(element);
+    }
+    return NULL;
+}
+
+// Demote a chain of elements evicted for space (linked through next),
+// called without the lock held
+static void demote_evicted_elements(cache_element* chain) {
+    while (chain) {
+        cache_element* next = chain->next;
+        cache_demote(chain);
+        chain = next;
+    }
+}
+
+// Second tier lookup after a memory miss. Only fresh copies are served
+// from disk, stale ones are dropped and fetched again. Returns 1 with ref
+// pinned for the caller to disk_cache_release(), or 0.
+int find_on_disk(cache_key* key, disk_cache_ref* ref) {
+    if (!disk_cache_lookup(key->hash, key->str, key->len, ref)) {
+        return 0;
+    }
+    if (time(NULL) >= ref->meta.expires) {
+        disk_cache_release(ref);
+        disk_cache_remove(key->hash, key->str, key->len);
+        return 0;
+    }
+    
+    // find_in_cache() counted the request as a miss
+    stats_add(STATS_CACHE_MISSES, -1);
+    stats_add(STATS_CACHE_HITS, 1);
+    stats_add(STATS_BYTES_HIT, ref->len);
+    stats_add(STATS_DISK_HITS, 1);
+    return 1;
+}
+
+// Send a response from the disk tier straight from its segment file
+int send_disk_element(int socket, disk_cache_ref* ref) {
+    off_t offset = ref->offset;
+    size_t left = ref->len;
+    
+    while (left > 0) {
+        ssize_t sent = sendfile(socket, ref->fd, &offset, left);
+        if (sent < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_socket(socket, POLLOUT, CONNECTION_TIMEOUT * 1000) > 0) {
+                continue;
+            }
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (sent == 0) return -1;
+        left -= sent;
+    }
+    return 0;
+}
+
+// Pick the next eviction victim (caller must hold the shard write lock).
+// Under LRU hits are moved to the head, so the tail is always the victim.
+// Under CLOCK referenced elements get a second chance: their bit is
+// cleared and they are rotated to the head. Under GDSF the victim is the
+// top of the heap.
+static cache_element* cache_select_victim(cache_shard* shard) {
+    if (config.cache_policy == CACHE_POLICY_GDSF && shard->heap_len > 0) {
+        return shard->heap[0];
+    }
+    if (config.cache_policy == CACHE_POLICY_CLOCK) {
+        size_t scanned = 0;
+        while (shard->tail && scanned++ < shard->count) {
+            cache_element* candidate = shard->tail;
+            if (!__atomic_exchange_n(&candidate->referenced, 0, __ATOMIC_RELAXED)) {
+                break;
+            }
+            cache_move_to_front(shard, candidate);
+        }
+    }
+    return shard->tail ? shard->tail : shard->window_tail;
+}
+
+// Unlink an eviction victim; under GDSF its priority becomes the new
+// inflation value (caller must hold the shard write lock)
+static void cache_evict_element(cache_shard* shard, cache_element* victim) {
+    if (config.cache_policy == CACHE_POLICY_GDSF && victim->heap_index != CACHE_HEAP_NONE) {
+        shard->inflation = victim->priority;
+    }
+    cache_unlink_element(shard, victim);
+}
+
+// Bytes the shard has to give up: what it holds past its share, as long
+// as the cache as a whole is full. Borrowing from the other shards lets an
+// object larger than a shard's share be cached whatever the shard count;
+// they give the bytes back through cache_rebalance().
+static int cache_shard_excess(int over_share, int total) {
+    int over_total = total - MAX_SIZE;
+    return over_share < over_total ? over_share : over_total;
+}
+
+// Evict victims until `needed` more bytes fit in the shard.
+// Returns the unlinked elements so they can be freed after the lock is released.
+static cache_element* evict_cache_batch(cache_shard* shard, int needed) {
+    cache_element* evicted = NULL;
+    int others = cache_total_size() - shard->size;
+    
+    while (cache_shard_excess(shard->size + needed - shard->budget, others + shard->size + needed) > 0 &&
+           (shard->tail || shard->window_tail)) {
+        cache_element* lru = cache_select_victim(shard);
+        cache_evict_element(shard, lru);
+        lru->next = evicted;
+        evicted = lru;
+    }
+    return evicted;
+}
+
+// Walk the victims a candidate on the main list would displace, in the
+// order cache_select_victim() picks them, without evicting any. True if
+// they free `excess` bytes (or run out) before one the sketch rates at
+// least as frequent as the candidate. Under GDSF the victims walked are
+// taken off the heap (*taken of them), for the caller to evict or restore.
+static int cache_admission_wins(cache_shard* shard, cache_element* candidate, int frequency,
+                                int excess, size_t* taken) {
+    int freed = 0;
+    *taken = 0;
+    if (config.cache_policy == CACHE_POLICY_GDSF) {
+        while (freed < excess && shard->heap_len > 0 && shard->heap[0] != candidate) {
+            if (cache_sketch_estimate(admission.sketch, shard->heap[0]->hash) >= frequency) {
+                return 0;
+            }
+            freed += cache_heap_take(shard)->size;
+            (*taken)++;
+        }
+        return 1;
+    }
+    
+    // Under CLOCK referenced elements get a second chance, so they only
+    // go once every unreferenced one has
+    int clock = config.cache_policy == CACHE_POLICY_CLOCK;
+    for (int pass = 0; pass <= clock; pass++) {
+        for (cache_element* victim = shard->tail; victim && freed < excess; victim = victim->prev) {
+            int referenced = clock && __atomic_load_n(&victim->referenced, __ATOMIC_RELAXED);
+            if (referenced != pass) continue;
+            if (victim == candidate) return 1;
+            if (cache_sketch_estimate(admission.sketch, victim->hash) >= frequency) {
+                return 0;
+            }
+            freed += victim->size;
+        }
+    }
+    return 1;
+}
+
+// Move elements that overflowed the admission window to the main list.
+// Once the main list is full a candidate only gets in if the sketch rates
+// it more frequent than each victim it displaces, otherwise it is dropped
+// and the main list left as it was.
+// Returns the displaced victims; rejected candidates go to *rejected.
+static cache_element* cache_admit_from_window(cache_shard* shard, cache_element** rejected) {
+    cache_element* evicted = NULL;
+    int main_budget = shard->budget - shard->window_budget;
+    int others = cache_total_size() - shard->size;
+    
+    while (shard->window_size > shard->window_budget && shard->window_tail) {
+        cache_element* candidate = shard->window_tail;
+        cache_list_remove(&shard->window_head, &shard->window_tail, candidate);
+        shard->window_size -= candidate->size;
+        cache_main_insert(shard, candidate);
+        
+        int frequency = cache_sketch_estimate(admission.sketch, candidate->hash);
+        size_t taken;
+        int excess = cache_shard_excess(shard->size - shard->window_size - main_budget, others + shard->size);
+        if (!cache_admission_wins(shard, candidate, frequency, excess, &taken)) {
+            cache_heap_restore(shard, taken);
+            cache_unlink_element(shard, candidate);
+            candidate->next = *rejected;
+            *rejected = candidate;
+            __atomic_fetch_add(&admission.rejected, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&admission.rejected_keys[candidate->hash % ADMISSION_REJECTED_SLOTS],
+                             candidate->hash, __ATOMIC_RELAXED);
+            continue;
+        }
+        
+        __atomic_fetch_add(&admission.admitted, 1, __ATOMIC_RELAXED);
+        if (config.cache_policy == CACHE_POLICY_GDSF) {
+            // Already off the heap, the highest priority of them becomes the inflation value
+            for (size_t i = 0; i < taken; i++) {
+                cache_element* victim = shard->heap[shard->heap_len + taken - 1 - i];
+                shard->inflation = victim->priority;
+                cache_unlink_element(shard, victim);
+                victim->next = evicted;
+                evicted = victim;
+            }
+            continue;
+        }
+        while (cache_shard_excess(shard->size - shard->window_size - main_budget, others + shard->size) > 0) {
+            cache_element* victim = cache_select_victim(shard);
+            if (victim == candidate) break;
+            cache_evict_element(shard, victim);
+            victim->next = evicted;
+            evicted = victim;
+        }
+    }
+    
+    // The window alone may still be over budget while the main list is empty
+    cache_element* reclaimed = evict_cache_batch(shard, 0);
+    while (reclaimed) {
+        cache_element* next = reclaimed->next;
+        reclaimed->next = evicted;
+        evicted = reclaimed;
+        reclaimed = next;
+    }
+    return evicted;
+}
+
+// O(1) LRU removal: evicts the victim of the fullest shard other than
+// spare (which may be NULL). Returns 0 if there was nothing to evict.
+int remove_lru_element(cache_shard* spare) {
+    cache_shard* shard = NULL;
+    for (int i = 0; i < cache_shard_count; i++) {
+        if (&cache_shards[i] != spare && (!shard || __atomic_load_n(&cache_shards[i].size, __ATOMIC_RELAXED) >
+                                                    __atomic_load_n(&shard->size, __ATOMIC_RELAXED))) {
+            shard = &cache_shards[i];
+        }
+    }
+    if (!shard) return 0;
+    
+    pthread_rwlock_wrlock(&shard->rwlock);
+    
+    cache_element* lru = cache_select_victim(shard);
+    if (lru) {
+        cache_evict_element(shard, lru);
+    }
+    
+    pthread_rwlock_unlock(&shard->rwlock);
+    
+    if (lru) {
+        cache_demote(lru);
+    }
+    return lru != NULL;
+}
+
+// A shard that went past its share borrowed bytes the other shards give
+// back, fullest first, once the cache as a whole is over MAX_SIZE
+static void cache_rebalance(cache_shard* borrower) {
+    while (cache_total_size() > MAX_SIZE && remove_lru_element(borrower)) {
+    }
+}
+
+// Optimized cache addition: the fill's segment chain becomes the element's
+// data without being copied. On success the fill is emptied, otherwise the
+// caller still owns its segments. If ref is given it receives a reference
+// to the new element for the caller to release.
+int add_to_cache(cache_fill* fill, cache_key* key, cache_element** ref) {
+    cache_shard* shard = cache_shard_for(key->hash);
+    
+    if (fill->total == 0 || fill->total > MAX_ELEMENT_SIZE) {
+        return 0;
+    }
+    
+    // Move a partially used tail segment into the best fitting size class
+    // so small objects don't pin a whole segment
+    cache_segment* tail = fill->tail;
+    if (!fill->shared && slab_chunk_size(sizeof(cache_segment) + tail->len) < sizeof(cache_segment) + tail->cap) {
+        cache_segment* trimmed = segment_alloc_sized(tail->len);
+        if (trimmed) {
+            cache_segment** link = &fill->head;
+            while (*link != tail) link = &(*link)->next;
+            memcpy(trimmed->data, tail->data, tail->len);
+            trimmed->len = tail->len;
+            *link = trimmed;
+            fill->tail = trimmed;
+            segment_free(tail);
+        }
+    }
+    
+    // Validators are kept for revalidating the element once it is stale
+    // (the headers are complete in the first segment, see cache_fill_check)
+    char etag[CACHE_VALIDATOR_LEN], last_modified[CACHE_VALIDATOR_LEN];
+    int etag_len = find_response_header(fill->head->data, fill->head->len, "ETag", etag, sizeof(etag));
+    int last_modified_len = find_response_header(fill->head->data, fill->head->len, "Last-Modified",
+                                                 last_modified, sizeof(last_modified));
+    if (etag_len < 0) etag_len = 0;
+    if (last_modified_len < 0) last_modified_len = 0;
+    
+    // Account the real slab memory used, not just the payload length
+    size_t header_size = sizeof(cache_element) + key->len + 1 + etag_len + 1 + last_modified_len + 1;
+    int element_size = slab_chunk_size(header_size) + segment_chain_size(fill->head);
+    
+    // Build the element before taking the lock so readers are not stalled.
+    // The element and its key share a single slab chunk.
+    cache_element* element = (cache_element*)slab_alloc(header_size);
+    if (!element) {
+        return 0;
+    }
+    element->url = (char*)(element + 1);
+    element->etag = element->url + key->len + 1;
+    element->last_modified = element->etag + etag_len + 1;
+    
+    element->segments = fill->head;
+    element->len = fill->total;
+    element->delimited = response_is_delimited(fill->head->data, fill->head->len);
+    fill->head = fill->tail = NULL;
+    fill->total = 0;
+    
+    memcpy(element->url, key->str, key->len + 1);
+    element->url_len = key->len;
+    memcpy(element->etag, etag, etag_len);
+    element->etag[etag_len] = '\0';
+    memcpy(element->last_modified, last_modified, last_modified_len);
+    element->last_modified[last_modified_len] = '\0';
+    element->expires = fill->expires;
+    element->stale_until = fill->stale_until;
+    element->refreshing = 0;
+    element->size = element_size;
+    element->hash = key->hash;
+    element->lru_time_track = time(NULL);
+    element->creation_time = element->lru_time_track;
+    element->access_count = 1;
+    element->referenced = 0;
+    element->cost_ms = fill->cost_ms;
+    element->heap_index = CACHE_HEAP_NONE;
+    element->refcount = ref ? 2 : 1;
+    element->hash_next = NULL;
+    
+    // The compressor's reference is taken before readers can see the element
+    int suffix_len = sizeof(CACHE_KEY_GZIP) - 1;
+    int compress = config.cache_compress && key->len >= suffix_len &&
+                   memcmp(key->str + key->len - suffix_len, CACHE_KEY_GZIP, suffix_len) == 0 &&
+                   cache_element_compressible(element);
+    if (compress) element->refcount++;
+    
+    pthread_rwlock_wrlock(&shard->rwlock);
+    
+    // Replace any older copy; readers still streaming it keep their reference
+    cache_element* evicted = NULL;
+    cache_element* existing = cache_index_lookup(shard, key);
+    if (existing != NULL) {
+        cache_unlink_element(shard, existing);
+        evicted = existing;
+    }
+    
+    cache_element* reclaimed;
+    cache_element* rejected = NULL;
+    if (config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        // Enter through the window, what overflows it competes for the main list
+        element->in_window = 1;
+        cache_list_push(&shard->window_head, &shard->window_tail, element);
+        cache_index_insert(shard, element);
+        shard->size += element_size;
+        shard->window_size += element_size;
+        reclaimed = cache_admit_from_window(shard, &rejected);
+    } else {
+        // Make space for the whole element under a single lock acquisition
+        reclaimed = evict_cache_batch(shard, element_size);
+        
+        cache_main_insert(shard, element);
+        cache_index_insert(shard, element);
+        shard->size += element_size;
+    }
+    
+    pthread_rwlock_unlock(&shard->rwlock);
+    
+    if (evicted) release_cache_element(evicted);
+    demote_evicted_elements(reclaimed);
+    cache_rebalance(shard);
+    if (compress) cache_compress_enqueue(element);
+    
+    // Rejected elements are not worth a disk write either
+    while (rejected) {
+        cache_element* next = rejected->next;
+        release_cache_element(rejected);
+        rejected = next;
+    }
+    
+    // A copy demoted earlier is superseded
+    disk_cache_remove(key->hash, key->str, key->len);
+    if (ref) *ref = element;
+    return 1;
+}
+
+// Put replacement in the place of element if it is still the cached copy
+// of its key. Returns 0 if the key was replaced or evicted meanwhile.
+static int cache_replace_element(cache_element* element, cache_element* replacement) {
+    cache_shard* shard = cache_shard_for(element->hash);
+    cache_key key;
+    memcpy(key.str, element->url, element->url_len + 1);
+    key.len = element->url_len;
+    key.hash = element->hash;
+    
+    pthread_rwlock_wrlock(&shard->rwlock);
+    if (cache_index_lookup(shard, &key) != element) {
+        pthread_rwlock_unlock(&shard->rwlock);
+        return 0;
+    }
+    
+    // The copy takes the element's place on its list and heap, it is only smaller
+    replacement->in_window = element->in_window;
+    replacement->referenced = __atomic_load_n(&element->referenced, __ATOMIC_RELAXED);
+    if (element->in_window) {
+        cache_list_replace(&shard->window_head, &shard->window_tail, element, replacement);
+        shard->window_size += replacement->size - element->size;
+    } else {
+        cache_list_replace(&shard->head, &shard->tail, element, replacement);
+    }
+    if (element->heap_index != CACHE_HEAP_NONE) {
+        cache_heap_set(shard, element->heap_index, replacement);
+        element->heap_index = CACHE_HEAP_NONE;
+        cache_heap_update(shard, replacement);
+    }
+    cache_index_remove(shard, element);
+    cache_index_insert(shard, replacement);
+    shard->size += replacement->size - element->size;
+    pthread_rwlock_unlock(&shard->rwlock);
+    
+    release_cache_element(element);
+    return 1;
+}
+
+// Hand a referenced element to the compressor, dropping it if the queue is full
+void cache_compress_enqueue(cache_element* element) {
+    pthread_mutex_lock(&compress_queue.mutex);
+    if (compress_queue.count == COMPRESS_QUEUE_SIZE) {
+        pthread_mutex_unlock(&compress_queue.mutex);
+        release_cache_element(element);
+        return;
+    }
+    compress_queue.elements[(compress_queue.head + compress_queue.count) % COMPRESS_QUEUE_SIZE] = element;
+    compress_queue.count++;
+    pthread_cond_signal(&compress_queue.ready);
+    pthread_mutex_unlock(&compress_queue.mutex);
+}
+
+// Replaces queued elements with gzipped copies when that saves enough
+void* cache_compress_thread(void* arg) {
+    while (server_running) {
+        pthread_mutex_lock(&compress_queue.mutex);
+        while (compress_queue.count == 0) {
+            pthread_cond_wait(&compress_queue.ready, &compress_queue.mutex);
+        }
+        cache_element* element = compress_queue.elements[compress_queue.head];
+        compress_queue.head = (compress_queue.head + 1) % COMPRESS_QUEUE_SIZE;
+        compress_queue.count--;
+        pthread_mutex_unlock(&compress_queue.mutex);
+        
+        // Only the queue's reference left means it is no longer cached
+        cache_fill fill;
+        if (__atomic_load_n(&element->refcount, __ATOMIC_ACQUIRE) > 1 && cache_recode(element, 1, &fill) == 0) {
+            cache_element* compressed = NULL;
+            if (fill.total <= (long)element->len * (100 - COMPRESS_MIN_SAVING) / 100) {
+                compressed = cache_element_derive(element, &fill);
+            }
+            if (!compressed) {
+                segment_chain_free(fill.head);
+            } else if (cache_replace_element(element, compressed)) {
+                stats_add(STATS_COMPRESSED, 1);
+                stats_add(STATS_COMPRESS_SAVED, element->len - compressed->len);
+            } else {
+                release_cache_element(compressed);
+            }
+        }
+        release_cache_element(element);
+    }
+    return NULL;
+}
+
+// Single-flight fetches: the first miss on a key fetches it, later misses
+// on the same key attach to that fetch and stream its bytes as they arrive
+// instead of going to the origin themselves
+
+static cache_inflight* cache_inflight_alloc(cache_key* key) {
+    cache_inflight* inflight = (cache_inflight*)calloc(1, sizeof(cache_inflight));
+    if (!inflight) return NULL;
+    
+    cache_fill_init(&inflight->fill);
+    if (key) {
+        inflight->key = *key;
+    } else {
+        cache_fill_abandon(&inflight->fill);
+    }
+    // Segments stay valid until the last reference is released, so neither
+    // followers nor the leader's unsent bytes lose them on abandonment
+    inflight->fill.shared = 1;
+    inflight->state = key ? INFLIGHT_FILLING : INFLIGHT_UNCACHEABLE;
+    inflight->refcount = 1;
+    pthread_mutex_init(&inflight->mutex, NULL);
+    pthread_cond_init(&inflight->cond, NULL);
+    return inflight;
+}
+
+// A fetch of its own for one request, filling the cache under key if given
+cache_inflight* cache_inflight_create(cache_key* key) {
+    return cache_inflight_alloc(key);
+}
+
+// Attach to the fetch in progress for key, or start one and set *leader
+// (the caller must then fetch it). Returns a referenced inflight, or NULL.
+cache_inflight* cache_inflight_join(cache_key* key, int* leader) {
+    size_t bucket = key->hash & (INFLIGHT_BUCKETS - 1);
+    
+    pthread_mutex_lock(&inflight_table.mutex);
+    for (cache_inflight* inflight = inflight_table.buckets[bucket]; inflight; inflight = inflight->next) {
+        if (inflight->key.hash == key->hash && inflight->key.len == key->len &&
+            memcmp(inflight->key.str, key->str, key->len) == 0) {
+            pthread_mutex_lock(&inflight->mutex);
+            inflight->refcount++;
+            pthread_mutex_unlock(&inflight->mutex);
+            pthread_mutex_unlock(&inflight_table.mutex);
+            
+            stats_add(STATS_COALESCED, 1);
+            *leader = 0;
+            return inflight;
+        }
+    }
+    
+    cache_inflight* inflight = cache_inflight_alloc(key);
+    if (inflight) {
+        inflight->listed = 1;
+        inflight->next = inflight_table.buckets[bucket];
+        inflight_table.buckets[bucket] = inflight;
+    }
+    pthread_mutex_unlock(&inflight_table.mutex);
+    *leader = 1;
+    return inflight;
+}
+
+// Stop new requests from attaching
+static void cache_inflight_unlist(cache_inflight* inflight) {
+    pthread_mutex_lock(&inflight_table.mutex);
+    if (inflight->listed) {
+        cache_inflight** link = &inflight_table.buckets[inflight->key.hash & (INFLIGHT_BUCKETS - 1)];
+        while (*link != inflight) link = &(*link)->next;
+        *link = inflight->next;
+        inflight->listed = 0;
+    }
+    pthread_mutex_unlock(&inflight_table.mutex);
+}
+
+// Tell followers there is progress (caller holds the inflight lock)
+static void cache_inflight_notify(cache_inflight* inflight) {
+    pthread_cond_broadcast(&inflight->cond);
+    if (inflight->waiters) {
+        event_wake_followers(inflight->waiters);
+        inflight->waiters = NULL;
+    }
+}
+
+// Leader: true while the response is being buffered
+int cache_inflight_filling(cache_inflight* inflight) {
+    return inflight->state == INFLIGHT_FILLING && !inflight->fill.abandoned;
+}
+
+// Leader: true while followers read the response
+int cache_inflight_followed(cache_inflight* inflight) {
+    pthread_mutex_lock(&inflight->mutex);
+    int followed = inflight->refcount > 1;
+    pthread_mutex_unlock(&inflight->mutex);
+    return followed;
+}
+
+// Leader: free space to receive into, or NULL once the response is not
+// being buffered (the leader then relays through its own buffer)
+char* cache_inflight_space(cache_inflight* inflight, int* avail) {
+    if (inflight->state != INFLIGHT_FILLING || inflight->fill.abandoned) return NULL;
+    
+    pthread_mutex_lock(&inflight->mutex);
+    char* space = cache_fill_space(&inflight->fill, avail);
+    if (!space) {
+        cache_fill_abandon(&inflight->fill);
+        inflight->state = INFLIGHT_UNCACHEABLE;
+        cache_inflight_notify(inflight);
+    } else if (!inflight->head) {
+        inflight->head = inflight->fill.head;
+    }
+    pthread_mutex_unlock(&inflight->mutex);
+    
+    if (!space) cache_inflight_unlist(inflight);
+    return space;
+}
+
+// Leader: publish bytes received into the space from cache_inflight_space()
+void cache_inflight_commit(cache_inflight* inflight, int bytes) {
+    pthread_mutex_lock(&inflight->mutex);
+    cache_fill_commit(&inflight->fill, bytes);
+    cache_fill_check(&inflight->fill, 0);
+    // A 304 to a revalidation is not stored, but is shared through the
+    // revalidated element (see cache_inflight_revalidated)
+    int abandoned = inflight->fill.abandoned &&
+                    !(inflight->revalidating && inflight->fill.status == 304);
+    if (abandoned) {
+        inflight->state = INFLIGHT_UNCACHEABLE;
+    }
+    cache_inflight_notify(inflight);
+    pthread_mutex_unlock(&inflight->mutex);
+    
+    if (abandoned) cache_inflight_unlist(inflight);
+}
+
+// Leader: the fetch is over. A complete response is added to the cache and
+// followers finish streaming it, otherwise they are failed. Only the first
+// call counts.
+void cache_inflight_finish(cache_inflight* inflight, int complete, int delimited) {
+    cache_inflight_unlist(inflight);
+    
+    pthread_mutex_lock(&inflight->mutex);
+    if (!inflight->finished) {
+        inflight->finished = 1;
+        inflight->delimited = delimited;
+        if (!complete) {
+            inflight->state = INFLIGHT_FAILED;
+        } else if (inflight->state == INFLIGHT_FILLING) {
+            cache_fill_check(&inflight->fill, 1);
+            if (inflight->fill.abandoned) {
+                inflight->state = INFLIGHT_UNCACHEABLE;
+            } else if (inflight->peered) {
+                // The owning peer keeps the copy
+                inflight->state = INFLIGHT_DONE;
+            } else {
+                // Without followers (the leader's own client included) the
+                // segments can be trimmed and need no extra reference
+                int followed = inflight->refcount > 1 || inflight->leader_behind;
+                inflight->fill.shared = followed;
+                add_to_cache(&inflight->fill, &inflight->key, followed ? &inflight->element : NULL);
+                inflight->fill.shared = 1;
+                inflight->state = INFLIGHT_DONE;
+            }
+        }
+        cache_inflight_notify(inflight);
+    }
+    pthread_mutex_unlock(&inflight->mutex);
+}
+
+// Leader: the stale element being revalidated is still valid, followers
+// stream it instead of the 304
+void cache_inflight_revalidated(cache_inflight* inflight, cache_element* element) {
+    cache_inflight_unlist(inflight);
+    
+    pthread_mutex_lock(&inflight->mutex);
+    if (!inflight->finished) {
+        inflight->finished = 1;
+        __atomic_fetch_add(&element->refcount, 1, __ATOMIC_RELAXED);
+        inflight->element = element;
+        inflight->head = element->segments;
+        inflight->delimited = element->delimited;
+        inflight->state = INFLIGHT_DONE;
+        cache_inflight_notify(inflight);
+    }
+    pthread_mutex_unlock(&inflight->mutex);
+}
+
+// Follower: next bytes to send from (*segment, *offset), for the caller to
+// advance *offset past what it sent. Returns the byte count, 0 if the
+// caller must wait for more, or -1 once there is nothing more to send
+// (inflight->state says whether the response completed). Caller holds
+// the inflight lock.
+int cache_inflight_next(cache_inflight* inflight, cache_segment** segment, int* offset, const char** data) {
+    if (inflight->state == INFLIGHT_FAILED || inflight->state == INFLIGHT_UNCACHEABLE) {
+        return -1;
+    }
+    // Nothing goes out before the headers have passed the cacheability
+    // check, nor while a 304 is coming in. A response of unknown length is
+    // held back until it is complete: it may still outgrow MAX_ELEMENT_SIZE,
+    // and a follower that sent part of it could not fetch it alone.
+    if ((!inflight->fill.checked || inflight->fill.abandoned || !inflight->fill.sized) &&
+        inflight->state == INFLIGHT_FILLING) {
+        return 0;
+    }
+    
+    if (!*segment) *segment = inflight->head;
+    while (*segment && *offset == (*segment)->len && (*segment)->next) {
+        *segment = (*segment)->next;
+        *offset = 0;
+    }
+    
+    int avail = *segment ? (*segment)->len - *offset : 0;
+    if (avail > 0) {
+        *data = (*segment)->data + *offset;
+        return avail;
+    }
+    return inflight->state == INFLIGHT_DONE ? -1 : 0;
+}
+
+// Leader: move its own client's position in the fill forward past bytes
+// sent. Unlike segment_advance() it stays on the last segment, where more
+// bytes are still to come, and starts at the first one once there is one.
+void leader_fill_skip(cache_inflight* inflight, cache_segment** segment, int* offset, long bytes) {
+    if (!*segment) {
+        *segment = inflight->head;
+        *offset = 0;
+    }
+    while (*segment) {
+        long left = (*segment)->len - *offset;
+        if (bytes < left || !(*segment)->next) {
+            *offset += bytes < left ? bytes : left;
+            return;
+        }
+        bytes -= left;
+        *segment = (*segment)->next;
+        *offset = 0;
+    }
+}
+
+// Leader: true while its own client has fill bytes left to be sent
+int leader_fill_unsent(cache_inflight* inflight, cache_segment** segment, int* offset) {
+    struct iovec iov;
+    leader_fill_skip(inflight, segment, offset, 0);
+    return segment_iov(*segment, *offset, &iov, 1) > 0;
+}
+
+// Leader: send its own client the fill from (*segment, *offset) on. The
+// client is one more reader of the fill, so the fetch never waits for it:
+// unless `wait` is set, only what it takes without blocking goes out.
+// Returns 1 if bytes are left unsent, 0 once it has caught up, or -1 if
+// the client failed. The leader is the only writer, so no lock is taken.
+int leader_send_fill(int socket, cache_inflight* inflight, cache_segment** segment, int* offset, int wait) {
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    
+    leader_fill_skip(inflight, segment, offset, 0);
+    while ((msg.msg_iovlen = segment_iov(*segment, *offset, iov, SEND_IOV_MAX)) > 0) {
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            if (!wait) return 1;
+            worker_io_begin();
+            int ready = wait_socket(socket, POLLOUT, CONNECTION_TIMEOUT * 1000);
+            worker_io_end();
+            if (ready <= 0) return -1;
+            continue;
+        }
+        leader_fill_skip(inflight, segment, offset, sent);
+    }
+    return 0;
+}
+
+// Drop a reference. The segments are freed with the last one.
+void cache_inflight_release(cache_inflight* inflight) {
+    pthread_mutex_lock(&inflight->mutex);
+    int last = --inflight->refcount == 0;
+    pthread_mutex_unlock(&inflight->mutex);
+    if (!last) return;
+    
+    if (inflight->element) release_cache_element(inflight->element);
+    inflight->fill.shared = 0;
+    segment_chain_free(inflight->fill.retired);
+    cache_fill_abandon(&inflight->fill);
+    pthread_mutex_destroy(&inflight->mutex);
+    pthread_cond_destroy(&inflight->cond);
+    free(inflight);
+}
+
+// Thread engine follower: stream the leader's response to the client.
+// Returns 0 once the response was sent (or the client went away), -1 if
+// the fetch failed before anything was sent, or FOLLOW_SOLO if the
+// response is not being shared and the caller must fetch it itself.
+int follow_inflight(int client_socket, cache_inflight* inflight, int* reusable) {
+    cache_segment* segment = NULL;
+    int offset = 0, sent = 0;
+    const char* data;
+    
+    *reusable = 0;
+    pthread_mutex_lock(&inflight->mutex);
+    while (1) {
+        int len = cache_inflight_next(inflight, &segment, &offset, &data);
+        if (len == 0) {
+            worker_io_begin();
+            pthread_cond_wait(&inflight->cond, &inflight->mutex);
+            worker_io_end();
+            continue;
+        }
+        if (len < 0) break;
+        
+        // Committed bytes never change, so they are sent unlocked
+        pthread_mutex_unlock(&inflight->mutex);
+        if (send_all(client_socket, data, len) < 0) {
+            return 0;
+        }
+        offset += len;
+        sent += len;
+        pthread_mutex_lock(&inflight->mutex);
+    }
+    int state = inflight->state;
+    if (state == INFLIGHT_DONE) {
+        *reusable = inflight->delimited;
+    }
+    pthread_mutex_unlock(&inflight->mutex);
+    
+    // Part of a response already went out, the connection just closes
+    if (state == INFLIGHT_DONE || sent > 0) return 0;
+    return state == INFLIGHT_UNCACHEABLE ? FOLLOW_SOLO : -1;
+}
+
+// Fetch a cache miss (or revalidate a stale element), following a fetch of
+// the same key already in flight if there is one. Returns 0 once a
+// response was relayed, -1 if none was.
+int fetch_coalesced(int client_socket, ParsedRequest* request, cache_key* key, cache_element* stale, int* reusable) {
+    int leader = 1;
+    cache_inflight* inflight = key ? cache_inflight_join(key, &leader) : cache_inflight_create(NULL);
+    if (!inflight) return -1;
+    
+    int result;
+    if (leader) {
+        result = handle_request_optimized(client_socket, request, inflight, stale, reusable);
+    } else {
+        result = follow_inflight(client_socket, inflight, reusable);
+        if (result == FOLLOW_SOLO) {
+            cache_inflight_release(inflight);
+            inflight = cache_inflight_create(NULL);
+            if (!inflight) return -1;
+            result = handle_request_optimized(client_socket, request, inflight, NULL, reusable);
+        }
+    }
+    cache_inflight_release(inflight);
+    return result;
+}
+
+// Read the next request header block from a client connection. Bytes of
+// pipelined requests already buffered are used first. Returns the length
+// of the header block, 0 if the connection closed or went idle (with
+// connections waiting on queue), or REQUEST_READER_TOO_LARGE.
+static int read_client_request(int client_socket, request_reader* reader, work_queue* queue, int idle) {
+    while (1) {
+        int request_len = request_reader_read(reader, client_socket);
+        if (request_len == REQUEST_READER_CLOSED) return 0;
+        if (request_len != REQUEST_READER_AGAIN) return request_len;
+        
+        // Between requests, give the worker back as soon as others are queued
+        if (idle && reader->len == 0) {
+            for (int waited = 0; ; waited += 100) {
+                if (waited >= KEEPALIVE_TIMEOUT * 1000 ||
+                    work_queue_size(queue) > 0 || !server_running) {
+                    return 0;
+                }
+                if (wait_socket(client_socket, POLLIN, 100) != 0) break;
+            }
+        } else if (wait_socket(client_socket, POLLIN, CONNECTION_TIMEOUT * 1000) <= 0) {
+            return 0;
+        }
+    }
+}
+
+// Serve successive (possibly pipelined) requests on one client connection
+// taken from queue
+void serve_client_connection(int client_socket, work_queue* queue) {
+    request_reader reader;
+    request_reader_init(&reader);
+    
+    for (int served = 0; served < KEEPALIVE_MAX_REQUESTS && server_running; served++) {
+        int request_len = read_client_request(client_socket, &reader, queue, served > 0);
+        if (request_len == REQUEST_READER_TOO_LARGE) {
+            sendErrorMessage(client_socket, 431);
+        }
+        if (request_len <= 0) {
+            break;
+        }
+        char *buffer = reader.buf;
+        
+        if (is_metrics_request(buffer, request_len)) {
+            int metrics_len;
+            char* metrics = build_metrics_response(&metrics_len);
+            if (metrics) {
+                send_all(client_socket, metrics, metrics_len);
+                free(metrics);
+            }
+            break;
+        }
+        
+        struct timeval request_start;
+        gettimeofday(&request_start, NULL);
+        int outcome = STATS_MISS;
+        int keep_alive = 0;
+        ParsedRequest* request = ParsedRequest_create();
+        if (request && ParsedRequest_parse(request, buffer, request_len) == 0) {
+            if (strcmp(request->method, "GET") == 0 && 
+                request->host && request->path) {
+                keep_alive = client_wants_keepalive(request);
+                
+                // Check cache first, keyed on the normalized request
+                cache_key key;
+                disk_cache_ref disk_ref;
+                int freshness;
+                int keyed = (build_cache_key(request, &key) == 0);
+                cache_element* cached = keyed ? find_in_cache(&key, &freshness) : NULL;
+                if (cached && freshness == CACHE_STALE && !cached->etag[0] && !cached->last_modified[0]) {
+                    // Nothing to revalidate with, fetch it again
+                    release_cache_element(cached);
+                    cached = NULL;
+                }
+                
+                if (cached != NULL && freshness != CACHE_STALE) {
+                    if (freshness == CACHE_STALE_USABLE) {
+                        cache_refresh_start(buffer, request_len, &key, cached);
+                    }
+                    cache_element* ranged = cache_range_element(cached, request);
+                    if (ranged) {
+                        release_cache_element(cached);
+                        cached = ranged;
+                    }
+                    // Serve from cache outside the lock
+                    if (send_cache_element(client_socket, cached) < 0 || !cached->delimited) {
+                        keep_alive = 0;
+                    }
+                    printf("Cache hit: %.*s\n", (int)strcspn(key.str, "\n"), key.str);
+                    release_cache_element(cached);
+                    outcome = STATS_HIT;
+                } else if (!cached && keyed && find_on_disk(&key, &disk_ref)) {
+                    if (send_disk_element(client_socket, &disk_ref) < 0 || !disk_ref.meta.delimited) {
+                        keep_alive = 0;
+                    }
+                    printf("Disk hit: %.*s\n", (int)strcspn(key.str, "\n"), key.str);
+                    disk_cache_release(&disk_ref);
+                    outcome = STATS_HIT;
+                } else {
+                    // A miss, or a stale element to revalidate
+                    int reusable = 0;
+                    if (fetch_coalesced(client_socket, request, keyed ? &key : NULL, cached, &reusable) < 0) {
+                        sendErrorMessage(client_socket, 500);
+                        outcome = STATS_ERROR;
+                    }
+                    keep_alive = keep_alive && reusable;
+                    if (cached) release_cache_element(cached);
+                }
+            } else {
+                sendErrorMessage(client_socket, 501);
+                outcome = STATS_ERROR;
+            }
+        } else {
+            sendErrorMessage(client_socket, 400);
+            outcome = STATS_ERROR;
+        }
+        ParsedRequest_destroy(request);
+        record_request_stats(outcome, &request_start);
+        
+        if (served > 0) {
+            stats_add(STATS_KEEPALIVE_REUSES, 1);
+        }
+        if (!keep_alive) {
+            break;
+        }
+        
+        // Keep pipelined bytes for the next request
+        request_reader_next(&reader);
+    }
+    
+    request_reader_release(&reader);
+}
+
+// Worker thread function for thread pool, serving one listener group.
+// Exits when the pool retires it while there is no work.
+void* worker_thread(void* arg) {
+    listener_group* group = (listener_group*)arg;
+    worker_group = group;
+    
+    while (server_running) {
+        work_item item;
+        if (dequeue_request(group, &item) < 0) {
+            int retiring = __atomic_load_n(&group->retiring, __ATOMIC_RELAXED);
+            if (retiring > 0 && __atomic_compare_exchange_n(&group->retiring, &retiring, retiring - 1, 0,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch(&worker_pool.retired, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            continue;
+        }
+        
+        int client_socket = item.client_socket;
+        __atomic_add_fetch(&group->dequeued, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&group->wait_us, elapsed_us(&item.queued_at), __ATOMIC_RELAXED);
+        
+        // Process requests until the client connection is done
+        __atomic_add_fetch(&group->busy, 1, __ATOMIC_RELAXED);
+        serve_client_connection(client_socket, &group->queue);
+        __atomic_sub_fetch(&group->busy, 1, __ATOMIC_RELAXED);
+        
+        shutdown(client_socket, SHUT_RDWR);
+        close(client_socket);
+        pthread_mutex_lock(&connection_limit_mutex);
+        active_connection_count--;
+        pthread_cond_signal(&connection_available);
+        pthread_mutex_unlock(&connection_limit_mutex);
+    }
+    
+    __atomic_sub_fetch(&group->workers, 1, __ATOMIC_RELAXED);
+    slab_thread_flush();
+    return NULL;
+}
+
+// Event-driven connection engine (--mode=event)
+//
+// Each loop thread owns an epoll instance and shares the listening socket
+// (EPOLLEXCLUSIVE, so one loop wakes per connection). Client and upstream
+// sockets are non-blocking and every connection is a small state machine,
+// so a slow upstream or client only costs the memory of its event_conn.
+
+// Per-fd epoll tag, so events can be routed to the right side of a connection
+typedef struct event_handle {
+    struct event_conn* conn;
+    int upstream;                   // Set for the upstream socket handle
+} event_handle;
+
+typedef struct event_conn {
+    struct event_loop* loop;
+    int state;                      // CONN_* below
+    int client_fd;
+    int upstream_fd;
+    uint32_t client_events;         // Events currently registered for client_fd
+    uint32_t upstream_events;       // Events currently registered for upstream_fd
+    event_handle client_handle;
+    event_handle upstream_handle;
+    
+    request_reader reader;          // Client request, and pipelined ones after it
+    
+    // Upstream request, then relay scratch space
+    char buf[MAX_BYTES];
+    int buf_len;
+    int buf_sent;
+    char* upstream_request;         // Upstream request too large for buf, NULL if it fit
+    
+    ParsedRequest* request;
+    cache_key key;
+    int keyed;
+    int upstream_port;
+    int upstream_pooled;            // upstream_fd came from the pool and may be stale
+    cache_peer* peer;               // Owning peer the miss is fetched from, NULL for the origin
+    resolver_addrs addrs;           // Resolved upstream addresses
+    int addr_index;                 // Next address to connect to
+    int resolving;                  // A resolver callback is outstanding
+    int keep_alive;                 // Client connection may serve another request
+    int requests_served;
+    struct timeval request_start;   // When the current request arrived
+    int outcome;                    // STATS_* outcome of the current request
+    int measuring;                  // The current request is not accounted yet
+    
+    // Send-from-cache (or following) position; while fetching, cached is
+    // the stale element being revalidated
+    cache_element* cached;
+    cache_segment* cached_segment;
+    int cached_offset;
+    
+    // Disk tier response being sent, offset and len advance as it goes out
+    disk_cache_ref disk;
+    int on_disk;                    // disk is pinned
+    
+    // Metrics response being sent
+    char* metrics;
+    int metrics_len;
+    int metrics_sent;
+    
+    // Fetch this request leads or follows
+    cache_inflight* inflight;
+    int leader;
+    int follow_sent;                // Bytes sent while following
+    int waiting;                    // On the fetch's waiter list (under its lock)
+    struct event_conn* follow_next; // Next waiter of the same fetch
+    
+    // Relay state
+    response_framer framer;
+    char* pending;                  // Relayed bytes not yet written to the client
+    int pending_len;
+    char* pending_body;             // Body bytes to send after a held back header block
+    int pending_body_len;
+    int from_fill;                  // The client is sent the fill, from fill_segment on
+    cache_segment* fill_segment;
+    int fill_offset;
+    int holding;                    // Revalidating, the response status is not known yet
+    int revalidated;                // The origin answered the revalidation with a 304
+    int pipe_fds[2];                // Splice pipe for uncached bodies, created on first use
+    int piped;                      // Bytes in the pipe not yet written to the client
+    int upstream_eof;
+    int total_received;
+    struct timeval start_time;
+    
+    time_t last_active;
+    int closed;                     // Closed, freed once the current event batch is done
+    int wake_queued;                // On the loop's woken list (under wake_mutex)
+    struct event_conn* prev;        // Loop connection list, for idle timeouts
+    struct event_conn* next;
+    struct event_conn* wake_next;   // Loop list of connections woken by other threads
+} event_conn;
+
+typedef struct event_loop {
+    int epoll_fd;
+    int listen_fd;                  // Shared listener, or the loop's own with --reuseport
+    pthread_t thread;
+    event_conn* conns;              // Open connections
+    event_conn* closed;             // Connections closed during the current batch
+    int wake_fd;                    // eventfd signalled by event_wake()
+    event_handle wake_handle;       // Tag for wake_fd (no connection)
+    event_conn* woken;              // Connections whose lookup completed or fetch progressed
+    pthread_mutex_t wake_mutex;     // Protects woken and wake_queued
+} event_loop;
+
+enum {
+    CONN_READ_REQUEST,              // Reading the client request
+    CONN_RESOLVE,                   // Waiting for the upstream hostname lookup
+    CONN_CONNECT,                   // Waiting for the upstream connect to complete
+    CONN_SEND_REQUEST,              // Writing the request upstream
+    CONN_RELAY,                     // Relaying the upstream response to the client
+    CONN_SEND_CACHED,               // Sending a cached element to the client
+    CONN_SEND_DISK,                 // Sending a disk tier response to the client
+    CONN_SEND_METRICS,              // Sending the metrics endpoint response, then closing
+    CONN_FOLLOW                     // Streaming another connection's fetch to the client
+};
+
+event_loop event_loops[EVENT_MAX_LOOPS];
+int event_loop_count;
+
+// Update the epoll registration of one side of a connection if it changed
+static int event_watch(event_conn* conn, int upstream, uint32_t events) {
+    int fd = upstream ? conn->upstream_fd : conn->client_fd;
+    uint32_t* current = upstream ? &conn->upstream_events : &conn->client_events;
+    if (*current == events || fd < 0) return 0;
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = upstream ? &conn->upstream_handle : &conn->client_handle;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        return -1;
+    }
+    *current = events;
+    return 0;
+}
+
+static int event_register(event_conn* conn, int upstream, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = upstream ? &conn->upstream_handle : &conn->client_handle;
+    int fd = upstream ? conn->upstream_fd : conn->client_fd;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+    if (upstream) {
+        conn->upstream_events = events;
+    } else {
+        conn->client_events = events;
+    }
+    return 0;
+}
+
+static void event_close_upstream(event_conn* conn) {
+    if (conn->upstream_fd >= 0) {
+        epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->upstream_fd, NULL);
+        close(conn->upstream_fd);
+        conn->upstream_fd = -1;
+        conn->upstream_events = 0;
+    }
+}
+
+// Follower: stop waiting for data, the connection is going away
+void cache_inflight_leave(cache_inflight* inflight, struct event_conn* conn) {
+    pthread_mutex_lock(&inflight->mutex);
+    if (conn->waiting) {
+        event_conn** link = &inflight->waiters;
+        while (*link != conn) link = &(*link)->follow_next;
+        *link = conn->follow_next;
+        conn->waiting = 0;
+    }
+    pthread_mutex_unlock(&inflight->mutex);
+}
+
+// Let go of the fetch this connection leads or follows. A leader stopping
+// before it finished fails its followers.
+static void event_drop_inflight(event_conn* conn) {
+    if (!conn->inflight) return;
+    
+    if (conn->leader) {
+        cache_inflight_finish(conn->inflight, 0, 0);
+    } else {
+        cache_inflight_leave(conn->inflight, conn);
+    }
+    cache_inflight_release(conn->inflight);
+    conn->inflight = NULL;
+}
+
+// Account the current request once its response is over
+static void event_request_done(event_conn* conn) {
+    if (conn->measuring) {
+        conn->measuring = 0;
+        record_request_stats(conn->outcome, &conn->request_start);
+    }
+}
+
+static void event_close_conn(event_conn* conn) {
+    event_loop* loop = conn->loop;
+    
+    event_request_done(conn);
+    if (conn->prev) conn->prev->next = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (loop->conns == conn) loop->conns = conn->next;
+    
+    event_close_upstream(conn);
+    if (conn->client_fd >= 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+        shutdown(conn->client_fd, SHUT_RDWR);
+        close(conn->client_fd);
+    }
+    
+    if (conn->cached) release_cache_element(conn->cached);
+    conn->cached = NULL;
+    if (conn->on_disk) disk_cache_release(&conn->disk);
+    conn->on_disk = 0;
+    event_drop_inflight(conn);
+    if (conn->request) ParsedRequest_destroy(conn->request);
+    conn->request = NULL;
+    request_reader_release(&conn->reader);
+    free(conn->upstream_request);
+    conn->upstream_request = NULL;
+    free(conn->metrics);
+    conn->metrics = NULL;
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    }
+    
+    // Later events in this batch may still point at the connection. One
+    // with a lookup outstanding or a wakeup queued is freed by
+    // event_drain_woken() once that lands.
+    conn->closed = 1;
+    pthread_mutex_lock(&loop->wake_mutex);
+    int deferred = conn->resolving || conn->wake_queued;
+    pthread_mutex_unlock(&loop->wake_mutex);
+    if (!deferred) {
+        conn->next = loop->closed;
+        loop->closed = conn;
+    }
+    
+    pthread_mutex_lock(&connection_limit_mutex);
+    active_connection_count--;
+    pthread_mutex_unlock(&connection_limit_mutex);
+}
+
+static void event_fail(event_conn* conn, int status_code) {
+    conn->outcome = STATS_ERROR;
+    sendErrorMessage(conn->client_fd, status_code);
+    event_close_conn(conn);
+}
+
+// Hand a connection back to its loop from another thread
+static void event_wake(event_conn* conn) {
+    event_loop* loop = conn->loop;
+    
+    pthread_mutex_lock(&loop->wake_mutex);
+    if (!conn->wake_queued) {
+        conn->wake_queued = 1;
+        conn->wake_next = loop->woken;
+        loop->woken = conn;
+    }
+    pthread_mutex_unlock(&loop->wake_mutex);
+    
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        perror("eventfd write failed");
+    }
+}
+
+// Resolver thread callback: the lookup is cached, resume the connection
+static void event_resolved(void* arg) {
+    event_conn* conn = (event_conn*)arg;
+    
+    pthread_mutex_lock(&conn->loop->wake_mutex);
+    conn->resolving = 0;
+    pthread_mutex_unlock(&conn->loop->wake_mutex);
+    event_wake(conn);
+}
+
+// A fetch made progress: wake its waiting followers (caller holds the
+// fetch's lock, so none of them can leave meanwhile)
+void event_wake_followers(struct event_conn* conn) {
+    while (conn) {
+        event_conn* next = conn->follow_next;
+        conn->waiting = 0;
+        event_wake(conn);
+        conn = next;
+    }
+}
+
+static void event_read_request(event_conn* conn);
+static void event_start_upstream(event_conn* conn, int use_pool);
+static void event_resolve_upstream(event_conn* conn);
+static void event_connect_upstream(event_conn* conn);
+static void event_follow(event_conn* conn);
+
+// The response is complete: wait for the next request on a persistent
+// connection (picking up pipelined bytes), or close it
+static void event_finish_response(event_conn* conn) {
+    event_request_done(conn);
+    conn->requests_served++;
+    if (!conn->keep_alive || conn->requests_served >= KEEPALIVE_MAX_REQUESTS || !server_running) {
+        event_close_conn(conn);
+        return;
+    }
+    
+    event_close_upstream(conn);
+    if (conn->cached) release_cache_element(conn->cached);
+    conn->cached = NULL;
+    if (conn->on_disk) disk_cache_release(&conn->disk);
+    conn->on_disk = 0;
+    event_drop_inflight(conn);
+    if (conn->request) ParsedRequest_destroy(conn->request);
+    conn->request = NULL;
+    conn->pending_len = 0;
+    conn->pending_body_len = 0;
+    conn->upstream_eof = 0;
+    conn->total_received = 0;
+    
+    conn->state = CONN_READ_REQUEST;
+    request_reader_next(&conn->reader);
+    
+    event_watch(conn, 0, EPOLLIN);
+    event_read_request(conn);
+}
+
+static void event_send_cached(event_conn* conn) {
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    
+    while (conn->cached_segment) {
+        msg.msg_iovlen = segment_iov(conn->cached_segment, conn->cached_offset, iov, SEND_IOV_MAX);
+        if (msg.msg_iovlen == 0) {
+            conn->cached_segment = NULL;
+            break;
+        }
+        ssize_t sent = sendmsg(conn->client_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                event_watch(conn, 0, EPOLLOUT);
+                return;
+            }
+            break;
+        }
+        segment_advance(&conn->cached_segment, &conn->cached_offset, sent);
+    }
+    
+    if (conn->cached_segment == NULL && conn->cached->delimited) {
+        event_finish_response(conn);
+    } else {
+        event_close_conn(conn);
+    }
+}
+
+// Disk reads happen in the loop thread, mostly from the page cache
+static void event_send_disk(event_conn* conn) {
+    while (conn->disk.len > 0) {
+        ssize_t sent = sendfile(conn->client_fd, conn->disk.fd, &conn->disk.offset, conn->disk.len);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            event_watch(conn, 0, EPOLLOUT);
+            return;
+        }
+        if (sent <= 0) break;
+        conn->disk.len -= sent;
+    }
+    
+    if (conn->disk.len == 0 && conn->disk.meta.delimited) {
+        event_finish_response(conn);
+    } else {
+        event_close_conn(conn);
+    }
+}
+
+static void event_send_metrics(event_conn* conn) {
+    while (conn->metrics_sent < conn->metrics_len) {
+        ssize_t sent = send(conn->client_fd, conn->metrics + conn->metrics_sent,
+                            conn->metrics_len - conn->metrics_sent, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            event_watch(conn, 0, EPOLLOUT);
+            return;
+        }
+        if (sent <= 0) break;
+        conn->metrics_sent += sent;
+    }
+    event_close_conn(conn);
+}
+
+static void event_finish_relay(event_conn* conn) {
+    if (conn->total_received == 0) {
+        event_fail(conn, 500);
+        return;
+    }
+    
+    record_response_stats(&conn->start_time, conn->total_received);
+    if (conn->framer.state != FRAME_DONE) {
+        // Truncated response, the client cannot tell where it ended
+        event_close_conn(conn);
+        return;
+    }
+    if (conn->revalidated) {
+        // Not modified: serve the stale element, now fresh again
+        cache_element_revalidated(conn->cached, conn->framer.header, conn->framer.header_len);
+        cache_inflight_revalidated(conn->inflight, conn->cached);
+        conn->state = CONN_SEND_CACHED;
+        conn->cached_segment = conn->cached->segments;
+        conn->cached_offset = 0;
+        event_send_cached(conn);
+        return;
+    }
+    int delimited = response_is_delimited(conn->framer.header, conn->framer.header_len);
+    if (!delimited) {
+        conn->keep_alive = 0;
+    }
+    conn->inflight->fill.cost_ms = elapsed_ms(&conn->start_time);
+    cache_inflight_finish(conn->inflight, 1, delimited);
+    event_finish_response(conn);
+}
+
+static char* event_upstream_host(event_conn* conn) {
+    return conn->peer ? conn->peer->host : conn->request->host;
+}
+
+// The whole response has arrived: hand the upstream connection back to
+// the pool if it sits at a response boundary, otherwise close it
+static void event_release_upstream(event_conn* conn, int overrun) {
+    if (!framer_reusable(&conn->framer) || overrun) {
+        event_close_upstream(conn);
+        return;
+    }
+    
+    int fd = conn->upstream_fd;
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    conn->upstream_fd = -1;
+    conn->upstream_events = 0;
+    
+    // Pooled connections are blocking, as the thread engine expects
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    return_pooled_connection(fd, event_upstream_host(conn), conn->upstream_port);
+}
+
+// A pooled connection turned out to be closed before any response byte
+// arrived: fetch again on a fresh connection. A peer failing on a fresh
+// one is left for the origin.
+static void event_retry_upstream(event_conn* conn) {
+    if (conn->peer && !conn->upstream_pooled) {
+        peer_fetch_failed(conn->peer, conn->inflight);
+        conn->peer = NULL;
+    }
+    event_close_upstream(conn);
+    event_start_upstream(conn, 0);
+}
+
+// Splice pipe of a connection, or -1 if it cannot be created
+static int event_conn_pipe(event_conn* conn) {
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// The client went away. A leader whose response followers are reading
+// goes on fetching it without the client, any other connection closes.
+static void event_client_failed(event_conn* conn) {
+    if (conn->client_fd < 0) return;
+    if (conn->state == CONN_RELAY && conn->leader && cache_inflight_filling(conn->inflight) &&
+        cache_inflight_followed(conn->inflight)) {
+        epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+        shutdown(conn->client_fd, SHUT_RDWR);
+        close(conn->client_fd);
+        conn->client_fd = -1;
+        conn->client_events = 0;
+        conn->keep_alive = 0;
+        return;
+    }
+    event_close_conn(conn);
+}
+
+// Pump upstream data to the client, filling the cache on the way.
+// Bodies that are not cached are spliced through a pipe instead.
+// The client reads the fill like one more follower, so upstream is read
+// at its own pace while the fill is shared; past that, reading upstream
+// stops whenever the client cannot keep up.
+static void event_relay(event_conn* conn) {
+    for (int round = 0; round < 16; round++) {
+        int filling = cache_inflight_filling(conn->inflight);
+        if (conn->client_fd < 0 && (!filling || !cache_inflight_followed(conn->inflight))) {
+            // Nobody is left to read the rest
+            event_close_conn(conn);
+            return;
+        }
+        
+        int behind = 0;
+        if (conn->from_fill && conn->client_fd >= 0) {
+            behind = leader_send_fill(conn->client_fd, conn->inflight, &conn->fill_segment,
+                                      &conn->fill_offset, 0);
+            if (behind < 0) {
+                event_client_failed(conn);
+                if (conn->closed) return;
+                continue;
+            }
+            if (behind && conn->upstream_eof && conn->framer.state != FRAME_DONE) {
+                // Truncated, the rest is of no use to the client
+                event_finish_relay(conn);
+                return;
+            }
+            if (behind && (!filling || conn->upstream_eof)) {
+                // Followers are not kept waiting for the rest to reach the
+                // client, which holds on to the segments until then
+                if (conn->upstream_eof) {
+                    int delimited = response_is_delimited(conn->framer.header, conn->framer.header_len);
+                    conn->inflight->leader_behind = 1;
+                    conn->inflight->fill.cost_ms = elapsed_ms(&conn->start_time);
+                    cache_inflight_finish(conn->inflight, 1, delimited);
+                }
+                if (conn->upstream_fd >= 0) event_watch(conn, 1, 0);
+                event_watch(conn, 0, EPOLLOUT);
+                return;
+            }
+            if (!filling) conn->from_fill = 0;
+        }
+        
+        while (conn->pending_len > 0) {
+            ssize_t sent = send(conn->client_fd, conn->pending, conn->pending_len, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (conn->upstream_fd >= 0) event_watch(conn, 1, 0);
+                    event_watch(conn, 0, EPOLLOUT);
+                    return;
+                }
+                event_close_conn(conn);
+                return;
+            }
+            conn->pending += sent;
+            conn->pending_len -= sent;
+            if (conn->pending_len == 0 && conn->pending_body_len > 0) {
+                conn->pending = conn->pending_body;
+                conn->pending_len = conn->pending_body_len;
+                conn->pending_body_len = 0;
+            }
+        }
+        while (conn->piped > 0) {
+            ssize_t sent = splice(conn->pipe_fds[0], NULL, conn->client_fd, NULL, conn->piped,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (conn->upstream_fd >= 0) event_watch(conn, 1, 0);
+                    event_watch(conn, 0, EPOLLOUT);
+                    return;
+                }
+                event_close_conn(conn);
+                return;
+            }
+            conn->piped -= sent;
+        }
+        
+        if (conn->upstream_eof) {
+            event_finish_relay(conn);
+            return;
+        }
+        
+        // The pipe is empty here, so EAGAIN means upstream has nothing yet
+        long splice_len = framer_splice_len(&conn->framer);
+        if (splice_len > 0 && !conn->holding && !filling && conn->client_fd >= 0 &&
+            event_conn_pipe(conn) == 0) {
+            ssize_t moved = splice(conn->upstream_fd, NULL, conn->pipe_fds[1], NULL, splice_len,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                event_watch(conn, 0, 0);
+                event_watch(conn, 1, EPOLLIN);
+                return;
+            }
+            if (moved <= 0) {
+                if (moved == 0) framer_eof(&conn->framer);
+                conn->upstream_eof = 1;
+                event_close_upstream(conn);
+                continue;
+            }
+            framer_advance(&conn->framer, moved);
+            conn->total_received += moved;
+            conn->piped = moved;
+            if (conn->framer.state == FRAME_DONE) {
+                conn->upstream_eof = 1;
+                event_release_upstream(conn, 0);
+            }
+            continue;
+        }
+        
+        // Filled segments outlive abandonment of the fill, so the client's
+        // position may stay in them until the fetch is released
+        int avail;
+        char* chunk = cache_inflight_space(conn->inflight, &avail);
+        if (!chunk) {
+            if (conn->from_fill && conn->client_fd >= 0) continue;
+            chunk = conn->buf;
+            avail = MAX_BYTES;
+        }
+        
+        ssize_t received = recv(conn->upstream_fd, chunk, avail, 0);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            event_watch(conn, 0, behind ? EPOLLOUT : 0);
+            event_watch(conn, 1, EPOLLIN);
+            return;
+        }
+        if (received <= 0) {
+            if (conn->total_received == 0 && (conn->upstream_pooled || conn->peer)) {
+                event_retry_upstream(conn);
+                return;
+            }
+            // The origin closed, its socket cannot be reused
+            if (received == 0) framer_eof(&conn->framer);
+            conn->upstream_eof = 1;
+            event_close_upstream(conn);
+            continue;
+        }
+        
+        // Only the bytes belonging to this response are relayed
+        int used = framer_feed(&conn->framer, chunk, received);
+        if (conn->framer.state == FRAME_DONE) {
+            conn->upstream_eof = 1;
+            event_release_upstream(conn, used < received);
+        }
+        received = used;
+        conn->total_received += received;
+        conn->pending = chunk;
+        conn->pending_len = chunk != conn->buf ? 0 : received;
+        if (chunk != conn->buf) {
+            // Goes out to the client from the fill
+            cache_inflight_commit(conn->inflight, received);
+        }
+        
+        // A revalidation response is held back until its status is known.
+        // A 304 is not relayed at all; otherwise the client is sent the
+        // fill past any interim responses, or if the response is not being
+        // buffered the header block (which the framer kept) goes out
+        // first, then the body bytes so far.
+        if (conn->holding) {
+            conn->pending_len = 0;
+            if (conn->framer.state != FRAME_HEADERS) {
+                conn->holding = 0;
+                if (conn->framer.status == 304) {
+                    conn->revalidated = 1;
+                } else if (chunk != conn->buf) {
+                    conn->from_fill = 1;
+                    leader_fill_skip(conn->inflight, &conn->fill_segment, &conn->fill_offset,
+                                     conn->framer.header_bytes - conn->framer.header_len);
+                } else {
+                    conn->pending_body_len = conn->total_received - conn->framer.header_bytes;
+                    conn->pending_body = chunk + received - conn->pending_body_len;
+                    conn->pending = conn->framer.header;
+                    conn->pending_len = conn->framer.header_len;
+                }
+            }
+        }
+    }
+    
+    // Yield to other connections, level-triggered epoll brings us back.
+    // While the fill is shared upstream is read however far behind the
+    // client is.
+    int behind = conn->from_fill && conn->client_fd >= 0 &&
+                 leader_fill_unsent(conn->inflight, &conn->fill_segment, &conn->fill_offset);
+    if (conn->pending_len > 0 || conn->piped > 0 || conn->upstream_eof || behind) {
+        int reading = !conn->upstream_eof && conn->pending_len == 0 && conn->piped == 0 &&
+                      cache_inflight_filling(conn->inflight);
+        if (conn->upstream_fd >= 0) event_watch(conn, 1, reading ? EPOLLIN : 0);
+        event_watch(conn, 0, EPOLLOUT);
+    } else {
+        event_watch(conn, 0, 0);
+        event_watch(conn, 1, EPOLLIN);
+    }
+}
+
+static void event_send_request(event_conn* conn) {
+    char* request = conn->upstream_request ? conn->upstream_request : conn->buf;
+    while (conn->buf_sent < conn->buf_len) {
+        ssize_t sent = send(conn->upstream_fd, request + conn->buf_sent,
+                            conn->buf_len - conn->buf_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                event_watch(conn, 1, EPOLLOUT);
+                return;
+            }
+            if (conn->upstream_pooled || conn->peer) {
+                event_retry_upstream(conn);
+            } else {
+                event_fail(conn, 500);
+            }
+            return;
+        }
+        conn->buf_sent += sent;
+    }
+    
+    free(conn->upstream_request);
+    conn->upstream_request = NULL;
+    conn->state = CONN_RELAY;
+    event_watch(conn, 1, EPOLLIN);
+}
+
+// Start the upstream fetch for a cache miss, reusing a pooled connection
+// if allowed
+static void event_start_upstream(event_conn* conn, int use_pool) {
+    ParsedRequest* request = conn->request;
+    conn->upstream_port = conn->peer ? conn->peer->port : (request->port != NULL) ? atoi(request->port) : 80;
+    free(conn->upstream_request);
+    conn->upstream_request = NULL;
+    conn->buf_len = build_upstream_request(request, conn->buf, MAX_BYTES, conn->peer != NULL);
+    if (conn->buf_len < 0) {
+        // Large client headers, build it in a buffer of its own
+        conn->upstream_request = (char*)malloc(UPSTREAM_REQUEST_MAX);
+        conn->buf_len = conn->upstream_request ?
+            build_upstream_request(request, conn->upstream_request, UPSTREAM_REQUEST_MAX, conn->peer != NULL) : -1;
+        if (conn->buf_len < 0) {
+            event_fail(conn, conn->upstream_request ? 431 : 500);
+            return;
+        }
+    }
+    conn->buf_sent = 0;
+    gettimeofday(&conn->start_time, NULL);
+    framer_init(&conn->framer);
+    conn->holding = conn->cached != NULL;
+    conn->revalidated = 0;
+    conn->from_fill = !conn->holding;
+    conn->fill_segment = NULL;
+    conn->fill_offset = 0;
+    
+    conn->upstream_fd = use_pool ? get_pooled_connection(event_upstream_host(conn), conn->upstream_port) : -1;
+    conn->upstream_pooled = conn->upstream_fd > 0;
+    if (conn->upstream_fd > 0) {
+        setup_nonblocking_socket(conn->upstream_fd);
+        conn->state = CONN_SEND_REQUEST;
+        
+        // The client is not watched while the upstream side is busy
+        event_watch(conn, 0, 0);
+        if (event_register(conn, 1, EPOLLOUT) < 0) {
+            event_fail(conn, 500);
+        }
+        return;
+    }
+    event_resolve_upstream(conn);
+}
+
+// Look up the upstream without blocking the loop; on a resolver cache miss
+// the connection parks until event_resolved() brings it back
+static void event_resolve_upstream(event_conn* conn) {
+    conn->resolving = 1;
+    int status = resolver_lookup_async(event_upstream_host(conn), &conn->addrs, event_resolved, conn);
+    if (status == RESOLVER_PENDING) {
+        conn->state = CONN_RESOLVE;
+        event_watch(conn, 0, 0);
+        return;
+    }
+    conn->resolving = 0;
+    
+    if (status != RESOLVER_OK) {
+        fprintf(stderr, "Host resolution failed for %s\n", event_upstream_host(conn));
+        if (conn->peer) {
+            event_retry_upstream(conn);
+        } else {
+            event_fail(conn, 500);
+        }
+        return;
+    }
+    conn->addr_index = 0;
+    event_connect_upstream(conn);
+}
+
+// Connect to the next resolved upstream address. The event engine tries
+// addresses in turn as connects fail rather than racing them.
+static void event_connect_upstream(event_conn* conn) {
+    while (conn->addr_index < conn->addrs.count) {
+        struct sockaddr_storage addr = conn->addrs.addrs[conn->addr_index];
+        socklen_t addr_len = conn->addrs.lens[conn->addr_index];
+        conn->addr_index++;
+        resolver_set_port(&addr, conn->upstream_port);
+        
+        conn->upstream_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (conn->upstream_fd < 0) continue;
+        int opt = 1;
+        setsockopt(conn->upstream_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+        
+        if (connect(conn->upstream_fd, (struct sockaddr*)&addr, addr_len) == 0) {
+            conn->state = CONN_SEND_REQUEST;
+        } else if (errno == EINPROGRESS) {
+            conn->state = CONN_CONNECT;
+        } else {
+            close(conn->upstream_fd);
+            conn->upstream_fd = -1;
+            continue;
+        }
+        
+        // The client is not watched while the upstream side is busy
+        event_watch(conn, 0, 0);
+        if (event_register(conn, 1, EPOLLOUT) < 0) {
+            event_fail(conn, 500);
+        }
+        return;
+    }
+    if (conn->peer) {
+        event_retry_upstream(conn);
+    } else {
+        event_fail(conn, 500);
+    }
+}
+
+// Stream the fetch this connection follows to the client, parking it as a
+// waiter whenever it has caught up with the leader
+static void event_follow(event_conn* conn) {
+    cache_inflight* inflight = conn->inflight;
+    const char* data;
+    
+    pthread_mutex_lock(&inflight->mutex);
+    while (1) {
+        int len = cache_inflight_next(inflight, &conn->cached_segment, &conn->cached_offset, &data);
+        if (len == 0) {
+            if (!conn->waiting) {
+                conn->waiting = 1;
+                conn->follow_next = inflight->waiters;
+                inflight->waiters = conn;
+            }
+            pthread_mutex_unlock(&inflight->mutex);
+            event_watch(conn, 0, 0);
+            return;
+        }
+        if (len < 0) break;
+        
+        ssize_t sent = send(conn->client_fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            pthread_mutex_unlock(&inflight->mutex);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                event_watch(conn, 0, EPOLLOUT);
+            } else {
+                event_close_conn(conn);
+            }
+            return;
+        }
+        conn->cached_offset += sent;
+        conn->follow_sent += sent;
+    }
+    int state = inflight->state;
+    int delimited = inflight->delimited;
+    pthread_mutex_unlock(&inflight->mutex);
+    
+    if (state == INFLIGHT_DONE) {
+        conn->keep_alive = conn->keep_alive && delimited;
+        event_finish_response(conn);
+    } else if (conn->follow_sent > 0) {
+        // Part of a response already went out, the connection just closes
+        event_close_conn(conn);
+    } else if (state == INFLIGHT_UNCACHEABLE) {
+        // The response is not shared, fetch it alone (unconditionally)
+        if (conn->cached) release_cache_element(conn->cached);
+        conn->cached = NULL;
+        cache_inflight_release(inflight);
+        conn->inflight = cache_inflight_create(NULL);
+        conn->leader = 1;
+        conn->peer = NULL;
+        if (!conn->inflight) {
+            event_fail(conn, 500);
+            return;
+        }
+        event_start_upstream(conn, 1);
+    } else {
+        event_fail(conn, 500);
+    }
+}
+
+// A cache miss (or a stale element in conn->cached to revalidate): lead a
+// fetch of the key, or follow the one already in flight
+static void event_start_fetch(event_conn* conn) {
+    int leader = 1;
+    conn->inflight = conn->keyed ? cache_inflight_join(&conn->key, &leader) : cache_inflight_create(NULL);
+    if (!conn->inflight) {
+        event_fail(conn, 500);
+        return;
+    }
+    conn->leader = leader;
+    if (leader) {
+        if (conn->cached) {
+            add_validators(conn->request, conn->cached);
+            conn->inflight->revalidating = 1;
+        }
+        // A plain miss on a key another node owns is asked of that node
+        conn->peer = conn->cached ? NULL : peer_for_fetch(conn->request, conn->inflight);
+        event_start_upstream(conn, 1);
+        return;
+    }
+    
+    conn->state = CONN_FOLLOW;
+    conn->cached_segment = NULL;
+    conn->cached_offset = 0;
+    conn->follow_sent = 0;
+    event_follow(conn);
+}
+
+// A complete request header has arrived: serve it from cache or fetch it
+static void event_start_request(event_conn* conn, int request_len) {
+    char* raw_request = conn->reader.buf;
+    if (is_metrics_request(raw_request, request_len)) {
+        conn->metrics = build_metrics_response(&conn->metrics_len);
+        if (!conn->metrics) {
+            event_close_conn(conn);
+            return;
+        }
+        conn->metrics_sent = 0;
+        conn->state = CONN_SEND_METRICS;
+        event_send_metrics(conn);
+        return;
+    }
+    
+    gettimeofday(&conn->request_start, NULL);
+    conn->outcome = STATS_MISS;
+    conn->measuring = 1;
+    conn->request = ParsedRequest_create();
+    if (!conn->request || ParsedRequest_parse(conn->request, raw_request, request_len) < 0) {
+        event_fail(conn, 400);
+        return;
+    }
+    
+    ParsedRequest* request = conn->request;
+    if (strcmp(request->method, "GET") != 0 || !request->host || !request->path) {
+        event_fail(conn, 501);
+        return;
+    }
+    conn->keep_alive = client_wants_keepalive(request);
+    if (conn->requests_served > 0) {
+        stats_add(STATS_KEEPALIVE_REUSES, 1);
+    }
+    
+    int freshness;
+    conn->keyed = (build_cache_key(request, &conn->key) == 0);
+    conn->cached = conn->keyed ? find_in_cache(&conn->key, &freshness) : NULL;
+    if (conn->cached && freshness == CACHE_STALE && !conn->cached->etag[0] && !conn->cached->last_modified[0]) {
+        // Nothing to revalidate with, fetch it again
+        release_cache_element(conn->cached);
+        conn->cached = NULL;
+    }
+    
+    if (conn->cached && freshness != CACHE_STALE) {
+        if (freshness == CACHE_STALE_USABLE) {
+            cache_refresh_start(raw_request, request_len, &conn->key, conn->cached);
+        }
+        cache_element* ranged = cache_range_element(conn->cached, request);
+        if (ranged) {
+            release_cache_element(conn->cached);
+            conn->cached = ranged;
+        }
+        conn->outcome = STATS_HIT;
+        conn->state = CONN_SEND_CACHED;
+        conn->cached_segment = conn->cached->segments;
+        conn->cached_offset = 0;
+        event_send_cached(conn);
+    } else if (!conn->cached && conn->keyed && find_on_disk(&conn->key, &conn->disk)) {
+        conn->outcome = STATS_HIT;
+        conn->on_disk = 1;
+        conn->state = CONN_SEND_DISK;
+        event_send_disk(conn);
+    } else {
+        event_start_fetch(conn);
+    }
+}
+
+// Read until the request header block is complete; pipelined bytes left
+// by the previous request are used first
+static void event_read_request(event_conn* conn) {
+    int request_len = request_reader_read(&conn->reader, conn->client_fd);
+    if (request_len > 0) {
+        event_start_request(conn, request_len);
+    } else if (request_len == REQUEST_READER_TOO_LARGE) {
+        event_fail(conn, 431);
+    } else if (request_len == REQUEST_READER_CLOSED) {
+        event_close_conn(conn);
+    }
+}
+
+static void event_on_client(event_conn* conn, uint32_t events) {
+    if ((events & (EPOLLERR | EPOLLHUP)) && conn->state != CONN_READ_REQUEST) {
+        event_client_failed(conn);
+        return;
+    }
+    
+    switch (conn->state) {
+        case CONN_READ_REQUEST:
+            event_read_request(conn);
+            break;
+        case CONN_RELAY:
+            event_relay(conn);
+            break;
+        case CONN_SEND_CACHED:
+            event_send_cached(conn);
+            break;
+        case CONN_SEND_DISK:
+            event_send_disk(conn);
+            break;
+        case CONN_SEND_METRICS:
+            event_send_metrics(conn);
+            break;
+        case CONN_FOLLOW:
+            event_follow(conn);
+            break;
+    }
+}
+
+static void event_on_upstream(event_conn* conn, uint32_t events) {
+    switch (conn->state) {
+        case CONN_CONNECT: {
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(conn->upstream_fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error != 0) {
+                event_close_upstream(conn);
+                event_connect_upstream(conn);
+                return;
+            }
+            conn->state = CONN_SEND_REQUEST;
+            event_send_request(conn);
+            break;
+        }
+        case CONN_SEND_REQUEST:
+            event_send_request(conn);
+            break;
+        case CONN_RELAY:
+            event_relay(conn);
+            break;
+    }
+}
+
+static void event_accept(event_loop* loop, int listen_fd) {
+    for (int i = 0; i < 64; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(listen_fd, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+        
+        pthread_mutex_lock(&connection_limit_mutex);
+        if (active_connection_count >= EVENT_MAX_CLIENTS) {
+            pthread_mutex_unlock(&connection_limit_mutex);
+            // Best effort on the non-blocking socket: a new connection's
+            // send buffer is empty, so the short response fits
+            sendErrorMessage(client_socket, 503);
+            close(client_socket);
+            continue;
+        }
+        active_connection_count++;
+        pthread_mutex_unlock(&connection_limit_mutex);
+        
+        event_conn* conn = (event_conn*)calloc(1, sizeof(event_conn));
+        if (!conn) {
+            close(client_socket);
+            pthread_mutex_lock(&connection_limit_mutex);
+            active_connection_count--;
+            pthread_mutex_unlock(&connection_limit_mutex);
+            continue;
+        }
+        conn->loop = loop;
+        conn->state = CONN_READ_REQUEST;
+        conn->client_fd = client_socket;
+        request_reader_init(&conn->reader);
+        conn->upstream_fd = -1;
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        conn->client_handle.conn = conn;
+        conn->upstream_handle.conn = conn;
+        conn->upstream_handle.upstream = 1;
+        conn->last_active = time(NULL);
+        
+        conn->next = loop->conns;
+        if (loop->conns) loop->conns->prev = conn;
+        loop->conns = conn;
+        
+        if (event_register(conn, 0, EPOLLIN) < 0) {
+            event_close_conn(conn);
+        }
+    }
+}
+
+// Close connections that have made no progress for CONNECTION_TIMEOUT,
+// or persistent ones idle between requests for KEEPALIVE_TIMEOUT
+static void event_expire_idle(event_loop* loop, time_t now) {
+    event_conn* conn = loop->conns;
+    while (conn) {
+        event_conn* next = conn->next;
+        int idle = conn->state == CONN_READ_REQUEST && conn->reader.len == 0 && conn->requests_served > 0;
+        if (now - conn->last_active > (idle ? KEEPALIVE_TIMEOUT : CONNECTION_TIMEOUT)) {
+            event_close_conn(conn);
+        }
+        conn = next;
+    }
+}
+
+// Resume connections woken by resolver callbacks or followed fetches,
+// freeing the ones closed in the meantime. Wakeups may be stale, so the
+// connection state decides what to do.
+static void event_drain_woken(event_loop* loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
+    }
+    
+    pthread_mutex_lock(&loop->wake_mutex);
+    event_conn* conn = loop->woken;
+    loop->woken = NULL;
+    for (event_conn* woken = conn; woken; woken = woken->wake_next) {
+        woken->wake_queued = 0;
+    }
+    pthread_mutex_unlock(&loop->wake_mutex);
+    
+    while (conn) {
+        event_conn* next = conn->wake_next;
+        pthread_mutex_lock(&loop->wake_mutex);
+        int resolving = conn->resolving;
+        pthread_mutex_unlock(&loop->wake_mutex);
+        
+        if (conn->closed) {
+            if (!resolving) free(conn);
+        } else if (conn->state == CONN_RESOLVE && !resolving) {
+            conn->last_active = time(NULL);
+            event_resolve_upstream(conn);
+        } else if (conn->state == CONN_FOLLOW) {
+            conn->last_active = time(NULL);
+            event_follow(conn);
+        }
+        conn = next;
+    }
+}
+
+void* event_loop_thread(void* arg) {
+    event_loop* loop = (event_loop*)arg;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    
+    while (server_running) {
+        int ready = epoll_wait(loop->epoll_fd, events, EVENT_MAX_EVENTS, 1000);
+        time_t now = time(NULL);
+        
+        for (int i = 0; i < ready; i++) {
+            event_handle* handle = (event_handle*)events[i].data.ptr;
+            if (handle == NULL) {
+                event_accept(loop, loop->listen_fd);
+                continue;
+            }
+            
+            if (handle == &loop->wake_handle) {
+                event_drain_woken(loop);
+                continue;
+            }
+            
+            event_conn* conn = handle->conn;
+            if (conn->closed) continue;
+            conn->last_active = now;
+            if (handle->upstream) {
+                event_on_upstream(conn, events[i].events);
+            } else {
+                event_on_client(conn, events[i].events);
+            }
+        }
+        
+        while (loop->closed) {
+            event_conn* conn = loop->closed;
+            loop->closed = conn->next;
+            free(conn);
+        }
+        
+        if (now - last_sweep >= 1) {
+            event_expire_idle(loop, now);
+            last_sweep = now;
+            while (loop->closed) {
+                event_conn* conn = loop->closed;
+                loop->closed = conn->next;
+                free(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Start the event loops on the listening socket and wait for shutdown
+void run_event_loops() {
+    int cpus[EVENT_MAX_LOOPS];
+    int cpu_count = config.reuseport ? usable_cpus(cpus, EVENT_MAX_LOOPS) : 0;
+    event_loop_count = config.event_loops;
+    setup_nonblocking_socket(proxy_socketId);
+    
+    for (int i = 0; i < event_loop_count; i++) {
+        event_loop* loop = &event_loops[i];
+        loop->epoll_fd = epoll_create1(0);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            exit(1);
+        }
+        
+        // With --reuseport every loop accepts on a listener of its own
+        loop->listen_fd = proxy_socketId;
+        if (config.reuseport && i > 0) {
+            loop->listen_fd = open_listener(1);
+            if (loop->listen_fd < 0) {
+                exit(1);
+            }
+            setup_nonblocking_socket(loop->listen_fd);
+        }
+        
+        // Listener events carry a NULL handle
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = config.reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+            ev.events = EPOLLIN;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+        }
+        
+        // Resolver callbacks wake the loop through an eventfd
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK);
+        pthread_mutex_init(&loop->wake_mutex, NULL);
+        loop->woken = NULL;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->wake_handle;
+        if (loop->wake_fd < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+            perror("eventfd setup failed");
+            exit(1);
+        }
+        
+        if (pthread_create(&loop->thread, NULL, event_loop_thread, loop) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        if (cpu_count > 0) pin_thread(loop->thread, cpus[i % cpu_count]);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+    run_stats_loop();
+    
+    for (int i = 0; i < event_loop_count; i++) {
+        pthread_join(event_loops[i].thread, NULL);
+        close(event_loops[i].epoll_fd);
+        close(event_loops[i].wake_fd);
+        if (event_loops[i].listen_fd != proxy_socketId) close(event_loops[i].listen_fd);
+    }
+}
+
+// Print statistics every minute until shutdown (main thread)
+void run_stats_loop() {
+    time_t last_stats_time = time(NULL);
+    while (server_running) {
+        sleep(1);
+        time_t now = time(NULL);
+        if (now - last_stats_time >= 60) { // Every minute
+            print_stats();
+            last_stats_time = now;
+        }
+    }
+}
+
+// Request queue management
+void enqueue_request(work_queue* queue, int client_socket, struct sockaddr_in client_addr) {
+    work_item item;
+    item.client_socket = client_socket;
+    item.client_addr = client_addr;
+    gettimeofday(&item.queued_at, NULL);
+    
+    // A full queue holds the acceptor back until workers catch up
+    while (work_queue_push(queue, &item) < 0) {
+        if (!server_running) {
+            close(client_socket);
+            return;
+        }
+        usleep(100);
+    }
+}
+
+// Next connection for a worker of group: from its own queue, else stolen
+// from another group's, else whatever arrives on its own while it parks.
+// Returns -1 if there was none or the server is stopping.
+int dequeue_request(listener_group* group, work_item* item) {
+    if (work_queue_pop(&group->queue, item) == 0) return 0;
+    
+    int index = group - listener_groups;
+    for (int i = 1; i < listener_group_count; i++) {
+        listener_group* victim = &listener_groups[(index + i) % listener_group_count];
+        if (work_queue_pop(&victim->queue, item) == 0) {
+            __atomic_add_fetch(&group->stolen, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    
+    if (!server_running) return -1;
+    return work_queue_wait(&group->queue, item, QUEUE_PARK_MS);
+}
+
+// Open a listening socket on port_number. With reuseport several sockets
+// can be bound to the port, the kernel spreading new connections over
+// them. Returns -1 on failure.
+int open_listener(int reuseport) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Error opening socket");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(listener, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    if (reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Error setting SO_REUSEPORT");
+        close(listener);
+        return -1;
+    }
+
+    struct sockaddr_in proxy_addr;
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_addr.s_addr = INADDR_ANY;
+    proxy_addr.sin_port = htons(port_number);
+
+    if (bind(listener, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        perror("Error binding socket");
+        close(listener);
+        return -1;
+    }
+    if (listen(listener, QUEUE_SIZE) < 0) {
+        perror("Error listening on socket");
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+// CPUs the process may run on (at most max), returns their count or 0
+int usable_cpus(int* cpus, int max) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return 0;
+    }
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+// Restrict a thread to one CPU; failing that it just runs unpinned
+void pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Pinning a thread to CPU %d failed: %s\n", cpu, strerror(err));
+    }
+}
+
+// Accept connections on a listener group's socket and queue them for its
+// workers
+void* accept_thread(void* arg) {
+    listener_group* group = (listener_group*)arg;
+    
+    while (server_running) {
+        // Wake up regularly to notice shutdown
+        if (wait_socket(group->socket, POLLIN, 1000) <= 0) continue;
+        
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept(group->socket, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            perror("Error accepting connection");
+            continue;
+        }
+        
+        // Check if we've reached max connections
+        pthread_mutex_lock(&connection_limit_mutex);
+        if (active_connection_count >= MAX_CLIENTS) {
+            pthread_mutex_unlock(&connection_limit_mutex);
+            sendErrorMessage(client_socket, 503);
+            close(client_socket);
+            continue;
+        }
+        active_connection_count++;
+        pthread_mutex_unlock(&connection_limit_mutex);
+        
+        // Set socket to non-blocking
+        setup_nonblocking_socket(client_socket);
+        __atomic_add_fetch(&group->accepted, 1, __ATOMIC_RELAXED);
+        
+        // Enqueue the request
+        enqueue_request(&group->queue, client_socket, client_addr);
+    }
+    return NULL;
+}
+
+// Share of total given to one of parts groups, at least 1
+static int group_share(int total, int index, int parts) {
+    int share = total / parts + (index < total % parts);
+    return share < 1 ? 1 : share;
+}
+
+// Workers the thread engine starts with
+static int initial_workers() {
+    if (THREAD_POOL_SIZE < config.workers_min) return config.workers_min;
+    if (THREAD_POOL_SIZE > config.workers_max) return config.workers_max;
+    return THREAD_POOL_SIZE;
+}
+
+// Set up the thread engine's listener groups and start their accept and
+// worker threads. Group 0 accepts on proxy_socketId.
+void start_listener_groups() {
+    int cpus[MAX_LISTENERS];
+    int cpu_count = config.reuseport ? usable_cpus(cpus, MAX_LISTENERS) : 0;
+    listener_group_count = 1;
+    if (config.reuseport) {
+        listener_group_count = config.listeners > 0 ? config.listeners : (cpu_count > 0 ? cpu_count : 1);
+    }
+    
+    for (int i = 0; i < listener_group_count; i++) {
+        listener_group* group = &listener_groups[i];
+        group->socket = i == 0 ? proxy_socketId : open_listener(1);
+        if (group->socket < 0) {
+            exit(1);
+        }
+        group->cpu = cpu_count > 0 ? cpus[i % cpu_count] : -1;
+        if (work_queue_init(&group->queue, QUEUE_SIZE) < 0) {
+            perror("Request queue allocation failed");
+            exit(1);
+        }
+        
+        // Pool bounds are split evenly, every group keeps at least one worker
+        group->min_workers = group_share(config.workers_min, i, listener_group_count);
+        group->max_workers = group_share(config.workers_max, i, listener_group_count);
+    }
+    
+    // Workers steal from every group, so all queues exist before any starts
+    for (int i = 0; i < listener_group_count; i++) {
+        listener_group* group = &listener_groups[i];
+        int workers = group_share(initial_workers(), i, listener_group_count);
+        for (int w = 0; w < workers; w++) {
+            if (start_worker(group) < 0) {
+                perror("pthread_create failed");
+                exit(1);
+            }
+        }
+        if (pthread_create(&group->accept_thread, NULL, accept_thread, group) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        if (group->cpu >= 0) pin_thread(group->accept_thread, group->cpu);
+    }
+    
+    pthread_t sizer;
+    if (pthread_create(&sizer, NULL, worker_pool_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+    pthread_detach(sizer);
+}
+
+// Live, busy and I/O blocked workers over all listener groups
+void worker_pool_counts(int* workers, int* busy, int* blocked) {
+    *workers = *busy = *blocked = 0;
+    for (int i = 0; i < listener_group_count; i++) {
+        *workers += __atomic_load_n(&listener_groups[i].workers, __ATOMIC_RELAXED);
+        *busy += __atomic_load_n(&listener_groups[i].busy, __ATOMIC_RELAXED);
+        *blocked += __atomic_load_n(&listener_groups[i].io_blocked, __ATOMIC_RELAXED);
+    }
+}
+
+// Start one more worker for group, returns -1 if no thread could be created
+int start_worker(listener_group* group) {
+    pthread_t thread;
+    __atomic_add_fetch(&group->workers, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&thread, NULL, worker_thread, group) != 0) {
+        __atomic_sub_fetch(&group->workers, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (group->cpu >= 0) pin_thread(thread, group->cpu);
+    pthread_detach(thread);
+    return 0;
+}
+
+// Size every listener group's worker pool between its bounds. A group
+// grows while connections wait in its queue and most of its workers are
+// blocked on I/O, where more threads help (unlike workers busy on CPU).
+// Spare workers are retired only after the queue stayed empty for
+// WORKERS_IDLE_TICKS, and a growth restarts that count, so the pool does
+// not thrash on short lulls.
+void* worker_pool_thread(void* arg) {
+    long last_dequeued[MAX_LISTENERS] = {0};
+    long last_wait_us[MAX_LISTENERS] = {0};
+    int idle_ticks[MAX_LISTENERS] = {0};
+    
+    while (server_running) {
+        usleep(WORKERS_TICK_MS * 1000);
+        
+        for (int i = 0; i < listener_group_count; i++) {
+            listener_group* group = &listener_groups[i];
+            int workers = __atomic_load_n(&group->workers, __ATOMIC_RELAXED) -
+                          __atomic_load_n(&group->retiring, __ATOMIC_RELAXED);
+            int busy = __atomic_load_n(&group->busy, __ATOMIC_RELAXED);
+            int blocked = __atomic_load_n(&group->io_blocked, __ATOMIC_RELAXED);
+            int depth = (int)work_queue_size(&group->queue);
+            
+            // Mean queue wait of the connections taken since the last tick
+            long dequeued = __atomic_load_n(&group->dequeued, __ATOMIC_RELAXED);
+            long wait_us = __atomic_load_n(&group->wait_us, __ATOMIC_RELAXED);
+            long taken = dequeued - last_dequeued[i];
+            double wait_ms = taken > 0 ? (wait_us - last_wait_us[i]) / 1000.0 / taken : 0.0;
+            last_dequeued[i] = dequeued;
+            last_wait_us[i] = wait_us;
+            
+            int backlog = depth > 0 && (taken == 0 || wait_ms >= WORKERS_GROW_WAIT_MS);
+            int io_bound = blocked * 100 >= workers * WORKERS_IO_BOUND_PERCENT;
+            if (backlog && io_bound && workers < group->max_workers) {
+                // Pending retirements are cancelled first
+                int cancelled = __atomic_exchange_n(&group->retiring, 0, __ATOMIC_RELAXED);
+                int add = depth < workers / 2 ? depth : workers / 2;
+                if (add < 1) add = 1;
+                if (add > group->max_workers - workers) add = group->max_workers - workers;
+                add -= cancelled;
+                
+                int started = 0;
+                while (started < add && start_worker(group) == 0) {
+                    started++;
+                }
+                __atomic_add_fetch(&worker_pool.started, started, __ATOMIC_RELAXED);
+                idle_ticks[i] = 0;
+                printf("Worker pool: listener %d grown to %d workers (queue %d, wait %.1f ms, %d blocked on I/O)\n",
+                       i, workers + cancelled + started, depth, wait_ms, blocked);
+                continue;
+            }
+            
+            int spare = workers - busy;
+            if (depth > 0 || spare <= 1) {
+                idle_ticks[i] = 0;
+                continue;
+            }
+            if (++idle_ticks[i] >= WORKERS_IDLE_TICKS) {
+                // Retire half the spare workers, still keeping one idle
+                int retire = spare / 2;
+                if (retire > workers - group->min_workers) retire = workers - group->min_workers;
+                if (retire > 0) {
+                    __atomic_add_fetch(&group->retiring, retire, __ATOMIC_RELAXED);
+                    printf("Worker pool: listener %d shrinking to %d workers (%d idle)\n",
+                           i, workers - retire, spare);
+                }
+                idle_ticks[i] = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Connection pool implementation
+void init_connection_pool() {
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        conn_pool.buckets[i].origins = NULL;
+        pthread_mutex_init(&conn_pool.buckets[i].mutex, NULL);
+    }
+    
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, pool_reaper_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        return;
+    }
+    pthread_detach(reaper);
+}
+
+static uint64_t pool_hash(const char* host, int port) {
+    return (cache_hash(host, strlen(host)) ^ (uint64_t)port) * 1099511628211ULL;
+}
+
+// Find the entry for an origin (caller holds the bucket lock)
+static pool_origin* pool_find_origin(pool_bucket* bucket, const char* host, int port, uint64_t hash) {
+    for (pool_origin* origin = bucket->origins; origin; origin = origin->next) {
+        if (origin->hash == hash && origin->port == port && strcmp(origin->host, host) == 0) {
+            return origin;
+        }
+    }
+    return NULL;
+}
+
+// An idle connection has nothing to read, so readable data, EOF or an error
+// all mean the origin closed it (or broke framing) and it cannot be reused
+static int pool_connection_alive(int socket) {
+    struct pollfd pfd = { .fd = socket, .events = POLLIN | POLLRDHUP, .revents = 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+int get_pooled_connection(char* host, int port) {
+    uint64_t hash = pool_hash(host, port);
+    pool_bucket* bucket = &conn_pool.buckets[hash & (POOL_BUCKETS - 1)];
+    time_t now = time(NULL);
+    
+    while (1) {
+        int socket = -1;
+        time_t last_used = 0;
+        
+        pthread_mutex_lock(&bucket->mutex);
+        pool_origin* origin = pool_find_origin(bucket, host, port, hash);
+        if (origin && origin->count > 0) {
+            origin->count--;
+            socket = origin->sockets[origin->count];
+            last_used = origin->last_used[origin->count];
+        }
+        pthread_mutex_unlock(&bucket->mutex);
+        
+        if (socket < 0) return -1;
+        __atomic_sub_fetch(&conn_pool.idle, 1, __ATOMIC_RELAXED);
+        
+        if (now - last_used >= POOL_IDLE_TIMEOUT) {
+            // Everything below the top of the stack is older still,
+            // leave it to the reaper
+            close(socket);
+            return -1;
+        }
+        if (pool_connection_alive(socket)) {
+            __atomic_add_fetch(&conn_pool.reused, 1, __ATOMIC_RELAXED);
+            return socket;
+        }
+        __atomic_add_fetch(&conn_pool.stale, 1, __ATOMIC_RELAXED);
+        close(socket);
+    }
+}
+
+void return_pooled_connection(int socket, char* host, int port) {
+    // Pool full, just close the connection
+    if (__atomic_add_fetch(&conn_pool.idle, 1, __ATOMIC_RELAXED) > POOL_MAX_IDLE) {
+        __atomic_sub_fetch(&conn_pool.idle, 1, __ATOMIC_RELAXED);
+        close(socket);
+        return;
+    }
+    
+    uint64_t hash = pool_hash(host, port);
+    pool_bucket* bucket = &conn_pool.buckets[hash & (POOL_BUCKETS - 1)];
+    int evicted = -1;
+    
+    pthread_mutex_lock(&bucket->mutex);
+    pool_origin* origin = pool_find_origin(bucket, host, port, hash);
+    if (!origin) {
+        origin = (pool_origin*)malloc(sizeof(pool_origin));
+        if (origin) origin->host = strdup(host);
+        if (!origin || !origin->host) {
+            pthread_mutex_unlock(&bucket->mutex);
+            free(origin);
+            __atomic_sub_fetch(&conn_pool.idle, 1, __ATOMIC_RELAXED);
+            close(socket);
+            return;
+        }
+        origin->port = port;
+        origin->hash = hash;
+        origin->count = 0;
+        origin->next = bucket->origins;
+        bucket->origins = origin;
+    }
+    
+    // Origin full: the coldest connection makes room for this one
+    if (origin->count == POOL_MAX_PER_ORIGIN) {
+        evicted = origin->sockets[0];
+        memmove(origin->sockets, origin->sockets + 1, (POOL_MAX_PER_ORIGIN - 1) * sizeof(int));
+        memmove(origin->last_used, origin->last_used + 1, (POOL_MAX_PER_ORIGIN - 1) * sizeof(time_t));
+        origin->count--;
+    }
+    origin->sockets[origin->count] = socket;
+    origin->last_used[origin->count] = time(NULL);
+    origin->count++;
+    pthread_mutex_unlock(&bucket->mutex);
+    
+    if (evicted >= 0) {
+        __atomic_sub_fetch(&conn_pool.idle, 1, __ATOMIC_RELAXED);
+        close(evicted);
+    }
+}
+
+// Periodically close idle connections that expired or were closed by the
+// peer, and drop origins left without any
+void* pool_reaper_thread(void* arg) {
+    while (server_running) {
+        sleep(POOL_REAP_INTERVAL);
+        time_t now = time(NULL);
+        
+        for (int i = 0; i < POOL_BUCKETS; i++) {
+            pool_bucket* bucket = &conn_pool.buckets[i];
+            int removed = 0, stale = 0;
+            
+            pthread_mutex_lock(&bucket->mutex);
+            pool_origin** link = &bucket->origins;
+            while (*link) {
+                pool_origin* origin = *link;
+                int kept = 0;
+                for (int j = 0; j < origin->count; j++) {
+                    int expired = now - origin->last_used[j] >= POOL_IDLE_TIMEOUT;
+                    if (!expired && pool_connection_alive(origin->sockets[j])) {
+                        origin->sockets[kept] = origin->sockets[j];
+                        origin->last_used[kept] = origin->last_used[j];
+                        kept++;
+                        continue;
+                    }
+                    close(origin->sockets[j]);
+                    removed++;
+                    if (!expired) stale++;
+                }
+                origin->count = kept;
+                
+                if (kept == 0) {
+                    *link = origin->next;
+                    free(origin->host);
+                    free(origin);
+                } else {
+                    link = &origin->next;
+                }
+            }
+            pthread_mutex_unlock(&bucket->mutex);
+            
+            if (removed > 0) {
+                __atomic_sub_fetch(&conn_pool.idle, removed, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&conn_pool.stale, stale, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
 }
 
 int setup_nonblocking_socket(int socket) {
@@ -694,213 +5544,773 @@ int setup_nonblocking_socket(int socket) {
     return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
 }
 
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    printf("\nReceived signal %d, shutting down gracefully...\n", sig);
-    server_running = 0;
+static int snapshot_write_element(FILE* file, cache_element* element) {
+    static const char padding[8];
+    snapshot_record record;
+    memset(&record, 0, sizeof(record));
+    record.key_len = element->url_len;
+    record.data_len = element->len;
+    record.creation_time = element->creation_time;
+    record.lru_time = __atomic_load_n(&element->lru_time_track, __ATOMIC_RELAXED);
+    record.expires = __atomic_load_n(&element->expires, __ATOMIC_RELAXED);
+    record.stale_until = __atomic_load_n(&element->stale_until, __ATOMIC_RELAXED);
+    record.access_count = __atomic_load_n(&element->access_count, __ATOMIC_RELAXED);
+    record.delimited = element->delimited;
+    record.cost_ms = element->cost_ms;
+    
+    if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+        fwrite(element->url, 1, element->url_len, file) != (size_t)element->url_len) {
+        return -1;
+    }
+    for (cache_segment* segment = element->segments; segment; segment = segment->next) {
+        if (fwrite(segment->data, 1, segment->len, file) != (size_t)segment->len) {
+            return -1;
+        }
+    }
+    size_t pad = (8 - (sizeof(record) + element->url_len + element->len) % 8) % 8;
+    return fwrite(padding, 1, pad, file) == pad ? 0 : -1;
+}
+
+// Write every cached element to path, through a temporary file renamed
+// into place so a crash never leaves a torn snapshot. Elements are
+// referenced a shard at a time, so no lock is held while writing.
+int cache_snapshot_write(const char* path) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("Cache snapshot");
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
     
-    // Wake up all waiting threads
-    pthread_mutex_lock(&request_queue.mutex);
-    pthread_cond_broadcast(&request_queue.not_empty);
-    pthread_mutex_unlock(&request_queue.mutex);
+    snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0};
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
     
-    print_stats();
-    cleanup_resources();
-    close(proxy_socketId);
-    exit(0);
+    for (int i = 0; i < cache_shard_count && !failed; i++) {
+        cache_shard* shard = &cache_shards[i];
+        pthread_rwlock_rdlock(&shard->rwlock);
+        cache_element** elements = (cache_element**)malloc((shard->count + 1) * sizeof(cache_element*));
+        size_t count = 0;
+        for (cache_element* current = shard->tail; elements && current; current = current->prev) {
+            __atomic_fetch_add(&current->refcount, 1, __ATOMIC_RELAXED);
+            elements[count++] = current;
+        }
+        for (cache_element* current = shard->window_tail; elements && current; current = current->prev) {
+            __atomic_fetch_add(&current->refcount, 1, __ATOMIC_RELAXED);
+            elements[count++] = current;
+        }
+        pthread_rwlock_unlock(&shard->rwlock);
+        if (!elements) {
+            failed = 1;
+            break;
+        }
+        
+        for (size_t j = 0; j < count; j++) {
+            if (!failed && snapshot_write_element(file, elements[j]) < 0) failed = 1;
+            release_cache_element(elements[j]);
+        }
+        header.count += count;
+        free(elements);
+    }
+    
+    // The count goes in last, a snapshot is only valid once complete
+    if (!failed) {
+        failed = fseek(file, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fflush(file) != 0 || fsync(fileno(file)) < 0;
+    }
+    if (fclose(file) != 0) failed = 1;
+    if (failed || rename(tmp_path, path) < 0) {
+        perror("Cache snapshot write failed");
+        unlink(tmp_path);
+        return -1;
+    }
+    printf("Cache snapshot: %llu elements written to %s\n", (unsigned long long)header.count, path);
+    return 0;
+}
+
+// Refill the cache from a snapshot mapped read-only. Elements that are
+// stale with nothing to revalidate them are skipped. Returns the number of
+// elements loaded, or -1 if there is no usable snapshot.
+int cache_snapshot_load(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) perror("Cache snapshot");
+        return -1;
+    }
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(snapshot_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cache snapshot %s is unreadable\n", path);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    snapshot_header* header = (snapshot_header*)map;
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Cache snapshot %s has an unknown format\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    
+    time_t now = time(NULL);
+    size_t offset = sizeof(snapshot_header);
+    int loaded = 0;
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (offset + sizeof(snapshot_record) > (size_t)st.st_size) break;
+        snapshot_record* record = (snapshot_record*)(map + offset);
+        size_t size = sizeof(snapshot_record) + record->key_len + record->data_len;
+        if (record->key_len >= CACHE_KEY_LEN || offset + size > (size_t)st.st_size) break;
+        const char* key_str = (const char*)(record + 1);
+        const char* data = key_str + record->key_len;
+        offset += (size + 7) & ~(size_t)7;
+        
+        char validator[CACHE_VALIDATOR_LEN];
+        char* header_end = memmem(data, record->data_len, "\r\n\r\n", 4);
+        int header_len = header_end ? header_end - data + 4 : 0;
+        if (!header_end || record->data_len > MAX_ELEMENT_SIZE ||
+            (now >= record->stale_until && now >= record->expires &&
+             find_response_header(data, header_len, "ETag", validator, sizeof(validator)) < 0 &&
+             find_response_header(data, header_len, "Last-Modified", validator, sizeof(validator)) < 0)) {
+            continue;
+        }
+        
+        cache_key key;
+        memcpy(key.str, key_str, record->key_len);
+        key.str[record->key_len] = '\0';
+        key.len = record->key_len;
+        key.hash = cache_hash(key.str, key.len);
+        
+        // Restore the key's popularity so admission weighs it fairly
+        for (uint32_t n = 0; admission.sketch && n < record->access_count && n < CACHE_SKETCH_MAX_COUNT; n++) {
+            cache_sketch_increment(admission.sketch, key.hash);
+        }
+        
+        cache_fill fill;
+        cache_fill_init(&fill);
+        fill.expires = record->expires;
+        fill.stale_until = record->stale_until;
+        fill.cost_ms = record->cost_ms;
+        cache_element* element;
+        if (cache_fill_append(&fill, data, record->data_len) < 0 || !add_to_cache(&fill, &key, &element)) {
+            segment_chain_free(fill.head);
+            continue;
+        }
+        
+        // Loading runs before any request is served, nothing races these
+        element->creation_time = record->creation_time;
+        element->lru_time_track = record->lru_time;
+        element->access_count = record->access_count;
+        element->delimited = record->delimited;
+        if (config.cache_policy == CACHE_POLICY_GDSF) {
+            cache_shard* shard = cache_shard_for(key.hash);
+            pthread_rwlock_wrlock(&shard->rwlock);
+            cache_heap_update(shard, element);
+            pthread_rwlock_unlock(&shard->rwlock);
+        }
+        release_cache_element(element);
+        loaded++;
+    }
+    
+    munmap(map, st.st_size);
+    return loaded;
+}
+
+// Periodic snapshots, so a crash loses at most one interval
+void* cache_snapshot_thread(void* arg) {
+    time_t last = time(NULL);
+    while (server_running) {
+        sleep(1);
+        if (time(NULL) - last < config.snapshot_interval) continue;
+        
+        pthread_mutex_lock(&snapshot_mutex);
+        if (server_running) cache_snapshot_write(config.snapshot_path);
+        pthread_mutex_unlock(&snapshot_mutex);
+        last = time(NULL);
+    }
+    return NULL;
+}
+
+// Signal handler for graceful shutdown. It only stops the server; main()
+// notices within a second and shuts down outside signal context.
+void signal_handler(int sig) {
+    static const char message[] = "\nReceived shutdown signal, shutting down gracefully...\n";
+    ssize_t written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+    (void)written;
+    server_running = 0;
 }
 
 // Cleanup function
 void cleanup_resources() {
     // Cleanup connection pool
-    pthread_mutex_lock(&conn_pool.mutex);
-    for (int i = 0; i < conn_pool.size; i++) {
-        if (conn_pool.sockets[i] > 0) {
-            close(conn_pool.sockets[i]);
-        }
-        free(conn_pool.hosts[i]);
-    }
-    free(conn_pool.sockets);
-    free(conn_pool.hosts);
-    free(conn_pool.ports);
-    free(conn_pool.last_used);
-    pthread_mutex_unlock(&conn_pool.mutex);
-    
-    // Cleanup cache
-    pthread_rwlock_wrlock(&cache_rwlock);
-    cache_element* current = cache_head;
-    while (current) {
-        cache_element* next = current->next;
-        free(current->data);
-        free(current->url);
-        free(current);
-        current = next;
-    }
-    pthread_rwlock_unlock(&cache_rwlock);
-    
-    // Destroy synchronization primitives
-    pthread_rwlock_destroy(&cache_rwlock);
-    pthread_mutex_destroy(&request_queue.mutex);
-    pthread_cond_destroy(&request_queue.not_empty);
-    pthread_cond_destroy(&request_queue.not_full);
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        pool_bucket* bucket = &conn_pool.buckets[i];
+        pthread_mutex_lock(&bucket->mutex);
+        while (bucket->origins) {
+            pool_origin* origin = bucket->origins;
+            bucket->origins = origin->next;
+            for (int j = 0; j < origin->count; j++) {
+                close(origin->sockets[j]);
+            }
+            free(origin->host);
+            free(origin);
+        }
+        pthread_mutex_unlock(&bucket->mutex);
+    }
+    conn_pool.idle = 0;
+    
+    // Cleanup cache shards
+    for (int i = 0; i < cache_shard_count; i++) {
+        cache_shard* shard = &cache_shards[i];
+        pthread_rwlock_wrlock(&shard->rwlock);
+        cache_element* lists[2] = {shard->head, shard->window_head};
+        for (int j = 0; j < 2; j++) {
+            cache_element* current = lists[j];
+            while (current) {
+                cache_element* next = current->next;
+                free_cache_element(current);
+                current = next;
+            }
+        }
+        shard->head = shard->tail = NULL;
+        shard->window_head = shard->window_tail = NULL;
+        free(shard->index);
+        free(shard->heap);
+        shard->index = NULL;
+        pthread_rwlock_unlock(&shard->rwlock);
+        pthread_rwlock_destroy(&shard->rwlock);
+    }
+    
+    slab_release_idle();
+    disk_cache_close();
+    
+    // Destroy synchronization primitives. Request queues stay: detached
+    // workers woken for shutdown may still be polling them.
+    for (int i = 0; i < listener_group_count; i++) {
+        listener_group* group = &listener_groups[i];
+        if (group->socket != proxy_socketId) close(group->socket);
+    }
    pthread_mutex_destroy(&connection_limit_mutex);
 pthread_cond_destroy(&connection_available);
 }
 
+static const char* stats_outcome_names[STATS_OUTCOMES] = { "hit", "miss", "error" };
+
 // Print performance statistics
 void print_stats() {
-    pthread_mutex_lock(&stats.mutex);
+    stats_totals totals;
+    stats_collect(&totals);
+    long* counters = totals.counters;
+    long lookups = counters[STATS_CACHE_HITS] + counters[STATS_CACHE_MISSES];
+    
     printf("\n=== Performance Statistics ===\n");
-    printf("Total Requests: %ld\n", stats.total_requests);
-    printf("Cache Hits: %ld (%.2f%%)\n", stats.cache_hits, 
-           stats.total_requests > 0 ? (stats.cache_hits * 100.0 / stats.total_requests) : 0.0);
-    printf("Cache Misses: %ld (%.2f%%)\n", stats.cache_misses,
-           stats.total_requests > 0 ? (stats.cache_misses * 100.0 / stats.total_requests) : 0.0);
-    printf("Bytes Served: %ld MB\n", stats.bytes_served / (1024 * 1024));
-    printf("Average Response Time: %.2f ms\n", stats.avg_response_time);
+    printf("Total Requests: %ld (%ld errors)\n", counters[STATS_REQUESTS], counters[STATS_ERRORS]);
+    printf("Cache Hits: %ld (%.2f%%)\n", counters[STATS_CACHE_HITS],
+           lookups > 0 ? (counters[STATS_CACHE_HITS] * 100.0 / lookups) : 0.0);
+    printf("Cache Misses: %ld (%.2f%%)\n", counters[STATS_CACHE_MISSES],
+           lookups > 0 ? (counters[STATS_CACHE_MISSES] * 100.0 / lookups) : 0.0);
+    printf("Bytes Fetched: %ld MB\n", counters[STATS_BYTES_FETCHED] / (1024 * 1024));
+    long bytes_requested = counters[STATS_BYTES_HIT] + counters[STATS_BYTES_FETCHED];
+    printf("Byte Hit Ratio: %.2f%% (%ld MB from cache)\n",
+           bytes_requested > 0 ? (counters[STATS_BYTES_HIT] * 100.0 / bytes_requested) : 0.0,
+           counters[STATS_BYTES_HIT] / (1024 * 1024));
+    printf("Upstream Fetches: %ld, Average Fetch Time: %.2f ms\n", counters[STATS_FETCHES],
+           counters[STATS_FETCHES] > 0 ? counters[STATS_FETCH_TIME_US] / 1000.0 / counters[STATS_FETCHES] : 0.0);
+    for (int outcome = 0; outcome < STATS_OUTCOMES; outcome++) {
+        long count = totals.latency_count[outcome];
+        printf("Latency (%s): %ld requests, mean %.2f ms, p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms\n",
+               stats_outcome_names[outcome], count,
+               count > 0 ? totals.latency_sum[outcome] / 1000.0 / count : 0.0,
+               stats_percentile(&totals, outcome, 0.5) / 1000.0,
+               stats_percentile(&totals, outcome, 0.99) / 1000.0,
+               stats_percentile(&totals, outcome, 0.999) / 1000.0);
+    }
+    if (listener_group_count > 1) {
+        long stolen = 0;
+        printf("Accepted per Listener:");
+        for (int i = 0; i < listener_group_count; i++) {
+            printf(" %ld", __atomic_load_n(&listener_groups[i].accepted, __ATOMIC_RELAXED));
+            stolen += __atomic_load_n(&listener_groups[i].stolen, __ATOMIC_RELAXED);
+        }
+        printf(" (%ld stolen)\n", stolen);
+    }
+    if (config.mode == MODE_THREAD) {
+        int workers, busy, blocked;
+        worker_pool_counts(&workers, &busy, &blocked);
+        printf("Worker Pool: %d workers (%d busy, %d blocked on I/O), %ld started, %ld retired\n",
+               workers, busy, blocked, __atomic_load_n(&worker_pool.started, __ATOMIC_RELAXED),
+               __atomic_load_n(&worker_pool.retired, __ATOMIC_RELAXED));
+    }
+    printf("Keep-Alive Reuses: %ld\n", counters[STATS_KEEPALIVE_REUSES]);
+    printf("Coalesced Requests: %ld\n", counters[STATS_COALESCED]);
+    printf("Range Requests Served from Cache: %ld\n", counters[STATS_RANGES]);
+    printf("Revalidated (304): %ld, Served Stale: %ld\n", counters[STATS_REVALIDATED], counters[STATS_STALE_SERVED]);
+    printf("Upstream Pool: %d idle, %ld reused, %ld stale\n",
+           __atomic_load_n(&conn_pool.idle, __ATOMIC_RELAXED),
+           __atomic_load_n(&conn_pool.reused, __ATOMIC_RELAXED),
+           __atomic_load_n(&conn_pool.stale, __ATOMIC_RELAXED));
+    long dns_hits, dns_misses, dns_negative, dns_prefetches;
+    resolver_stats(&dns_hits, &dns_misses, &dns_negative, &dns_prefetches);
+    printf("DNS Cache: %ld hits, %ld misses, %ld negative hits, %ld prefetches\n",
+           dns_hits, dns_misses, dns_negative, dns_prefetches);
+    int cache_size = cache_total_size();
     printf("Cache Size: %d bytes (%.2f MB)\n", cache_size, cache_size / (1024.0 * 1024.0));
-    pthread_mutex_unlock(&stats.mutex);
+    printf("Cache Memory Mapped: %.2f MB\n", slab_mapped_bytes() / (1024.0 * 1024.0));
+    if (config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        printf("Admission (TinyLFU): %ld admitted, %ld rejected, %ld misses on rejected keys, %ld decays\n",
+               __atomic_load_n(&admission.admitted, __ATOMIC_RELAXED),
+               __atomic_load_n(&admission.rejected, __ATOMIC_RELAXED),
+               __atomic_load_n(&admission.rejected_misses, __ATOMIC_RELAXED),
+               cache_sketch_decays(admission.sketch));
+    }
+    if (config.cache_compress) {
+        printf("Compressed Cache: %ld elements gzipped, %.2f MB saved, %ld hits inflated\n",
+               counters[STATS_COMPRESSED], counters[STATS_COMPRESS_SAVED] / (1024.0 * 1024.0),
+               counters[STATS_INFLATED]);
+    }
+    if (cache_peer_count() > 0) {
+        printf("Cache Peers: %ld misses fetched from peers, %ld fell back to the origin\n",
+               counters[STATS_PEER_FETCHES], counters[STATS_PEER_FAILURES]);
+        for (int i = 0; i < cache_peer_count(); i++) {
+            cache_peer* peer = cache_peer_at(i);
+            printf("  %s:%d %s, %ld fetched, %ld failed\n", peer->host, peer->port,
+                   peer->self ? "(this node)" : __atomic_load_n(&peer->down, __ATOMIC_RELAXED) ? "down" : "up",
+                   __atomic_load_n(&peer->fetches, __ATOMIC_RELAXED),
+                   __atomic_load_n(&peer->failures, __ATOMIC_RELAXED));
+        }
+    }
+    if (disk_cache_enabled()) {
+        long disk_entries, disk_stored, disk_dropped, disk_reclaimed;
+        size_t disk_used;
+        disk_cache_stats(&disk_entries, &disk_stored, &disk_dropped, &disk_reclaimed, &disk_used);
+        printf("Disk Cache: %ld hits, %ld entries (%.2f MB), %ld stored, %ld dropped, %ld segments reclaimed\n",
+               counters[STATS_DISK_HITS], disk_entries, disk_used / (1024.0 * 1024.0),
+               disk_stored, disk_dropped, disk_reclaimed);
+    }
+}
+
+// Requests for the metrics endpoint name a path rather than an absolute URL
+int is_metrics_request(const char* request, int len) {
+    int prefix = sizeof("GET " METRICS_PATH) - 1;
+    return len > prefix && memcmp(request, "GET " METRICS_PATH, prefix) == 0 &&
+           (request[prefix] == ' ' || request[prefix] == '?');
+}
+
+// Metrics exported in the Prometheus text format
+static const struct {
+    const char* name;
+    int counter;                    // STATS_* counter
+    const char* help;
+} metrics_counters[] = {
+    { "proxy_requests_total", STATS_REQUESTS, "Client requests answered" },
+    { "proxy_errors_total", STATS_ERRORS, "Error responses sent" },
+    { "proxy_cache_hits_total", STATS_CACHE_HITS, "Requests served from the cache" },
+    { "proxy_cache_misses_total", STATS_CACHE_MISSES, "Cache lookups that found nothing usable" },
+    { "proxy_disk_hits_total", STATS_DISK_HITS, "Hits served from the disk tier" },
+    { "proxy_stale_served_total", STATS_STALE_SERVED, "Stale responses served while refreshing" },
+    { "proxy_revalidated_total", STATS_REVALIDATED, "Stale responses refreshed by a 304" },
+    { "proxy_coalesced_total", STATS_COALESCED, "Misses served by another request's fetch" },
+    { "proxy_keepalive_reuses_total", STATS_KEEPALIVE_REUSES, "Requests on an already used client connection" },
+    { "proxy_upstream_fetches_total", STATS_FETCHES, "Completed upstream fetches" },
+    { "proxy_upstream_bytes_total", STATS_BYTES_FETCHED, "Response bytes received from upstream" },
+    { "proxy_cache_hit_bytes_total", STATS_BYTES_HIT, "Response bytes served from the cache" },
+    { "proxy_cache_range_hits_total", STATS_RANGES, "Range requests answered from a cached response" },
+    { "proxy_cache_compressed_total", STATS_COMPRESSED, "Cached elements replaced by a gzipped copy" },
+    { "proxy_cache_compress_saved_bytes_total", STATS_COMPRESS_SAVED, "Bytes saved by gzipped copies" },
+    { "proxy_cache_inflated_total", STATS_INFLATED, "Hits on a gzipped copy inflated for the client" },
+    { "proxy_peer_fetches_total", STATS_PEER_FETCHES, "Misses fetched through the peer owning the key" },
+    { "proxy_peer_failures_total", STATS_PEER_FAILURES, "Peer fetches that fell back to the origin" },
+};
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void metrics_value(FILE* out, const char* name, const char* type, const char* help, double value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+// Build the whole HTTP response of the metrics endpoint. Returns a
+// buffer to free(), or NULL if out of memory.
+char* build_metrics_response(int* len) {
+    stats_totals totals;
+    stats_collect(&totals);
+    
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if (!out) return NULL;
+    
+    for (size_t i = 0; i < sizeof(metrics_counters) / sizeof(metrics_counters[0]); i++) {
+        metrics_value(out, metrics_counters[i].name, "counter", metrics_counters[i].help,
+                      totals.counters[metrics_counters[i].counter]);
+    }
+    metrics_value(out, "proxy_upstream_fetch_seconds_total", "counter", "Time spent on completed upstream fetches",
+                  totals.counters[STATS_FETCH_TIME_US] / 1e6);
+    
+    fprintf(out, "# HELP proxy_request_duration_seconds Client request latency by outcome\n"
+                 "# TYPE proxy_request_duration_seconds summary\n");
+    for (int outcome = 0; outcome < STATS_OUTCOMES; outcome++) {
+        const char* name = stats_outcome_names[outcome];
+        for (size_t q = 0; q < sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]); q++) {
+            fprintf(out, "proxy_request_duration_seconds{outcome=\"%s\",quantile=\"%g\"} %.6f\n", name,
+                    metrics_quantiles[q], stats_percentile(&totals, outcome, metrics_quantiles[q]) / 1e6);
+        }
+        fprintf(out, "proxy_request_duration_seconds_sum{outcome=\"%s\"} %.6f\n", name,
+                totals.latency_sum[outcome] / 1e6);
+        fprintf(out, "proxy_request_duration_seconds_count{outcome=\"%s\"} %ld\n", name,
+                totals.latency_count[outcome]);
+    }
+    
+    metrics_value(out, "proxy_cache_bytes", "gauge", "Bytes accounted to the memory cache", cache_total_size());
+    metrics_value(out, "proxy_cache_mapped_bytes", "gauge", "Memory mapped by the cache slab allocator",
+                  slab_mapped_bytes());
+    metrics_value(out, "proxy_active_connections", "gauge", "Open client connections",
+                  __atomic_load_n(&active_connection_count, __ATOMIC_RELAXED));
+    if (config.mode == MODE_THREAD) {
+        int workers, busy, blocked;
+        worker_pool_counts(&workers, &busy, &blocked);
+        metrics_value(out, "proxy_workers", "gauge", "Live worker threads", workers);
+        metrics_value(out, "proxy_workers_busy", "gauge", "Workers serving a connection", busy);
+        metrics_value(out, "proxy_workers_io_blocked", "gauge", "Workers blocked on I/O", blocked);
+        metrics_value(out, "proxy_workers_started_total", "counter", "Workers added by pool sizing",
+                      __atomic_load_n(&worker_pool.started, __ATOMIC_RELAXED));
+        metrics_value(out, "proxy_workers_retired_total", "counter", "Idle workers retired by pool sizing",
+                      __atomic_load_n(&worker_pool.retired, __ATOMIC_RELAXED));
+    }
+    metrics_value(out, "proxy_upstream_idle_connections", "gauge", "Idle pooled upstream connections",
+                  __atomic_load_n(&conn_pool.idle, __ATOMIC_RELAXED));
+    metrics_value(out, "proxy_upstream_reused_total", "counter", "Pool checkouts that returned a live connection",
+                  __atomic_load_n(&conn_pool.reused, __ATOMIC_RELAXED));
+    metrics_value(out, "proxy_upstream_stale_total", "counter", "Idle pooled connections found closed",
+                  __atomic_load_n(&conn_pool.stale, __ATOMIC_RELAXED));
+    long dns_hits, dns_misses, dns_negative, dns_prefetches;
+    resolver_stats(&dns_hits, &dns_misses, &dns_negative, &dns_prefetches);
+    metrics_value(out, "proxy_dns_hits_total", "counter", "Resolver cache hits", dns_hits);
+    metrics_value(out, "proxy_dns_misses_total", "counter", "Resolver cache misses", dns_misses);
+    metrics_value(out, "proxy_dns_negative_hits_total", "counter", "Cached resolver failures served", dns_negative);
+    metrics_value(out, "proxy_dns_prefetches_total", "counter", "Resolver background refreshes", dns_prefetches);
+    if (config.cache_admission == CACHE_ADMISSION_TINYLFU) {
+        metrics_value(out, "proxy_admission_admitted_total", "counter", "Window elements admitted to the main list",
+                      __atomic_load_n(&admission.admitted, __ATOMIC_RELAXED));
+        metrics_value(out, "proxy_admission_rejected_total", "counter", "Window elements rejected",
+                      __atomic_load_n(&admission.rejected, __ATOMIC_RELAXED));
+        metrics_value(out, "proxy_admission_rejected_misses_total", "counter", "Misses on rejected keys",
+                      __atomic_load_n(&admission.rejected_misses, __ATOMIC_RELAXED));
+    }
+    if (cache_peer_count() > 0) {
+        int down = 0;
+        for (int i = 0; i < cache_peer_count(); i++) {
+            down += __atomic_load_n(&cache_peer_at(i)->down, __ATOMIC_RELAXED);
+        }
+        metrics_value(out, "proxy_peers", "gauge", "Members of the peering ring", cache_peer_count());
+        metrics_value(out, "proxy_peers_down", "gauge", "Peers currently skipped as down", down);
+    }
+    if (disk_cache_enabled()) {
+        long disk_entries, disk_stored, disk_dropped, disk_reclaimed;
+        size_t disk_used;
+        disk_cache_stats(&disk_entries, &disk_stored, &disk_dropped, &disk_reclaimed, &disk_used);
+        metrics_value(out, "proxy_disk_entries", "gauge", "Responses indexed by the disk tier", disk_entries);
+        metrics_value(out, "proxy_disk_bytes", "gauge", "Bytes in live disk tier segments", disk_used);
+        metrics_value(out, "proxy_disk_stored_total", "counter", "Responses written to the disk tier", disk_stored);
+        metrics_value(out, "proxy_disk_dropped_total", "counter", "Disk tier stores dropped", disk_dropped);
+        metrics_value(out, "proxy_disk_reclaimed_total", "counter", "Disk tier segments reclaimed", disk_reclaimed);
+    }
+    if (fclose(out) != 0) {
+        free(body);
+        return NULL;
+    }
+    
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: no-store\r\n"
+        "Connection: close\r\n"
+        "Server: HighPerformanceProxy/2.0\r\n"
+        "\r\n", body_len);
+    char* response = (char*)malloc(header_len + body_len);
+    if (response) {
+        memcpy(response, header, header_len);
+        memcpy(response + header_len, body, body_len);
+        *len = header_len + body_len;
+    }
+    free(body);
+    return response;
+}
+
+// Parse --name=value options following the port argument
+int parse_options(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--cache-shards=", 15) == 0) {
+            config.cache_shards = atoi(argv[i] + 15);
+            if (config.cache_shards < 1 || config.cache_shards > MAX_CACHE_SHARDS) {
+                fprintf(stderr, "--cache-shards must be between 1 and %d\n", MAX_CACHE_SHARDS);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--cache-policy=", 15) == 0) {
+            if (strcmp(argv[i] + 15, "lru") == 0) {
+                config.cache_policy = CACHE_POLICY_LRU;
+            } else if (strcmp(argv[i] + 15, "clock") == 0) {
+                config.cache_policy = CACHE_POLICY_CLOCK;
+            } else if (strcmp(argv[i] + 15, "gdsf") == 0) {
+                config.cache_policy = CACHE_POLICY_GDSF;
+            } else {
+                fprintf(stderr, "--cache-policy must be lru, clock or gdsf\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--cache-admission=", 18) == 0) {
+            if (strcmp(argv[i] + 18, "all") == 0) {
+                config.cache_admission = CACHE_ADMISSION_ALL;
+            } else if (strcmp(argv[i] + 18, "tinylfu") == 0) {
+                config.cache_admission = CACHE_ADMISSION_TINYLFU;
+            } else {
+                fprintf(stderr, "--cache-admission must be all or tinylfu\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--peers=", 8) == 0) {
+            config.peers = argv[i] + 8;
+        } else if (strncmp(argv[i], "--peer-self=", 12) == 0) {
+            config.peer_self = argv[i] + 12;
+        } else if (strncmp(argv[i], "--cache-compress=", 17) == 0) {
+            if (strcmp(argv[i] + 17, "off") == 0) {
+                config.cache_compress = CACHE_COMPRESS_OFF;
+            } else if (strcmp(argv[i] + 17, "gzip") == 0) {
+                config.cache_compress = CACHE_COMPRESS_GZIP;
+            } else {
+                fprintf(stderr, "--cache-compress must be off or gzip\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--mode=", 7) == 0) {
+            if (strcmp(argv[i] + 7, "thread") == 0) {
+                config.mode = MODE_THREAD;
+            } else if (strcmp(argv[i] + 7, "event") == 0) {
+                config.mode = MODE_EVENT;
+            } else {
+                fprintf(stderr, "--mode must be thread or event\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--event-loops=", 14) == 0) {
+            config.event_loops = atoi(argv[i] + 14);
+            if (config.event_loops < 1 || config.event_loops > EVENT_MAX_LOOPS) {
+                fprintf(stderr, "--event-loops must be between 1 and %d\n", EVENT_MAX_LOOPS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--reuseport") == 0) {
+            config.reuseport = 1;
+        } else if (strncmp(argv[i], "--listeners=", 12) == 0) {
+            config.listeners = atoi(argv[i] + 12);
+            config.reuseport = 1;
+            if (config.listeners < 1 || config.listeners > MAX_LISTENERS) {
+                fprintf(stderr, "--listeners must be between 1 and %d\n", MAX_LISTENERS);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--workers-min=", 14) == 0) {
+            config.workers_min = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--workers-max=", 14) == 0) {
+            config.workers_max = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--disk-cache=", 13) == 0) {
+            config.disk_cache_dir = argv[i] + 13;
+        } else if (strncmp(argv[i], "--disk-cache-size=", 18) == 0) {
+            config.disk_cache_size = atol(argv[i] + 18);
+            if (config.disk_cache_size < DISK_SEGMENT_SIZE >> 20) {
+                fprintf(stderr, "--disk-cache-size must be at least %d MB\n", DISK_SEGMENT_SIZE >> 20);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            config.snapshot_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--snapshot-interval=", 20) == 0) {
+            config.snapshot_interval = atoi(argv[i] + 20);
+            if (config.snapshot_interval < 1) {
+                fprintf(stderr, "--snapshot-interval must be at least 1 second\n");
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (config.workers_min < 1 || config.workers_max < config.workers_min) {
+        fprintf(stderr, "--workers-min must be at least 1 and no larger than --workers-max\n");
+        return -1;
+    }
+    return 0;
 }
 
 // Main function
+// Benchmarks build this file with PROXY_NO_MAIN to drive the cache directly
+#ifndef PROXY_NO_MAIN
 int main(int argc, char *argv[]) {
-    if (argc == 2) {
+    if (argc >= 2 && parse_options(argc, argv) == 0) {
         port_number = atoi(argv[1]);
     } else {
-        printf("Usage: %s <port>\n", argv[0]);
+        printf("Usage: %s <port> [--cache-shards=N] [--cache-policy=lru|clock|gdsf] [--cache-admission=all|tinylfu]"
+               " [--cache-compress=off|gzip] [--mode=thread|event] [--event-loops=N] [--reuseport] [--listeners=N] [--workers-min=N] [--workers-max=N]"
+               " [--disk-cache=DIR] [--disk-cache-size=MB]"
+               " [--snapshot=PATH] [--snapshot-interval=SECONDS]"
+               " [--peers=HOST:PORT,... --peer-self=HOST:PORT]\n", argv[0]);
         exit(1);
     }
+    if (config.event_loops == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.event_loops = cpus < 1 ? 1 : (cpus > EVENT_MAX_LOOPS ? EVENT_MAX_LOOPS : cpus);
+    }
 
     printf("Starting High-Performance Proxy Server on port %d\n", port_number);
-    printf("Thread Pool Size: %d\n", THREAD_POOL_SIZE);
-    printf("Max Concurrent Connections: %d\n", MAX_CLIENTS);
+    if (config.mode == MODE_EVENT) {
+        printf("Event Loops: %d\n", config.event_loops);
+        printf("Max Concurrent Connections: %d\n", EVENT_MAX_CLIENTS);
+    } else {
+        printf("Worker Pool: %d to %d workers, %d at start\n",
+               config.workers_min, config.workers_max, initial_workers());
+        printf("Max Concurrent Connections: %d\n", MAX_CLIENTS);
+    }
         printf("Cache Size: %d MB\n", MAX_SIZE / (1024 * 1024));
     printf("Max Element Size: %d MB\n", MAX_ELEMENT_SIZE / (1024 * 1024));
     printf("Queue Size: %d\n", QUEUE_SIZE);
 
 
-    // Initialize cache lock
-    if (pthread_rwlock_init(&cache_rwlock, NULL) != 0) {
-        perror("pthread_rwlock_init failed");
-        exit(1);
-    }
+    // Every thread started from here on inherits a mask blocking shutdown
+    // signals; they are unblocked once the main thread is serving
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
 
-    // Initialize request queue
-    request_queue.head = NULL;
-    request_queue.tail = NULL;
-    request_queue.count = 0;
-    pthread_mutex_init(&request_queue.mutex, NULL);
-    pthread_cond_init(&request_queue.not_empty, NULL);
-    pthread_cond_init(&request_queue.not_full, NULL);
+    // Initialize cache shards
+    init_cache();
+    printf("Cache Shards: %d\n", cache_shard_count);
+    printf("Cache Policy: %s\n", config.cache_policy == CACHE_POLICY_GDSF ? "gdsf" :
+                                  config.cache_policy == CACHE_POLICY_CLOCK ? "clock" : "lru");
+    printf("Cache Admission: %s\n", config.cache_admission == CACHE_ADMISSION_TINYLFU ? "tinylfu" : "all");
+    
+    // Text bodies are gzipped in the background once cached
+    if (config.cache_compress) {
+        pthread_t compressor;
+        if (pthread_create(&compressor, NULL, cache_compress_thread, NULL) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        pthread_detach(compressor);
+        printf("Cache Compression: gzip\n");
+    }
+    
+    // Disk tier for elements evicted from memory
+    pthread_t disk_writer;
+    if (config.disk_cache_dir) {
+        if (disk_cache_init(config.disk_cache_dir, (size_t)config.disk_cache_size << 20) < 0 ||
+            pthread_create(&disk_writer, NULL, disk_writer_thread, NULL) != 0) {
+            fprintf(stderr, "Disk cache setup failed\n");
+            exit(1);
+        }
+        printf("Disk Cache: %s (%ld MB)\n", config.disk_cache_dir, config.disk_cache_size);
+    }
+    
+    // Warm restart from the last snapshot, then keep taking them
+    if (config.snapshot_path) {
+        struct timeval load_start;
+        gettimeofday(&load_start, NULL);
+        int loaded = cache_snapshot_load(config.snapshot_path);
+        if (loaded >= 0) {
+            printf("Cache snapshot: %d elements loaded in %ld ms\n", loaded, elapsed_ms(&load_start));
+        }
+        
+        pthread_t snapshotter;
+        if (pthread_create(&snapshotter, NULL, cache_snapshot_thread, NULL) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        pthread_detach(snapshotter);
+    }
 
     // Initialize connection pool
     init_connection_pool();
+    resolver_init();
 
-    // Create worker threads
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (pthread_create(&worker_threads[i], NULL, worker_thread, NULL) != 0) {
-            perror("pthread_create failed");
+    // Peering ring, with a checker that notices failed peers
+    if (config.peers) {
+        pthread_t checker;
+        if (cache_peer_init(config.peers, config.peer_self) < 0 ||
+            pthread_create(&checker, NULL, cache_peer_check_thread, NULL) != 0) {
+            fprintf(stderr, "Cache peering setup failed\n");
             exit(1);
         }
+        pthread_detach(checker);
+        printf("Cache Peers: %d nodes, this one is %s\n", cache_peer_count(), config.peer_self);
     }
 
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);       // splice() has no MSG_NOSIGNAL
 
     // Create proxy socket
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+    proxy_socketId = open_listener(config.reuseport);
     if (proxy_socketId < 0) {
-        perror("Error opening socket");
-        exit(1);
-    }
-
-    // Set socket options
-    int opt = 1;
-    setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(proxy_socketId, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
-
-    // Bind socket
-    struct sockaddr_in proxy_addr;
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_addr.s_addr = INADDR_ANY;
-    proxy_addr.sin_port = htons(port_number);
-
-    if (bind(proxy_socketId, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
-        perror("Error binding socket");
-        exit(1);
-    }
-
-    // Listen for connections
-    if (listen(proxy_socketId, QUEUE_SIZE) < 0) {
-        perror("Error listening on socket");
         exit(1);
     }
 
     printf("Proxy server ready and listening on port %d...\n", port_number);
 
-    // Main server loop
-    while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        // Wait for connection with timeout to allow periodic stats printing
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(proxy_socketId, &read_fds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int ready = select(proxy_socketId + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (ready > 0 && FD_ISSET(proxy_socketId, &read_fds)) {
-            int client_socket = accept(proxy_socketId, (struct sockaddr *)&client_addr, &client_len);
-            if (client_socket < 0) {
-                perror("Error accepting connection");
-                continue;
-            }
-            
-            // Check if we've reached max connections
-            pthread_mutex_lock(&connection_limit_mutex);
-if (active_connection_count >= MAX_CLIENTS) {
-    pthread_mutex_unlock(&connection_limit_mutex);
-    sendErrorMessage(client_socket, 503);
-    close(client_socket);
-    continue;
-}
-active_connection_count++;
-pthread_mutex_unlock(&connection_limit_mutex);
-            
-            // Set socket to non-blocking
-            setup_nonblocking_socket(client_socket);
-            
-            // Enqueue the request
-            enqueue_request(client_socket, client_addr);
-        }
-        
-        // Print stats periodically
-        static time_t last_stats_time = 0;
-        time_t now = time(NULL);
-        if (now - last_stats_time >= 60) { // Every minute
-            print_stats();
-            last_stats_time = now;
+    if (config.mode == MODE_EVENT) {
+        run_event_loops();
+    } else {
+        // Accept and worker threads of the thread engine
+        start_listener_groups();
+        if (config.reuseport) {
+            printf("Listener Groups: %d (SO_REUSEPORT, %d to %d workers each)\n",
+                   listener_group_count, listener_groups[0].min_workers, listener_groups[0].max_workers);
         }
+        pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+        run_stats_loop();
     }
 
     // Cleanup and shutdown
     printf("Shutting down proxy server...\n");
     
-    // Wait for worker threads to finish
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_join(worker_threads[i], NULL);
+    // Wait for the accept threads to finish, then give the (detached)
+    // workers a moment to finish their connections
+    for (int i = 0; config.mode == MODE_THREAD && i < listener_group_count; i++) {
+        work_queue_wake_all(&listener_groups[i].queue);
+        pthread_join(listener_groups[i].accept_thread, NULL);
+    }
+    int workers = 0;
+    for (int waited = 0; waited <= SHUTDOWN_DRAIN_SECONDS * 10; waited++) {
+        workers = 0;
+        for (int i = 0; config.mode == MODE_THREAD && i < listener_group_count; i++) {
+            workers += __atomic_load_n(&listener_groups[i].workers, __ATOMIC_RELAXED);
+        }
+        if (workers == 0) break;
+        usleep(100000);
+    }
+    
+    // The disk writer finishes the element it is writing, if any
+    if (config.disk_cache_dir) {
+        pthread_mutex_lock(&demote_queue.mutex);
+        pthread_cond_broadcast(&demote_queue.ready);
+        pthread_mutex_unlock(&demote_queue.mutex);
+        pthread_join(disk_writer, NULL);
+    }
+    
+    // Kept locked through exit so no periodic snapshot starts afterwards
+    if (config.snapshot_path) {
+        pthread_mutex_lock(&snapshot_mutex);
+        cache_snapshot_write(config.snapshot_path);
     }
+    print_stats();
     
-    cleanup_resources();
+    // Workers still serving hold cache references, their memory goes with the process
+    if (workers == 0) {
+        cleanup_resources();
+    } else {
+        printf("%d workers still busy, skipping cache cleanup\n", workers);
+    }
     close(proxy_socketId);
     
     printf("Proxy server shutdown complete.\n");
     return 0;
-}
\ No newline at end of file
+}
+#endif /* PROXY_NO_MAIN */
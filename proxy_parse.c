@@ -1,4 +1,8 @@
 #include "proxy_parse.h"
+#include <stddef.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 void debug(const char* format, ...) {
     if (DEBUG) {
@@ -20,18 +24,28 @@ ParsedRequest* ParsedRequest_create() {
     return pr;
 }
 
+// Headers parsed from the request live in pr->buf, only those added
+// later by ParsedRequest_setHeader() are allocated one by one
+static int parsed_header_inline(ParsedRequest *pr, struct ParsedHeader *ph) {
+    return pr->buf && (char*)ph >= pr->buf && (char*)ph < pr->buf + pr->buf_len;
+}
+
+static void parsed_header_release(ParsedRequest *pr, struct ParsedHeader *ph) {
+    if (!parsed_header_inline(pr, ph)) {
+        ParsedHeader_destroyOne(ph);
+    }
+}
+
 void ParsedRequest_destroy(ParsedRequest *pr) {
     if (pr == NULL) return;
     
-    if (pr->buf) free(pr->buf);
-    if (pr->method) free(pr->method);
-    if (pr->protocol) free(pr->protocol);
-    if (pr->host) free(pr->host);
-    if (pr->port) free(pr->port);
-    if (pr->path) free(pr->path);
-    if (pr->version) free(pr->version);
-    
-    ParsedHeader_destroy(pr->headers);
+    struct ParsedHeader *current = pr->headers;
+    while (current != NULL) {
+        struct ParsedHeader *next = current->next;
+        parsed_header_release(pr, current);
+        current = next;
+    }
+    free(pr->buf);
     free(pr);
 }
 
@@ -85,17 +99,8 @@ char* ParsedRequest_getHeader(ParsedRequest *pr, const char *name) {
 int ParsedRequest_setHeader(ParsedRequest *pr, const char *name, const char *value) {
     if (pr == NULL || name == NULL || value == NULL) return -1;
     
-    // Check if header already exists
-    struct ParsedHeader *current = pr->headers;
-    while (current != NULL) {
-        if (strcasecmp(current->name, name) == 0) {
-            // Update existing header
-            free(current->value);
-            current->value = strdup(value);
-            return (current->value != NULL) ? 0 : -1;
-        }
-        current = current->next;
-    }
+    // Replace any existing header, parsed ones cannot be resized in place
+    ParsedRequest_removeHeader(pr, name);
     
     // Create new header
     struct ParsedHeader *new_header = ParsedHeader_create((char*)name, (char*)value);
@@ -109,20 +114,271 @@ int ParsedRequest_setHeader(ParsedRequest *pr, const char *name, const char *val
     return 0;
 }
 
-static char* trim_whitespace(char *str) {
-    char *end;
+int ParsedRequest_removeHeader(ParsedRequest *pr, const char *name) {
+    if (pr == NULL || name == NULL) return 0;
     
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
+    int removed = 0;
+    struct ParsedHeader **link = &pr->headers;
+    while (*link != NULL) {
+        struct ParsedHeader *current = *link;
+        if (strcasecmp(current->name, name) == 0) {
+            *link = current->next;
+            parsed_header_release(pr, current);
+            pr->header_count--;
+            removed++;
+        } else {
+            link = &current->next;
+        }
+    }
+    return removed;
+}
+
+// Parse the digits at *p, returns -1 if there are none or too many
+static long parse_range_number(const char **p) {
+    long value = 0;
+    const char *start = *p;
+    while (isdigit((unsigned char)**p)) {
+        if (value > (0x7fffffffL - 9) / 10) return -1;
+        value = value * 10 + (**p - '0');
+        (*p)++;
+    }
+    return *p > start ? value : -1;
+}
+
+int ParsedRequest_getRanges(ParsedRequest *pr, ParsedRange *ranges, int max) {
+    const char *p = ParsedRequest_getHeader(pr, "Range");
+    if (p == NULL) return 0;
+    
+    while (*p == ' ' || *p == '\t') p++;
+    if (strncasecmp(p, "bytes", 5) != 0) return -1;
+    p += 5;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p++ != '=') return -1;
+    
+    int count = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') {
+            p++;                    // Empty list elements are allowed
+            continue;
+        }
+        if (*p == '\0') break;
+        if (count == max) return -1;
+        
+        ParsedRange *range = &ranges[count];
+        if (*p == '-') {
+            p++;
+            range->first = -1;
+            range->last = parse_range_number(&p);
+            if (range->last < 0) return -1;
+        } else {
+            range->first = parse_range_number(&p);
+            if (range->first < 0 || *p++ != '-') return -1;
+            range->last = isdigit((unsigned char)*p) ? parse_range_number(&p) : -1;
+            if (isdigit((unsigned char)*p) || (range->last >= 0 && range->last < range->first)) return -1;
+        }
+        count++;
+        
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p != ',' && *p != '\0') return -1;
+    }
+    return count > 0 ? count : -1;
+}
+
+// First byte in [p, end) equal to a, b or c, or end
+static const char* find_any_scalar(const char *p, const char *end, char a, char b, char c) {
+    while (p < end && *p != a && *p != b && *p != c) p++;
+    return p;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so every build gets at least this one
+static const char* find_any_sse2(const char *p, const char *end, char a, char b, char c) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, va), _mm_cmpeq_epi8(data, vb)),
+                                    _mm_cmpeq_epi8(data, vc));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_any_scalar(p, end, a, b, c);
+}
+
+// Compiled for AVX2 whatever the build targets, only called on CPUs that have it
+__attribute__((target("avx2")))
+static const char* find_any_avx2(const char *p, const char *end, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(data, va), _mm256_cmpeq_epi8(data, vb)),
+                                       _mm256_cmpeq_epi8(data, vc));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    // The tail call skips the compiler's own vzeroupper, and dirty upper
+    // halves would slow down every SSE instruction after it
+    _mm256_zeroupper();
+    return find_any_sse2(p, end, a, b, c);
+}
+#endif
+
+typedef const char* (*find_any_fn)(const char *p, const char *end, char a, char b, char c);
+
+// Scan picked for this CPU on first use
+static find_any_fn find_any_impl;
+
+static find_any_fn find_any_select() {
+    find_any_fn impl = __atomic_load_n(&find_any_impl, __ATOMIC_RELAXED);
+    if (impl) return impl;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    impl = __builtin_cpu_supports("avx2") ? find_any_avx2 : find_any_sse2;
+#else
+    impl = find_any_scalar;
+#endif
+    __atomic_store_n(&find_any_impl, impl, __ATOMIC_RELAXED);
+    return impl;
+}
+
+static const char* find_any(const char *p, const char *end, char a, char b, char c) {
+    return find_any_select()(p, end, a, b, c);
+}
+
+const char* ParsedRequestView_scan() {
+    find_any_fn impl = find_any_select();
+#if defined(__x86_64__)
+    if (impl == find_any_avx2) return "AVX2";
+    if (impl == find_any_sse2) return "SSE2";
+#endif
+    return "scalar";
+}
+
+static ParsedSlice make_slice(const char *buf, const char *start, const char *end) {
+    ParsedSlice slice = { (int)(start - buf), (int)(end - start) };
+    return slice;
+}
+
+// Start of the line after the one ending at eol (a CRLF or a bare LF)
+static const char* next_line(const char *eol, const char *end) {
+    return eol + (*eol == '\r' && eol + 1 < end && eol[1] == '\n' ? 2 : 1);
+}
+
+// Split "host[:port]" into the host and port slices
+static void split_authority(ParsedRequestView *view, const char *start, const char *end) {
+    const char *colon = memchr(start, ':', end - start);
+    view->host = make_slice(view->buf, start, colon ? colon : end);
+    if (colon) {
+        view->port = make_slice(view->buf, colon + 1, end);
+    }
+}
+
+int ParsedRequestView_parse(ParsedRequestView *view, const char *buf, int buflen) {
+    if (view == NULL || buf == NULL || buflen <= 0) {
+        return -1;
+    }
     
-    if (*str == 0) return str;
+    // The header array is only valid up to header_count, so it is not cleared
+    memset(view, 0, offsetof(ParsedRequestView, headers));
+    view->buf = buf;
+    const char *end = buf + buflen;
+    
+    // Request line: method SP target SP version
+    const char *p = buf;
+    const char *sp = find_any(p, end, ' ', '\r', '\n');
+    if (sp == p || sp == end || *sp != ' ') return -1;
+    view->method = make_slice(buf, p, sp);
+    
+    p = sp + 1;
+    sp = find_any(p, end, ' ', '\r', '\n');
+    if (sp == p || sp == end || *sp != ' ') return -1;
+    view->url = make_slice(buf, p, sp);
+    
+    p = sp + 1;
+    const char *eol = find_any(p, end, '\r', '\n', '\n');
+    if (eol == end) return -1;
+    view->version = make_slice(buf, p, eol);
+    
+    // Absolute URLs carry the origin, relative ones are all path
+    const char *url = buf + view->url.offset;
+    const char *url_end = url + view->url.len;
+    if (view->url.len >= 7 && strncmp(url, "http://", 7) == 0) {
+        view->protocol = make_slice(buf, url, url + 4);
+        const char *authority = url + 7;
+        const char *slash = memchr(authority, '/', url_end - authority);
+        const char *authority_end = slash ? slash : url_end;
+        split_authority(view, authority, authority_end);
+        view->path = make_slice(buf, authority_end, url_end);
+    } else {
+        view->path = view->url;
+    }
     
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
+    // Header lines up to the blank line; lines without a colon are skipped
+    p = next_line(eol, end);
+    while (p < end) {
+        eol = find_any(p, end, '\r', '\n', '\n');
+        if (eol == end) break; // Unterminated last line
+        const char *line = p;
+        p = next_line(eol, end);
+        if (eol == line) break;
+        
+        const char *colon = find_any(line, eol, ':', ':', ':');
+        if (colon == eol) continue;
+        if (view->header_count == PARSED_MAX_HEADERS) return -1;
+        
+        const char *name = line, *name_end = colon;
+        const char *value = colon + 1, *value_end = eol;
+        while (name < name_end && (*name == ' ' || *name == '\t')) name++;
+        while (name_end > name && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+        while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        view->headers[view->header_count].name = make_slice(buf, name, name_end);
+        view->headers[view->header_count].value = make_slice(buf, value, value_end);
+        view->header_count++;
+    }
+    view->length = p - buf;
     
-    end[1] = '\0';
-    return str;
+    // If no host was found in URL, try to get it from Host header
+    if (view->protocol.len == 0) {
+        const ParsedSlice *host = ParsedRequestView_getHeader(view, "Host");
+        if (host != NULL) {
+            split_authority(view, buf + host->offset, buf + host->offset + host->len);
+        }
+    }
+    return 0;
+}
+
+const ParsedSlice* ParsedRequestView_getHeader(const ParsedRequestView *view, const char *name) {
+    if (view == NULL || name == NULL) return NULL;
+    
+    int name_len = strlen(name);
+    for (int i = 0; i < view->header_count; i++) {
+        if (view->headers[i].name.len == name_len &&
+            strncasecmp(view->buf + view->headers[i].name.offset, name, name_len) == 0) {
+            return &view->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// Copy a slice into the block at *cursor as a C string
+static char* block_copy(char **cursor, const char *buf, ParsedSlice slice) {
+    char *copy = *cursor;
+    memcpy(copy, buf + slice.offset, slice.len);
+    copy[slice.len] = '\0';
+    *cursor += slice.len + 1;
+    return copy;
+}
+
+static char* block_copy_string(char **cursor, const char *str) {
+    ParsedSlice slice = { 0, (int)strlen(str) };
+    return block_copy(cursor, str, slice);
 }
 
 int ParsedRequest_parse(ParsedRequest *pr, const char *buf, int buflen) {
@@ -130,139 +386,52 @@ int ParsedRequest_parse(ParsedRequest *pr, const char *buf, int buflen) {
         return -1;
     }
     
-    // Make a copy of the buffer
-    pr->buf = (char*)malloc(buflen + 1);
-    if (pr->buf == NULL) {
+    ParsedRequestView view;
+    if (ParsedRequestView_parse(&view, buf, buflen) < 0) {
         return -1;
     }
-    memcpy(pr->buf, buf, buflen);
-    pr->buf[buflen] = '\0';
-    pr->buf_len = buflen;
-    
-    char *line_start = pr->buf;
-    char *line_end;
-    
-    // Parse request line
-    line_end = strstr(line_start, "\r\n");
-    if (line_end == NULL) {
-        line_end = strstr(line_start, "\n");
-        if (line_end == NULL) {
-            return -1;
-        }
-        *line_end = '\0';
-        line_end += 1;
-    } else {
-        *line_end = '\0';
-        line_end += 2;
+    int has_host = view.protocol.len > 0 || view.host.len > 0;
+    
+    // One block holds the header structures, then every string
+    size_t headers_size = view.header_count * sizeof(struct ParsedHeader);
+    size_t size = headers_size + view.method.len + view.protocol.len + view.host.len + view.path.len +
+                  view.version.len + (view.port.len > 0 ? view.port.len : 2) + sizeof("/") + 6;
+    for (int i = 0; i < view.header_count; i++) {
+        size += view.headers[i].name.len + view.headers[i].value.len + 2;
+    }
+    pr->buf = (char*)malloc(size);
+    if (pr->buf == NULL) {
+        return -1;
     }
+    pr->buf_len = size;
     
-    // Parse method, path, and version
-    char *method_end = strchr(line_start, ' ');
-    if (method_end == NULL) return -1;
-    *method_end = '\0';
-    pr->method = strdup(line_start);
-    
-    char *path_start = method_end + 1;
-    char *path_end = strchr(path_start, ' ');
-    if (path_end == NULL) return -1;
-    *path_end = '\0';
-    
-    // Parse URL to extract protocol, host, port, and path
-    char *url = strdup(path_start);
-    if (strncmp(url, "http://", 7) == 0) {
-        pr->protocol = strdup("http");
-        char *host_start = url + 7;
-        char *host_end = strchr(host_start, '/');
-        char *port_start = strchr(host_start, ':');
-        
-        if (port_start && (host_end == NULL || port_start < host_end)) {
-            *port_start = '\0';
-            pr->host = strdup(host_start);
-            port_start++;
-            if (host_end) {
-                *host_end = '\0';
-                pr->port = strdup(port_start);
-                pr->path = strdup(host_end + 1);
-            } else {
-                pr->port = strdup(port_start);
-                pr->path = strdup("/");
-            }
-        } else {
-            if (host_end) {
-                *host_end = '\0';
-                pr->host = strdup(host_start);
-                pr->path = strdup(host_end + 1);
-            } else {
-                pr->host = strdup(host_start);
-                pr->path = strdup("/");
-            }
-            pr->port = strdup("80");
-        }
-    } else {
-        // Relative URL
-        pr->path = strdup(url);
+    struct ParsedHeader *headers = (struct ParsedHeader*)pr->buf;
+    char *cursor = pr->buf + headers_size;
+    pr->method = block_copy(&cursor, buf, view.method);
+    if (view.protocol.len > 0) {
+        pr->protocol = block_copy(&cursor, buf, view.protocol);
     }
-    free(url);
-    
-    char *version_start = path_end + 1;
-    pr->version = strdup(version_start);
-    
-    // Parse headers
-    line_start = line_end;
-    while (line_start && *line_start != '\0') {
-        line_end = strstr(line_start, "\r\n");
-        if (line_end == NULL) {
-            line_end = strstr(line_start, "\n");
-            if (line_end == NULL) {
-                break;
-            }
-            *line_end = '\0';
-            line_end += 1;
-        } else {
-            *line_end = '\0';
-            line_end += 2;
-        }
-        
-        if (strlen(line_start) == 0) {
-            // Empty line indicates end of headers
-            break;
-        }
-        
-        char *header_separator = strchr(line_start, ':');
-        if (header_separator != NULL) {
-            *header_separator = '\0';
-            char *header_name = trim_whitespace(line_start);
-            char *header_value = trim_whitespace(header_separator + 1);
-            
-            struct ParsedHeader *header = ParsedHeader_create(header_name, header_value);
-            if (header != NULL) {
-                header->next = pr->headers;
-                pr->headers = header;
-                pr->header_count++;
-            }
-        }
-        
-        line_start = line_end;
+    if (has_host) {
+        pr->host = block_copy(&cursor, buf, view.host);
+        pr->port = view.port.len > 0 ? block_copy(&cursor, buf, view.port) : block_copy_string(&cursor, "80");
     }
-    
-    // If no host was found in URL, try to get it from Host header
-    if (pr->host == NULL) {
-        char *host_header = ParsedRequest_getHeader(pr, "Host");
-        if (host_header != NULL) {
-            char *port_separator = strchr(host_header, ':');
-            if (port_separator != NULL) {
-                *port_separator = '\0';
-                pr->host = strdup(host_header);
-                pr->port = strdup(port_separator + 1);
-                *port_separator = ':'; // Restore original
-            } else {
-                pr->host = strdup(host_header);
-                if (pr->port == NULL) {
-                    pr->port = strdup("80");
-                }
-            }
-        }
+    if (view.protocol.len > 0 && view.path.len == 0) {
+        pr->path = block_copy_string(&cursor, "/");
+    } else {
+        pr->path = block_copy(&cursor, buf, view.path);
+    }
+    pr->version = block_copy(&cursor, buf, view.version);
+    
+    // Headers keep their request order
+    struct ParsedHeader **link = &pr->headers;
+    for (int i = 0; i < view.header_count; i++) {
+        headers[i].name = block_copy(&cursor, buf, view.headers[i].name);
+        headers[i].value = block_copy(&cursor, buf, view.headers[i].value);
+        headers[i].next = NULL;
+        *link = &headers[i];
+        link = &headers[i].next;
     }
+    pr->header_count = view.header_count;
     
     return 0;
 }
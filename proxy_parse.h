@@ -14,6 +14,42 @@
 
 #define MAX_ELEMENT_SIZE 2048
 #define MAX_REQ_LEN 65536
+#define PARSED_MAX_HEADERS 64           // Header lines a request may carry
+#define PARSED_MAX_RANGES 16            // Byte ranges honored in one Range header
+
+/*
+ * Zero-allocation request view
+ *
+ * ParsedRequestView_parse() does not copy or allocate anything: every
+ * field is an (offset, length) slice into the caller's buffer, which must
+ * outlive the view, and headers are kept in a fixed inline array. The
+ * scans for spaces, line ends and colons compare 16 bytes at a time with
+ * SSE2 on x86-64, or 32 with AVX2 on CPUs that have it (picked at run
+ * time, whatever the build targets), and fall back to a scalar loop on
+ * other architectures.
+ */
+
+typedef struct ParsedSlice {
+    int offset;
+    int len;
+} ParsedSlice;
+
+typedef struct ParsedRequestView {
+    const char *buf;
+    ParsedSlice method;
+    ParsedSlice url;                    // Request target as sent
+    ParsedSlice protocol;               // "http" for absolute URLs, empty otherwise
+    ParsedSlice host;                   // From the URL, else from the Host header
+    ParsedSlice port;                   // Empty when not given
+    ParsedSlice path;                   // Empty for "http://host" without a slash
+    ParsedSlice version;
+    int header_count;
+    struct {
+        ParsedSlice name;
+        ParsedSlice value;              // Surrounding whitespace trimmed
+    } headers[PARSED_MAX_HEADERS];
+    int length;                         // Bytes parsed, up to and including the blank line
+} ParsedRequestView;
 
 struct ParsedHeader {
     char *name;
@@ -21,6 +57,16 @@ struct ParsedHeader {
     struct ParsedHeader *next;
 };
 
+/*
+ * One range of a "Range: bytes=..." header. first is -1 for a suffix
+ * range ("-n": the last n bytes, n is in last); last is -1 for an open
+ * ended one ("n-").
+ */
+typedef struct ParsedRange {
+    long first;
+    long last;
+} ParsedRange;
+
 typedef struct ParsedRequest {
     char *method;
     char *protocol;
@@ -28,8 +74,8 @@ typedef struct ParsedRequest {
     char *port;
     char *path;
     char *version;
-    char *buf;
-    int buf_len;
+    char *buf;                          // Single block holding the fields and parsed headers
+    int buf_len;                        // Size of that block
     struct ParsedHeader *headers;
     int header_count;
 } ParsedRequest;
@@ -49,11 +95,31 @@ ParsedRequest* ParsedRequest_create();
 
 /*
  * ParsedRequest_parse() takes a ParsedRequest structure and fills it in
- * based on the given HTTP request string
+ * based on the given HTTP request string. It parses a ParsedRequestView
+ * and copies the fields and headers into a single allocation.
  * returns 0 on success, -1 on failure
  */
 int ParsedRequest_parse(ParsedRequest *pr, const char *buf, int buflen);
 
+/*
+ * ParsedRequestView_parse() fills in view from the request in buf
+ * returns 0 on success, -1 on a malformed request line or more than
+ * PARSED_MAX_HEADERS headers
+ */
+int ParsedRequestView_parse(ParsedRequestView *view, const char *buf, int buflen);
+
+/*
+ * ParsedRequestView_getHeader() returns the value slice of the first header
+ * with the given name (compared case-insensitively), or NULL
+ */
+const ParsedSlice* ParsedRequestView_getHeader(const ParsedRequestView *view, const char *name);
+
+/*
+ * ParsedRequestView_scan() names the delimiter scan picked for this CPU:
+ * "AVX2", "SSE2" or "scalar"
+ */
+const char* ParsedRequestView_scan();
+
 /*
  * ParsedRequest_unparse() prints the given ParsedRequest structure to the
  * given file descriptor
@@ -109,5 +175,20 @@ char* ParsedRequest_getHeader(ParsedRequest *pr, const char *name);
  */
 int ParsedRequest_setHeader(ParsedRequest *pr, const char *name, const char *value);
 
+/*
+ * ParsedRequest_removeHeader() removes every header with the given name
+ * returns the number of headers removed
+ */
+int ParsedRequest_removeHeader(ParsedRequest *pr, const char *name);
+
+/*
+ * ParsedRequest_getRanges() parses the request's Range header into up to
+ * max byte ranges, in the order given
+ * returns the number of ranges, 0 if there is no Range header, -1 if it
+ * is malformed, not in bytes or lists more than max ranges (a Range
+ * header like that is to be ignored)
+ */
+int ParsedRequest_getRanges(ParsedRequest *pr, ParsedRange *ranges, int max);
+
 #endif /* PROXY_PARSE_H */
 
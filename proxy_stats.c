@@ -0,0 +1,154 @@
+#include "proxy_stats.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_CACHE_LINE 64
+
+typedef struct stats_slot {
+    long counters[STATS_COUNTERS];
+    long latency_count[STATS_OUTCOMES];
+    long latency_sum[STATS_OUTCOMES];
+    long latency[STATS_OUTCOMES][STATS_LATENCY_BUCKETS];
+    struct stats_slot* next;        // Registry list (under slots_mutex)
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_slot;
+
+static stats_slot* slots;           // Slots of live threads
+static stats_slot retired;          // Exited threads, and threads without a slot (atomic)
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static __thread stats_slot* thread_slot;
+static __thread int thread_slot_failed;
+
+// Only the owning thread writes its slot, readers may see any recent value
+static inline void slot_add(long* value, long n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Fold an exiting thread's slot into the retired total
+static void stats_slot_retire(void* arg) {
+    stats_slot* slot = (stats_slot*)arg;
+    long* from = (long*)slot;
+    long* to = (long*)&retired;
+    size_t values = offsetof(stats_slot, next) / sizeof(long);
+
+    pthread_mutex_lock(&slots_mutex);
+    for (stats_slot** link = &slots; *link; link = &(*link)->next) {
+        if (*link == slot) {
+            *link = slot->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < values; i++) {
+        __atomic_fetch_add(&to[i], __atomic_load_n(&from[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slots_mutex);
+    free(slot);
+}
+
+static void stats_key_create() {
+    pthread_key_create(&slot_key, stats_slot_retire);
+}
+
+// The calling thread's slot, registered on first use. NULL if it could
+// not be allocated, the retired total is then updated atomically instead.
+static stats_slot* stats_thread_slot() {
+    if (thread_slot || thread_slot_failed) return thread_slot;
+
+    pthread_once(&slot_key_once, stats_key_create);
+    stats_slot* slot;
+    if (posix_memalign((void**)&slot, STATS_CACHE_LINE, sizeof(stats_slot)) != 0) {
+        thread_slot_failed = 1;
+        return NULL;
+    }
+    memset(slot, 0, sizeof(stats_slot));
+    pthread_setspecific(slot_key, slot);
+
+    pthread_mutex_lock(&slots_mutex);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_mutex);
+    thread_slot = slot;
+    return slot;
+}
+
+static int latency_bucket(long usec) {
+    if (usec < 2 * STATS_SUB_BUCKETS) return usec > 0 ? usec : 0;
+    int shift = 63 - __builtin_clzl(usec) - STATS_SUB_BITS;
+    long bucket = ((long)shift << STATS_SUB_BITS) + (usec >> shift);
+    return bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1;
+}
+
+// Largest latency counted in a bucket
+static long latency_bucket_upper(int bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS) return bucket;
+    int shift = (bucket >> STATS_SUB_BITS) - 1;
+    long mantissa = (bucket & (STATS_SUB_BUCKETS - 1)) + STATS_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void stats_add(int counter, long n) {
+    stats_slot* slot = stats_thread_slot();
+    if (slot) {
+        slot_add(&slot->counters[counter], n);
+    } else {
+        __atomic_fetch_add(&retired.counters[counter], n, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_record_latency(int outcome, long usec) {
+    stats_slot* slot = stats_thread_slot();
+    int bucket = latency_bucket(usec);
+    if (slot) {
+        slot_add(&slot->latency_count[outcome], 1);
+        slot_add(&slot->latency_sum[outcome], usec);
+        slot_add(&slot->latency[outcome][bucket], 1);
+    } else {
+        __atomic_fetch_add(&retired.latency_count[outcome], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&retired.latency_sum[outcome], usec, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&retired.latency[outcome][bucket], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void stats_sum_slot(stats_totals* totals, stats_slot* slot) {
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        totals->counters[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int outcome = 0; outcome < STATS_OUTCOMES; outcome++) {
+        totals->latency_count[outcome] += __atomic_load_n(&slot->latency_count[outcome], __ATOMIC_RELAXED);
+        totals->latency_sum[outcome] += __atomic_load_n(&slot->latency_sum[outcome], __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+            totals->latency[outcome][b] += __atomic_load_n(&slot->latency[outcome][b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void stats_collect(stats_totals* totals) {
+    memset(totals, 0, sizeof(*totals));
+    pthread_mutex_lock(&slots_mutex);
+    stats_sum_slot(totals, &retired);
+    for (stats_slot* slot = slots; slot; slot = slot->next) {
+        stats_sum_slot(totals, slot);
+    }
+    pthread_mutex_unlock(&slots_mutex);
+}
+
+long stats_percentile(const stats_totals* totals, int outcome, double q) {
+    // Buckets are summed separately from the count, so rank by their own total
+    long count = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        count += totals->latency[outcome][b];
+    }
+    if (count == 0) return 0;
+
+    long rank = (long)(q * count + 0.999999);
+    if (rank < 1) rank = 1;
+    long seen = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        seen += totals->latency[outcome][b];
+        if (seen >= rank) return latency_bucket_upper(b);
+    }
+    return latency_bucket_upper(STATS_LATENCY_BUCKETS - 1);
+}
@@ -0,0 +1,85 @@
+#ifndef PROXY_STATS_H
+#define PROXY_STATS_H
+
+/*
+ * Per-thread statistics
+ *
+ * Each thread counts into its own cache-line aligned slot, with plain
+ * relaxed stores since it is the only writer, so recording a hit or a
+ * fetch never takes a lock or bounces a shared cache line. Readers sum all
+ * slots on demand. Slots of exited threads are folded into a retired total.
+ *
+ * Request latencies go to log-linear histograms (HDR style): values below
+ * 2 * STATS_SUB_BUCKETS microseconds are exact, above that every power of
+ * two is split into STATS_SUB_BUCKETS buckets, keeping the relative error
+ * of a percentile under 1 / STATS_SUB_BUCKETS.
+ */
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_LATENCY_BUCKETS 528   // Covers latencies up to 2^36 us, longer ones land in the last bucket
+
+// Counters
+enum {
+    STATS_REQUESTS,                 // Client requests answered
+    STATS_CACHE_HITS,               // Requests served from the cache, memory or disk
+    STATS_CACHE_MISSES,             // Cache lookups that found nothing usable
+    STATS_DISK_HITS,                // Hits served from the disk tier
+    STATS_STALE_SERVED,             // Stale elements served while refreshing in the background
+    STATS_REVALIDATED,              // Stale elements refreshed by a 304
+    STATS_COALESCED,                // Misses served by following another request's fetch
+    STATS_KEEPALIVE_REUSES,         // Requests served on an already used client connection
+    STATS_ERRORS,                   // Error responses sent by the proxy
+    STATS_FETCHES,                  // Completed upstream fetches
+    STATS_FETCH_TIME_US,            // Total time of those fetches
+    STATS_BYTES_FETCHED,            // Response bytes received from upstream
+    STATS_BYTES_HIT,                // Response bytes served from the cache
+    STATS_RANGES,                   // Range requests answered with a 206 or 416 from a cached response
+    STATS_COMPRESSED,               // Cached elements replaced by a gzipped copy
+    STATS_COMPRESS_SAVED,           // Bytes those copies saved
+    STATS_INFLATED,                 // Hits on a gzipped copy inflated for the client
+    STATS_PEER_FETCHES,             // Misses fetched through the peer owning the key
+    STATS_PEER_FAILURES,            // Of those, fetches that fell back to the origin
+    STATS_COUNTERS
+};
+
+// Request outcomes with a latency histogram each
+enum {
+    STATS_HIT,
+    STATS_MISS,
+    STATS_ERROR,
+    STATS_OUTCOMES
+};
+
+// Sum of all threads' statistics
+typedef struct stats_totals {
+    long counters[STATS_COUNTERS];
+    long latency_count[STATS_OUTCOMES];
+    long latency_sum[STATS_OUTCOMES]; // Microseconds
+    long latency[STATS_OUTCOMES][STATS_LATENCY_BUCKETS];
+} stats_totals;
+
+/*
+ * stats_add() adds n to one of the calling thread's counters
+ */
+void stats_add(int counter, long n);
+
+/*
+ * stats_record_latency() records one request of the given outcome that
+ * took usec microseconds
+ */
+void stats_record_latency(int outcome, long usec);
+
+/*
+ * stats_collect() sums the statistics of all threads into totals
+ */
+void stats_collect(stats_totals* totals);
+
+/*
+ * stats_percentile() returns the latency in microseconds below which the
+ * fraction q of the outcome's requests fell (the upper bound of the
+ * histogram bucket), or 0 if none were recorded
+ */
+long stats_percentile(const stats_totals* totals, int outcome, double q);
+
+#endif /* PROXY_STATS_H */
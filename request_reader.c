@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include "request_reader.h"
+#include "proxy_parse.h"
+#include "cache_slab.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define READER_MAX_CAP (MAX_REQ_LEN + 1) // Largest header block plus its terminating NUL
+
+// Buffers up to SLAB_MAX_CHUNK come from the slab allocator's per-thread
+// magazines, the rare larger ones from malloc
+static char* reader_alloc(int size, int* cap) {
+    size_t chunk = slab_chunk_size(size);
+    if (chunk) {
+        *cap = chunk;
+        return (char*)slab_alloc(size);
+    }
+    *cap = size;
+    return (char*)malloc(size);
+}
+
+static void reader_free(char* buf, int cap) {
+    if (cap <= SLAB_MAX_CHUNK) {
+        slab_free(buf);
+    } else {
+        free(buf);
+    }
+}
+
+// Make room for more bytes, returns -1 once the buffer is at its limit
+static int reader_grow(request_reader* reader) {
+    if (reader->buf && reader->len < reader->cap - 1) return 0;
+    if (reader->cap >= READER_MAX_CAP) return -1;
+
+    int size = reader->buf ? reader->cap * 2 : REQUEST_READER_INITIAL;
+    if (size > READER_MAX_CAP) size = READER_MAX_CAP;
+    int cap;
+    char* buf = reader_alloc(size, &cap);
+    if (!buf) return -1;
+
+    if (reader->buf) {
+        memcpy(buf, reader->buf, reader->len);
+        reader_free(reader->buf, reader->cap);
+    }
+    buf[reader->len] = '\0';
+    reader->buf = buf;
+    reader->cap = cap;
+    return 0;
+}
+
+// Look for the end of the header block in the bytes not scanned yet
+static int reader_scan(request_reader* reader) {
+    if (reader->len > reader->scanned) {
+        char* header_end = memmem(reader->buf + reader->scanned, reader->len - reader->scanned, "\r\n\r\n", 4);
+        if (header_end) {
+            reader->request_len = header_end - reader->buf + 4;
+            return reader->request_len;
+        }
+    }
+    reader->scanned = reader->len > 3 ? reader->len - 3 : 0;
+    return 0;
+}
+
+void request_reader_init(request_reader* reader) {
+    memset(reader, 0, sizeof(*reader));
+}
+
+int request_reader_read(request_reader* reader, int fd) {
+    // Bytes left over from a previous request may already complete this one
+    if (reader->request_len || reader_scan(reader)) {
+        return reader->request_len;
+    }
+
+    while (1) {
+        if (reader_grow(reader) < 0) {
+            return reader->len >= MAX_REQ_LEN ? REQUEST_READER_TOO_LARGE : REQUEST_READER_CLOSED;
+        }
+
+        ssize_t received = recv(fd, reader->buf + reader->len, reader->cap - 1 - reader->len, 0);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return REQUEST_READER_AGAIN;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return REQUEST_READER_CLOSED;
+        }
+
+        reader->len += received;
+        reader->buf[reader->len] = '\0';
+        if (reader_scan(reader)) {
+            return reader->request_len;
+        }
+    }
+}
+
+void request_reader_next(request_reader* reader) {
+    int remaining = reader->len - reader->request_len;
+    if (remaining <= 0) {
+        request_reader_release(reader);
+        return;
+    }
+
+    memmove(reader->buf, reader->buf + reader->request_len, remaining);
+    reader->buf[remaining] = '\0';
+    reader->len = remaining;
+    reader->scanned = 0;
+    reader->request_len = 0;
+}
+
+void request_reader_release(request_reader* reader) {
+    if (reader->buf) {
+        reader_free(reader->buf, reader->cap);
+    }
+    request_reader_init(reader);
+}
@@ -0,0 +1,55 @@
+#ifndef REQUEST_READER_H
+#define REQUEST_READER_H
+
+/*
+ * Incremental client request reader
+ *
+ * Accumulates a request header block from a socket across any number of
+ * partial reads. Each read only scans the newly received bytes (plus three
+ * for a terminator split between reads), so a header block arriving in
+ * many small pieces costs linear rather than quadratic time. The buffer
+ * starts at one small slab chunk and doubles as needed, up to MAX_REQ_LEN;
+ * idle persistent connections hold no buffer at all. Bytes received past
+ * the end of a request stay buffered for the next (pipelined) one.
+ */
+
+#define REQUEST_READER_INITIAL 4096     // First buffer size, most requests fit
+
+// request_reader_read() results other than a header block length
+#define REQUEST_READER_AGAIN      0     // Incomplete, nothing more to read for now
+#define REQUEST_READER_CLOSED    -1     // Peer closed or the socket failed
+#define REQUEST_READER_TOO_LARGE -2     // No end of the header block within MAX_REQ_LEN
+
+typedef struct request_reader {
+    char* buf;                          // NUL-terminated bytes received, NULL when empty
+    int cap;                            // Bytes allocated for buf
+    int len;                            // Bytes buffered
+    int scanned;                        // Leading bytes known not to end the header block
+    int request_len;                    // Length of the complete header block, 0 while incomplete
+} request_reader;
+
+/*
+ * request_reader_init() prepares an empty reader
+ */
+void request_reader_init(request_reader* reader);
+
+/*
+ * request_reader_read() receives from the (non-blocking) socket fd until a
+ * complete header block is buffered or the socket has nothing more to
+ * give. Returns the header block length once complete (without reading
+ * further), or one of REQUEST_READER_AGAIN, _CLOSED or _TOO_LARGE.
+ */
+int request_reader_read(request_reader* reader, int fd);
+
+/*
+ * request_reader_next() drops the current request from the buffer,
+ * keeping any bytes received after it
+ */
+void request_reader_next(request_reader* reader);
+
+/*
+ * request_reader_release() frees the buffer and empties the reader
+ */
+void request_reader_release(request_reader* reader);
+
+#endif /* REQUEST_READER_H */
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "resolver.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#define RESOLVER_BUCKETS 1024       // Hash buckets for the cache (power of two)
+#define RESOLVER_MAX_ENTRIES 4096   // Hostnames kept in the cache
+#define RESOLVER_MIN_TTL 1          // Seconds, so TTL 0 records do not defeat the cache
+#define RESOLVER_MAX_TTL 3600       // Seconds, upper bound on any record TTL
+#define RESOLVER_DEFAULT_TTL 60     // Seconds, for answers without a TTL (getaddrinfo)
+#define RESOLVER_NEGATIVE_TTL 10    // Seconds a failed lookup is cached
+#define RESOLVER_PREFETCH_PERCENT 10 // Refresh once less than this share of the TTL remains
+
+// A pending entry is being resolved for the first time (or again after it
+// expired); a ready one holds an answer until `expires`
+enum { ENTRY_PENDING, ENTRY_READY };
+
+typedef struct resolver_waiter {
+    resolver_callback done;
+    void* arg;
+    struct resolver_waiter* next;
+} resolver_waiter;
+
+typedef struct resolver_entry {
+    char* host;
+    uint64_t hash;
+    int state;
+    int refreshing;                 // Background refresh queued or running
+    int negative;                   // Cached failure
+    time_t expires;
+    int ttl;
+    resolver_addrs addrs;
+    resolver_waiter* waiters;       // Async callers waiting for the answer
+    struct resolver_entry* next;    // Next entry in the same bucket
+} resolver_entry;
+
+// Lookups queued for the resolver threads
+typedef struct resolver_job {
+    resolver_entry* entry;
+    struct resolver_job* next;
+} resolver_job;
+
+static struct {
+    resolver_entry* buckets[RESOLVER_BUCKETS];
+    int count;
+    resolver_job* jobs_head;
+    resolver_job* jobs_tail;
+    long hits;
+    long misses;
+    long negative_hits;
+    long prefetches;
+    pthread_mutex_t mutex;          // Protects everything above
+    pthread_cond_t job_ready;       // Signalled when a job is queued
+    pthread_cond_t resolved;        // Broadcast when any lookup completes
+} resolver = { .mutex = PTHREAD_MUTEX_INITIALIZER,
+               .job_ready = PTHREAD_COND_INITIALIZER,
+               .resolved = PTHREAD_COND_INITIALIZER };
+
+static uint64_t resolver_hash(const char* host) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* p = host; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Numeric addresses never reach the cache
+static int resolver_numeric(const char* host, resolver_addrs* addrs) {
+    struct sockaddr_in* in4 = (struct sockaddr_in*)&addrs->addrs[0];
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addrs->addrs[0];
+
+    memset(&addrs->addrs[0], 0, sizeof(addrs->addrs[0]));
+    if (inet_pton(AF_INET, host, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        addrs->lens[0] = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        addrs->lens[0] = sizeof(struct sockaddr_in6);
+    } else {
+        return 0;
+    }
+    addrs->count = 1;
+    return 1;
+}
+
+static resolver_entry* resolver_find(const char* host, uint64_t hash) {
+    for (resolver_entry* entry = resolver.buckets[hash & (RESOLVER_BUCKETS - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Returns -1 if out of memory, the entry is then not resolved
+static int resolver_queue(resolver_entry* entry) {
+    resolver_job* job = (resolver_job*)malloc(sizeof(resolver_job));
+    if (!job) return -1;
+    job->entry = entry;
+    job->next = NULL;
+    if (resolver.jobs_tail) {
+        resolver.jobs_tail->next = job;
+    } else {
+        resolver.jobs_head = job;
+    }
+    resolver.jobs_tail = job;
+    pthread_cond_signal(&resolver.job_ready);
+    return 0;
+}
+
+// Make room by dropping expired entries, then any others, skipping
+// entries a resolver thread is still working on
+static void resolver_evict(time_t now) {
+    for (int pass = 0; pass < 2 && resolver.count >= RESOLVER_MAX_ENTRIES; pass++) {
+        for (int i = 0; i < RESOLVER_BUCKETS && resolver.count >= RESOLVER_MAX_ENTRIES; i++) {
+            resolver_entry** link = &resolver.buckets[i];
+            while (*link) {
+                resolver_entry* entry = *link;
+                int busy = entry->state == ENTRY_PENDING || entry->refreshing;
+                if (!busy && (pass == 1 || entry->expires <= now)) {
+                    *link = entry->next;
+                    free(entry->host);
+                    free(entry);
+                    resolver.count--;
+                } else {
+                    link = &entry->next;
+                }
+            }
+        }
+    }
+}
+
+// Cache lookup shared by both entry points (caller holds the lock).
+// Returns RESOLVER_OK or RESOLVER_FAILED for a cached answer, or
+// RESOLVER_PENDING with *pending set to the entry being resolved.
+static int resolver_lookup_locked(const char* host, uint64_t hash, resolver_addrs* addrs, resolver_entry** pending) {
+    time_t now = time(NULL);
+    resolver_entry* entry = resolver_find(host, hash);
+
+    if (entry && entry->state == ENTRY_READY && entry->expires > now) {
+        if (entry->negative) {
+            resolver.negative_hits++;
+            return RESOLVER_FAILED;
+        }
+        resolver.hits++;
+        *addrs = entry->addrs;
+
+        // About to expire: refresh in the background while still serving it
+        time_t remaining = entry->expires - now;
+        if (!entry->refreshing &&
+            (remaining <= 1 || remaining * 100 <= (time_t)entry->ttl * RESOLVER_PREFETCH_PERCENT)) {
+            entry->refreshing = 1;
+            resolver.prefetches++;
+            if (resolver_queue(entry) < 0) entry->refreshing = 0;
+        }
+        return RESOLVER_OK;
+    }
+
+    if (!entry) {
+        if (resolver.count >= RESOLVER_MAX_ENTRIES) {
+            resolver_evict(now);
+        }
+        entry = (resolver_entry*)calloc(1, sizeof(resolver_entry));
+        if (entry) entry->host = strdup(host);
+        if (!entry || !entry->host) {
+            free(entry);
+            return RESOLVER_FAILED;
+        }
+        entry->hash = hash;
+        entry->state = ENTRY_PENDING;
+        // Nobody waits on it yet, so a lookup that cannot be queued just
+        // fails instead of leaving the entry pending forever
+        if (resolver_queue(entry) < 0) {
+            free(entry->host);
+            free(entry);
+            return RESOLVER_FAILED;
+        }
+        entry->next = resolver.buckets[hash & (RESOLVER_BUCKETS - 1)];
+        resolver.buckets[hash & (RESOLVER_BUCKETS - 1)] = entry;
+        resolver.count++;
+        resolver.misses++;
+    } else if (entry->state == ENTRY_READY) {
+        // Expired: resolve again, unless a refresh is already on its way
+        if (!entry->refreshing && resolver_queue(entry) < 0) {
+            return RESOLVER_FAILED;
+        }
+        entry->state = ENTRY_PENDING;
+        resolver.misses++;
+    }
+    *pending = entry;
+    return RESOLVER_PENDING;
+}
+
+int resolver_lookup(const char* host, resolver_addrs* addrs) {
+    if (resolver_numeric(host, addrs)) return RESOLVER_OK;
+
+    uint64_t hash = resolver_hash(host);
+    resolver_entry* pending;
+    int status;
+
+    pthread_mutex_lock(&resolver.mutex);
+    while ((status = resolver_lookup_locked(host, hash, addrs, &pending)) == RESOLVER_PENDING) {
+        // Entries are looked up again after waking, as they may be evicted
+        pthread_cond_wait(&resolver.resolved, &resolver.mutex);
+    }
+    pthread_mutex_unlock(&resolver.mutex);
+    return status;
+}
+
+int resolver_lookup_async(const char* host, resolver_addrs* addrs, resolver_callback done, void* arg) {
+    if (resolver_numeric(host, addrs)) return RESOLVER_OK;
+
+    uint64_t hash = resolver_hash(host);
+    resolver_entry* pending;
+    resolver_waiter* waiter = (resolver_waiter*)malloc(sizeof(resolver_waiter));
+    if (!waiter) return RESOLVER_FAILED;
+
+    pthread_mutex_lock(&resolver.mutex);
+    int status = resolver_lookup_locked(host, hash, addrs, &pending);
+    if (status == RESOLVER_PENDING) {
+        waiter->done = done;
+        waiter->arg = arg;
+        waiter->next = pending->waiters;
+        pending->waiters = waiter;
+        waiter = NULL;
+    }
+    pthread_mutex_unlock(&resolver.mutex);
+
+    free(waiter);
+    return status;
+}
+
+void resolver_set_port(struct sockaddr_storage* addr, int port) {
+    if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    }
+}
+
+void resolver_stats(long* hits, long* misses, long* negative_hits, long* prefetches) {
+    pthread_mutex_lock(&resolver.mutex);
+    *hits = resolver.hits;
+    *misses = resolver.misses;
+    *negative_hits = resolver.negative_hits;
+    *prefetches = resolver.prefetches;
+    pthread_mutex_unlock(&resolver.mutex);
+}
+
+// Query one record type, appending addresses and lowering *ttl to the
+// smallest record TTL seen. Returns the number of addresses found.
+static int resolver_query_type(res_state res, const char* host, int type, struct sockaddr_storage* out,
+                               int max, int* ttl) {
+    unsigned char answer[4096];
+    int len = res_nquery(res, host, ns_c_in, type, answer, sizeof(answer));
+    if (len < 0) return 0;
+
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) < 0) return 0;
+
+    int found = 0;
+    int records = ns_msg_count(msg, ns_s_an);
+    for (int i = 0; i < records && found < max; i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+        if ((int)ns_rr_type(rr) != type) continue; // CNAMEs on the way
+
+        memset(&out[found], 0, sizeof(out[found]));
+        if (type == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            struct sockaddr_in* in4 = (struct sockaddr_in*)&out[found];
+            in4->sin_family = AF_INET;
+            memcpy(&in4->sin_addr, ns_rr_rdata(rr), 4);
+        } else if (type == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            struct sockaddr_in6* in6 = (struct sockaddr_in6*)&out[found];
+            in6->sin6_family = AF_INET6;
+            memcpy(&in6->sin6_addr, ns_rr_rdata(rr), 16);
+        } else {
+            continue;
+        }
+        if ((int)ns_rr_ttl(rr) < *ttl) *ttl = ns_rr_ttl(rr);
+        found++;
+    }
+    return found;
+}
+
+// Interleave IPv6 and IPv4 addresses, IPv6 first (RFC 8305)
+static void resolver_interleave(resolver_addrs* addrs, struct sockaddr_storage* v6, int n6,
+                                struct sockaddr_storage* v4, int n4) {
+    int i6 = 0, i4 = 0;
+    addrs->count = 0;
+    while (addrs->count < RESOLVER_MAX_ADDRS && (i6 < n6 || i4 < n4)) {
+        if (i6 < n6 && (addrs->count % 2 == 0 || i4 == n4)) {
+            addrs->addrs[addrs->count] = v6[i6++];
+            addrs->lens[addrs->count] = sizeof(struct sockaddr_in6);
+        } else {
+            addrs->addrs[addrs->count] = v4[i4++];
+            addrs->lens[addrs->count] = sizeof(struct sockaddr_in);
+        }
+        addrs->count++;
+    }
+}
+
+// Resolve a hostname, returns 0 on success with *ttl set
+static int resolver_resolve(const char* host, resolver_addrs* addrs, int* ttl) {
+    static __thread struct __res_state res;
+    static __thread int res_ready;
+    struct sockaddr_storage v6[RESOLVER_MAX_ADDRS], v4[RESOLVER_MAX_ADDRS];
+    int n6 = 0, n4 = 0;
+
+    *ttl = RESOLVER_MAX_TTL;
+    if (!res_ready && res_ninit(&res) == 0) {
+        res_ready = 1;
+    }
+    if (res_ready) {
+        n6 = resolver_query_type(&res, host, ns_t_aaaa, v6, RESOLVER_MAX_ADDRS, ttl);
+        n4 = resolver_query_type(&res, host, ns_t_a, v4, RESOLVER_MAX_ADDRS, ttl);
+    }
+
+    if (n6 + n4 == 0) {
+        // Not answered by DNS: let the system resolver try (hosts file, NSS)
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+            return -1;
+        }
+        for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+            if (ai->ai_family == AF_INET6 && n6 < RESOLVER_MAX_ADDRS) {
+                memset(&v6[n6], 0, sizeof(v6[n6]));
+                memcpy(&v6[n6++], ai->ai_addr, ai->ai_addrlen);
+            } else if (ai->ai_family == AF_INET && n4 < RESOLVER_MAX_ADDRS) {
+                memset(&v4[n4], 0, sizeof(v4[n4]));
+                memcpy(&v4[n4++], ai->ai_addr, ai->ai_addrlen);
+            }
+        }
+        freeaddrinfo(result);
+        if (n6 + n4 == 0) return -1;
+        *ttl = RESOLVER_DEFAULT_TTL;
+    }
+
+    if (*ttl < RESOLVER_MIN_TTL) *ttl = RESOLVER_MIN_TTL;
+    resolver_interleave(addrs, v6, n6, v4, n4);
+    return 0;
+}
+
+static void* resolver_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&resolver.mutex);
+        while (!resolver.jobs_head) {
+            pthread_cond_wait(&resolver.job_ready, &resolver.mutex);
+        }
+        resolver_job* job = resolver.jobs_head;
+        resolver.jobs_head = job->next;
+        if (!resolver.jobs_head) resolver.jobs_tail = NULL;
+        resolver_entry* entry = job->entry;
+        pthread_mutex_unlock(&resolver.mutex);
+        free(job);
+
+        // The entry cannot be evicted while pending or refreshing, and its
+        // host never changes, so it is safe to read without the lock
+        resolver_addrs addrs;
+        int ttl;
+        int ok = resolver_resolve(entry->host, &addrs, &ttl) == 0;
+
+        pthread_mutex_lock(&resolver.mutex);
+        time_t now = time(NULL);
+        if (ok) {
+            entry->addrs = addrs;
+            entry->negative = 0;
+            entry->ttl = ttl;
+            entry->expires = now + ttl;
+        } else if (entry->state == ENTRY_PENDING) {
+            entry->negative = 1;
+            entry->ttl = RESOLVER_NEGATIVE_TTL;
+            entry->expires = now + RESOLVER_NEGATIVE_TTL;
+        }
+        // A failed refresh keeps serving the current answer until it expires
+        entry->state = ENTRY_READY;
+        entry->refreshing = 0;
+        resolver_waiter* waiters = entry->waiters;
+        entry->waiters = NULL;
+        pthread_cond_broadcast(&resolver.resolved);
+        pthread_mutex_unlock(&resolver.mutex);
+
+        while (waiters) {
+            resolver_waiter* next = waiters->next;
+            waiters->done(waiters->arg);
+            free(waiters);
+            waiters = next;
+        }
+    }
+    return NULL;
+}
+
+void resolver_init() {
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_thread, NULL) != 0) {
+            perror("pthread_create failed");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+
+/*
+ * Caching hostname resolver
+ *
+ * Lookups are answered from an in-process cache keyed by hostname. Misses
+ * are resolved by a small pool of resolver threads: A and AAAA records are
+ * queried directly so their TTLs can be honored, falling back to
+ * getaddrinfo() (with a default TTL) for names DNS does not answer, such as
+ * /etc/hosts entries. Failures are cached for a short time, and entries
+ * close to expiry are refreshed in the background while the current
+ * addresses keep being served.
+ */
+
+#define RESOLVER_MAX_ADDRS 8        // Addresses kept per hostname
+#define RESOLVER_THREADS 4          // Resolver pool threads
+
+// resolver_lookup_async() results
+#define RESOLVER_OK       0         // Addresses copied out
+#define RESOLVER_FAILED  -1         // Name does not resolve (possibly a cached failure)
+#define RESOLVER_PENDING  1         // Lookup in progress, the callback will fire
+
+/*
+ * Addresses of one hostname, IPv6 and IPv4 interleaved (IPv6 first) so a
+ * happy-eyeballs connect alternates families. Ports are left at 0, see
+ * resolver_set_port().
+ */
+typedef struct resolver_addrs {
+    int count;
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    socklen_t lens[RESOLVER_MAX_ADDRS];
+} resolver_addrs;
+
+typedef void (*resolver_callback)(void* arg);
+
+/*
+ * resolver_init() starts the resolver threads
+ */
+void resolver_init();
+
+/*
+ * resolver_lookup() resolves host, blocking the calling thread while a
+ * lookup is in progress. Returns RESOLVER_OK or RESOLVER_FAILED.
+ */
+int resolver_lookup(const char* host, resolver_addrs* addrs);
+
+/*
+ * resolver_lookup_async() answers from the cache without blocking. On a
+ * miss it returns RESOLVER_PENDING and done(arg) is called from a resolver
+ * thread once an answer is cached; call resolver_lookup_async() again then
+ * to collect it.
+ */
+int resolver_lookup_async(const char* host, resolver_addrs* addrs, resolver_callback done, void* arg);
+
+/*
+ * resolver_set_port() sets the port of a resolved address
+ */
+void resolver_set_port(struct sockaddr_storage* addr, int port);
+
+/*
+ * resolver_stats() reports cache hits, misses (lookups that had to wait),
+ * cached failures served and background refreshes started
+ */
+void resolver_stats(long* hits, long* misses, long* negative_hits, long* prefetches);
+
+#endif /* RESOLVER_H */
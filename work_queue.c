@@ -0,0 +1,132 @@
+#include "work_queue.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int work_queue_init(work_queue* queue, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    queue->cells = (work_cell*)calloc(size, sizeof(work_cell));
+    if (!queue->cells) return -1;
+    for (size_t i = 0; i < size; i++) {
+        queue->cells[i].sequence = i;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->sleepers = 0;
+    pthread_mutex_init(&queue->park_mutex, NULL);
+    pthread_cond_init(&queue->park_cond, NULL);
+    return 0;
+}
+
+void work_queue_destroy(work_queue* queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+    pthread_mutex_destroy(&queue->park_mutex);
+    pthread_cond_destroy(&queue->park_cond);
+}
+
+int work_queue_push(work_queue* queue, const work_item* item) {
+    work_cell* cell;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            // The cell is free for this lap, claim the position
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;              // Still holds the item from the previous lap
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = *item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in work_queue_wait(): either a parking consumer
+    // sees the item or we see the consumer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&queue->park_mutex);
+        pthread_cond_signal(&queue->park_cond);
+        pthread_mutex_unlock(&queue->park_mutex);
+    }
+    return 0;
+}
+
+int work_queue_pop(work_queue* queue, work_item* item) {
+    work_cell* cell;
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;              // Not written yet
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    *item = cell->item;
+    // Free the cell for the producer of the next lap
+    __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int work_queue_wait(work_queue* queue, work_item* item, int timeout_ms) {
+    for (int spin = 0; spin < WORK_QUEUE_SPINS; spin++) {
+        if (work_queue_pop(queue, item) == 0) return 0;
+        cpu_relax();
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&queue->park_mutex);
+    __atomic_add_fetch(&queue->sleepers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int result = work_queue_pop(queue, item);
+    if (result < 0) {
+        pthread_cond_timedwait(&queue->park_cond, &queue->park_mutex, &deadline);
+    }
+    __atomic_sub_fetch(&queue->sleepers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->park_mutex);
+
+    return result == 0 ? 0 : work_queue_pop(queue, item);
+}
+
+void work_queue_wake_all(work_queue* queue) {
+    pthread_mutex_lock(&queue->park_mutex);
+    pthread_cond_broadcast(&queue->park_cond);
+    pthread_mutex_unlock(&queue->park_mutex);
+}
+
+size_t work_queue_size(work_queue* queue) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,90 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+/*
+ * Lock-free bounded work queue
+ *
+ * A multi-producer multi-consumer ring buffer (Vyukov's algorithm): every
+ * cell carries a sequence number that tells producers and consumers whose
+ * turn it is, so a push or pop is a single compare-and-swap on the tail
+ * or head position plus a copy of the item, which is stored inline. No
+ * allocation happens per item.
+ *
+ * Consumers that find the queue empty spin for a short while before they
+ * park on a condition variable. Producers only touch the condition
+ * variable when someone is parked, so under load a handoff never enters
+ * the kernel.
+ */
+
+#define WORK_QUEUE_SPINS 2000           // Empty polls before a waiting consumer parks
+#define WORK_QUEUE_CACHE_LINE 64
+
+// Accepted client connection waiting for a worker
+typedef struct work_item {
+    int client_socket;
+    struct sockaddr_in client_addr;
+    struct timeval queued_at;           // When the acceptor queued it
+} work_item;
+
+typedef struct work_cell {
+    size_t sequence;                    // (atomic)
+    work_item item;
+} work_cell;
+
+typedef struct work_queue {
+    work_cell* cells;
+    size_t mask;                        // Capacity - 1, capacity is a power of two
+    size_t head __attribute__((aligned(WORK_QUEUE_CACHE_LINE))); // Next position to pop (atomic)
+    size_t tail __attribute__((aligned(WORK_QUEUE_CACHE_LINE))); // Next position to push (atomic)
+    int sleepers __attribute__((aligned(WORK_QUEUE_CACHE_LINE))); // Parked consumers (atomic)
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+} work_queue;
+
+/*
+ * work_queue_init() sets up a queue holding at least capacity items
+ * (rounded up to a power of two). Returns -1 if out of memory.
+ */
+int work_queue_init(work_queue* queue, size_t capacity);
+
+/*
+ * work_queue_destroy() frees the queue's storage; it must not be in use
+ */
+void work_queue_destroy(work_queue* queue);
+
+/*
+ * work_queue_push() appends a copy of item and wakes a parked consumer if
+ * there is one. Returns -1 if the queue is full.
+ */
+int work_queue_push(work_queue* queue, const work_item* item);
+
+/*
+ * work_queue_pop() takes the oldest item without waiting. Returns -1 if
+ * the queue is empty.
+ */
+int work_queue_pop(work_queue* queue, work_item* item);
+
+/*
+ * work_queue_wait() takes the oldest item, spinning and then parking for
+ * up to timeout_ms while the queue is empty. Returns -1 if nothing
+ * arrived in time or work_queue_wake_all() was called.
+ */
+int work_queue_wait(work_queue* queue, work_item* item, int timeout_ms);
+
+/*
+ * work_queue_wake_all() wakes every parked consumer, e.g. for shutdown
+ */
+void work_queue_wake_all(work_queue* queue);
+
+/*
+ * work_queue_size() returns the number of queued items; the value may be
+ * stale by the time it is used
+ */
+size_t work_queue_size(work_queue* queue);
+
+#endif /* WORK_QUEUE_H */